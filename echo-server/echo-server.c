@@ -8,14 +8,20 @@ telnet 127.0.0.1 8080
 
 void echo(int connectFd) {
   ssize_t nBytes;
-  char buffer[MAXLINE];
-  rio_t rio;
+  char *line; /* Points into the ring: echoed without being copied out first */
+  rio_ring_t rio;
 
-  Rio_readinitb(&rio, connectFd);
-  while ((nBytes = Rio_readlineb(&rio, buffer, MAXLINE)) != 0) {
+  rio_ringinitb(&rio, connectFd);
+  while ((nBytes = Rio_ringlineb(&rio, &line)) != 0) {
+    if (nBytes == -2) { /* Longer than the ring can grow: echo what is buffered and keep going */
+      line = rio_ringpullupb(&rio, rio.rio_cnt);
+      nBytes = (ssize_t)rio.rio_cnt;
+      rio_ringconsumeb(&rio, rio.rio_cnt);
+    }
     printf("server received %zd bytes\n", nBytes);
-    Rio_writen(connectFd, buffer, (size_t)nBytes);
+    Rio_writen(connectFd, line, (size_t)nBytes);
   }
+  rio_ringfreeb(&rio);
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,446 @@
+/*
+ * load-gen - Drives requests at the proxy, tiny or echo-server over
+ *   many concurrent connections and reports throughput and an HDR-style
+ *   latency histogram.
+ *
+ *   make load-gen
+ *   ./load-gen [-c connections] [-t threads] [-d seconds] [-r requests/sec]
+ *              [-x proxy host:port] [-e line bytes] <http://host:port/path | host:port>
+ *
+ *   Closed loop (default): every connection sends its next request as soon
+ *   as the last response ends. Open loop (-r): requests are due at a fixed
+ *   rate and their latency runs from when they were due, so a server that
+ *   stalls is charged for the queue it builds instead of slowing the load.
+ *   -x sends absolute-URI requests through a proxy; -e sends lines of the
+ *   given size to echo-server and waits for each to come back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include "../csapp.h"
+#include "../response/response.h"
+
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_SECONDS 10
+#define MAX_EVENTS 64
+#define READ_SIZE 65536 /* Body bytes are counted and dropped: one scratch buffer per thread */
+#define DRAIN_NS 2000000000LL /* After the run, how long responses still in flight may take */
+
+/* Log-linear buckets: exact below HISTOGRAM_SUB_BUCKETS, then 32 steps per power of two (within ~3%) */
+#define HISTOGRAM_SUB_BUCKETS 64
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + 58 * (HISTOGRAM_SUB_BUCKETS / 2))
+
+/* Where a connection's current request stands */
+#define CONN_IDLE 0 /* No request: waiting to be handed one */
+#define CONN_CONNECTING 1
+#define CONN_SENDING 2
+#define CONN_RECEIVING 3
+
+typedef struct {
+  unsigned long long counts[HISTOGRAM_BUCKETS];
+  unsigned long long total, min, max;
+  double sum;
+} histogram; /* Nanoseconds */
+
+typedef struct {
+  int fd; /* -1 between requests when the server closed the last one */
+  int state;
+  size_t sent;
+  long long startNs; /* When the request was due (open loop) or sent (closed loop) */
+  char head[MAXBUF]; /* Response head, until the blank line */
+  size_t headSize;
+  int isHeadDone;
+  responseHead response;
+  bodyFramer framer;
+  size_t echoReceived;
+} loadConnection;
+
+typedef struct {
+  pthread_t thread;
+  int connectionCount;
+  loadConnection *connections;
+  int *idle; /* Stack of idle connection indexes */
+  int idleCount;
+  long long intervalNs; /* Open loop: time between this thread's requests; 0 for closed loop */
+  unsigned long long dispatched, unsent;
+  long long endNs; /* When its last response came in */
+  unsigned long long requests, bytes, connectErrors, readErrors, statusErrors;
+  histogram latency;
+  char scratch[READ_SIZE];
+} loadWorker;
+
+/* Shared by every worker, fixed before they start */
+static struct sockaddr_storage targetAddress;
+static socklen_t targetAddressLength;
+static char *request; /* HTTP request or echo line */
+static size_t requestSize;
+static int isEcho;
+static long long startNs, deadlineNs;
+
+static int parseTarget(const char *target, char *hostname, char *port, char *path);
+static int resolveAddress(const char *hostname, const char *port);
+static void *runWorker(void *pArgument);
+static void startRequest(loadWorker *pWorker, int epfd, int index, long long dueNs);
+static void driveConnection(loadWorker *pWorker, int epfd, int index);
+static int receiveResponse(loadWorker *pWorker, loadConnection *pConnection);
+static int scanHead(loadConnection *pConnection, const char *data, size_t size, size_t *pBodyOffset);
+static void finishRequest(loadWorker *pWorker, int index, int isReusable);
+static void failRequest(loadWorker *pWorker, int index, unsigned long long *pCounter);
+static void closeConnection(loadConnection *pConnection);
+static long long nowNs(void);
+static void histogramRecord(histogram *pHistogram, unsigned long long value);
+static void histogramMerge(histogram *pTotal, const histogram *pPart);
+static unsigned long long histogramPercentile(const histogram *pHistogram, double percentile);
+static int histogramIndex(unsigned long long value);
+static unsigned long long histogramValue(int index);
+
+int main(int argc, char **argv) {
+  int connectionCount = DEFAULT_CONNECTIONS, threadCount = 1, seconds = DEFAULT_SECONDS, option;
+  double rate = 0;
+  long echoSize = 0;
+  char *proxy = NULL;
+  char hostname[MAXLINE], port[16], path[MAXLINE];
+
+  while((option = getopt(argc, argv, "c:t:d:r:x:e:")) != -1) {
+    switch(option) {
+      case 'c': connectionCount = atoi(optarg); break;
+      case 't': threadCount = atoi(optarg); break;
+      case 'd': seconds = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'x': proxy = optarg; break;
+      case 'e': isEcho = 1; echoSize = atol(optarg); break;
+      default: optind = argc + 1;
+    }
+  }
+  if(optind != argc - 1 || connectionCount <= 0 || threadCount <= 0 || seconds <= 0 || rate < 0 || (isEcho && (echoSize < 1 || proxy != NULL))
+    || parseTarget(argv[optind], hostname, port, path) < 0) {
+    fprintf(stderr, "usage: %s [-c connections] [-t threads] [-d seconds] [-r requests/sec] [-x proxy host:port] [-e line bytes] <http://host:port/path | host:port>\n", argv[0]);
+    return 1;
+  }
+  if(threadCount > connectionCount) threadCount = connectionCount;
+
+  /* Build The One Request Every Connection Repeats */
+  if(isEcho) {
+    requestSize = echoSize;
+    request = Malloc(requestSize);
+    memset(request, 'x', requestSize - 1);
+    request[requestSize - 1] = '\n'; /* echo-server answers line by line */
+  }
+  else {
+    request = Malloc(3 * MAXLINE);
+    if(proxy != NULL) requestSize = snprintf(request, 3 * MAXLINE, "GET http://%s:%s%s HTTP/1.1\r\nHost: %s:%s\r\n\r\n", hostname, port, path, hostname, port);
+    else requestSize = snprintf(request, 3 * MAXLINE, "GET %s HTTP/1.1\r\nHost: %s:%s\r\n\r\n", path, hostname, port);
+  }
+  if(proxy != NULL) { /* Connect to the proxy instead; the request still names the origin */
+    char proxyTarget[MAXLINE];
+    snprintf(proxyTarget, sizeof(proxyTarget), "%s", proxy);
+    if(parseTarget(proxyTarget, hostname, port, path) < 0) {
+      fprintf(stderr, "%s: bad proxy address %s\n", argv[0], proxy);
+      return 1;
+    }
+  }
+  if(resolveAddress(hostname, port) < 0) {
+    fprintf(stderr, "%s: cannot resolve %s:%s\n", argv[0], hostname, port);
+    return 1;
+  }
+
+  /* Split Connections And Rate Across Workers */
+  loadWorker *workers = Calloc(threadCount, sizeof(loadWorker));
+  startNs = nowNs();
+  deadlineNs = startNs + seconds * 1000000000LL;
+  for(int i = 0; i < threadCount; i++) {
+    loadWorker *pWorker = &workers[i];
+    pWorker->connectionCount = connectionCount / threadCount + (i < connectionCount % threadCount);
+    pWorker->intervalNs = (rate > 0) ? (long long)(1e9 * threadCount / rate) : 0;
+    pWorker->latency.min = ~0ULL;
+    Pthread_create(&pWorker->thread, NULL, runWorker, pWorker);
+  }
+
+  /* Report */
+  loadWorker total;
+  memset(&total, 0, sizeof(total));
+  total.latency.min = ~0ULL;
+  for(int i = 0; i < threadCount; i++) {
+    Pthread_join(workers[i].thread, NULL);
+    total.requests += workers[i].requests;
+    total.bytes += workers[i].bytes;
+    total.connectErrors += workers[i].connectErrors;
+    total.readErrors += workers[i].readErrors;
+    total.statusErrors += workers[i].statusErrors;
+    total.unsent += workers[i].unsent;
+    if(workers[i].endNs > total.endNs) total.endNs = workers[i].endNs;
+    histogramMerge(&total.latency, &workers[i].latency);
+  }
+  double elapsed = (total.endNs - startNs) / 1e9;
+  printf("%d connections, %d threads, %d s, %s loop", connectionCount, threadCount, seconds, (rate > 0) ? "open" : "closed");
+  if(rate > 0) printf(" at %.0f requests/s", rate);
+  printf(", %s%s\n", isEcho ? "echo " : "", argv[optind]);
+  printf("  Requests    %llu (%.1f/s)\n", total.requests, total.requests / elapsed);
+  printf("  Received    %llu bytes (%.2f MB/s)\n", total.bytes, total.bytes / elapsed / 1e6);
+  printf("  Errors      connect %llu, read %llu, status %llu\n", total.connectErrors, total.readErrors, total.statusErrors);
+  if(rate > 0) printf("  Unsent      %llu (due before the end, never sent)\n", total.unsent);
+  if(total.latency.total == 0) return 1;
+  printf("  Latency     min %.1f us, mean %.1f us, max %.1f us\n", total.latency.min / 1e3, total.latency.sum / total.latency.total / 1e3, total.latency.max / 1e3);
+  const double percentiles[] = { 50, 75, 90, 99, 99.9, 99.99, 100 };
+  for(size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+    printf("  %9.3f%% %12.1f us\n", percentiles[i], histogramPercentile(&total.latency, percentiles[i]) / 1e3);
+  }
+  return 0;
+}
+
+static int parseTarget(const char *target, char *hostname, char *port, char *path) {
+  /* "http://host[:port][/path]" or "host:port" */
+  if(!strncasecmp(target, "http://", 7)) target += 7;
+  const char *pPath = strchr(target, '/');
+  size_t authorityLength = (pPath != NULL) ? (size_t)(pPath - target) : strlen(target);
+  if(authorityLength == 0 || authorityLength >= MAXLINE) return -1;
+  memcpy(hostname, target, authorityLength);
+  hostname[authorityLength] = '\0';
+  snprintf(path, MAXLINE, "%s", (pPath != NULL) ? pPath : "/");
+  char *pColon = strrchr(hostname, ':');
+  if(pColon != NULL) {
+    *pColon = '\0';
+    if(strlen(pColon + 1) >= 16 || pColon[1] == '\0') return -1;
+    strcpy(port, pColon + 1);
+  }
+  else strcpy(port, "80");
+  return 0;
+}
+static int resolveAddress(const char *hostname, const char *port) {
+  struct addrinfo hints, *pList;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if(getaddrinfo(hostname, port, &hints, &pList) != 0) return -1;
+  memcpy(&targetAddress, pList->ai_addr, pList->ai_addrlen);
+  targetAddressLength = pList->ai_addrlen;
+  freeaddrinfo(pList);
+  return 0;
+}
+static void *runWorker(void *pArgument) {
+  loadWorker *pWorker = pArgument;
+  struct epoll_event events[MAX_EVENTS];
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(epfd < 0) unix_error("epoll_create1 error");
+
+  pWorker->connections = Calloc(pWorker->connectionCount, sizeof(loadConnection));
+  pWorker->idle = Calloc(pWorker->connectionCount, sizeof(int));
+  for(int i = 0; i < pWorker->connectionCount; i++) {
+    pWorker->connections[i].fd = -1;
+    pWorker->idle[pWorker->idleCount++] = i;
+  }
+
+  while(1) {
+    long long now = nowNs();
+    int timeout = 100;
+
+    /* Hand Out Requests; Past The Deadline, Only Let The Last Responses Finish */
+    if(now >= deadlineNs) { /* Aborting them would kill servers that exit on a broken pipe */
+      if(pWorker->idleCount == pWorker->connectionCount || now >= deadlineNs + DRAIN_NS) break;
+    }
+    else if(pWorker->intervalNs == 0) { /* Only the connections idle now: a failed request goes back on the stack */
+      for(int count = pWorker->idleCount; count > 0; count--) startRequest(pWorker, epfd, pWorker->idle[--pWorker->idleCount], now);
+    }
+    else {
+      unsigned long long due = (now - startNs) / pWorker->intervalNs + 1; /* Requests due so far, counting the one at start */
+      while(pWorker->dispatched < due && pWorker->idleCount > 0) { /* Late ones keep the time they were due */
+        startRequest(pWorker, epfd, pWorker->idle[--pWorker->idleCount], startNs + pWorker->dispatched * pWorker->intervalNs);
+        pWorker->dispatched++;
+      }
+      if(pWorker->dispatched >= due) timeout = (startNs + pWorker->dispatched * pWorker->intervalNs - now) / 1000000;
+    }
+    if(now < deadlineNs && timeout > (deadlineNs - now) / 1000000) timeout = (deadlineNs - now) / 1000000;
+
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if(n < 0 && errno != EINTR) unix_error("epoll_wait error");
+    for(int i = 0; i < n; i++) {
+      int index = events[i].data.u32;
+      if(pWorker->connections[index].state != CONN_IDLE) driveConnection(pWorker, epfd, index);
+    }
+  }
+  if(pWorker->intervalNs > 0) {
+    unsigned long long due = (deadlineNs - startNs - 1) / pWorker->intervalNs + 1;
+    if(due > pWorker->dispatched) pWorker->unsent = due - pWorker->dispatched;
+  }
+  pWorker->endNs = nowNs();
+  for(int i = 0; i < pWorker->connectionCount; i++) closeConnection(&pWorker->connections[i]);
+  close(epfd);
+  return NULL;
+}
+static void startRequest(loadWorker *pWorker, int epfd, int index, long long dueNs) {
+  loadConnection *pConnection = &pWorker->connections[index];
+  pConnection->startNs = dueNs;
+  pConnection->sent = 0;
+  pConnection->headSize = 0;
+  pConnection->isHeadDone = 0;
+  pConnection->echoReceived = 0;
+  pConnection->state = CONN_SENDING;
+  if(pConnection->fd < 0) { /* Connection setup is part of the request's latency */
+    int optval = 1;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u32 = index };
+    pConnection->fd = socket(targetAddress.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(pConnection->fd < 0) {
+      failRequest(pWorker, index, &pWorker->connectErrors);
+      return;
+    }
+    setsockopt(pConnection->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if(connect(pConnection->fd, (SA *)&targetAddress, targetAddressLength) < 0) {
+      if(errno != EINPROGRESS) {
+        failRequest(pWorker, index, &pWorker->connectErrors);
+        return;
+      }
+      pConnection->state = CONN_CONNECTING;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_ADD, pConnection->fd, &event);
+  }
+  driveConnection(pWorker, epfd, index);
+}
+static void driveConnection(loadWorker *pWorker, int epfd, int index) {
+  /* Edge-triggered: runs the request forward until the socket would block */
+  loadConnection *pConnection = &pWorker->connections[index];
+  if(pConnection->state == CONN_CONNECTING) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if(getsockopt(pConnection->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error == EINPROGRESS) return;
+    if(error != 0) {
+      failRequest(pWorker, index, &pWorker->connectErrors);
+      return;
+    }
+    pConnection->state = CONN_SENDING;
+  }
+  if(pConnection->state == CONN_SENDING) {
+    while(pConnection->sent < requestSize) {
+      ssize_t n = send(pConnection->fd, request + pConnection->sent, requestSize - pConnection->sent, MSG_NOSIGNAL);
+      if(n > 0) pConnection->sent += n;
+      else if(n < 0 && errno == EINTR) continue;
+      else if(n < 0 && errno == EAGAIN) return;
+      else {
+        failRequest(pWorker, index, &pWorker->readErrors);
+        return;
+      }
+    }
+    pConnection->state = CONN_RECEIVING;
+  }
+  int status = receiveResponse(pWorker, pConnection);
+  if(status == 1) finishRequest(pWorker, index, 1);
+  else if(status == 2) finishRequest(pWorker, index, 0);
+  else if(status < 0) failRequest(pWorker, index, &pWorker->readErrors);
+}
+static int receiveResponse(loadWorker *pWorker, loadConnection *pConnection) {
+  /* 0: would block, 1: done and reusable, 2: done by the server closing, -1: failed */
+  while(1) {
+    ssize_t n = read(pConnection->fd, pWorker->scratch, READ_SIZE);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return (errno == EAGAIN) ? 0 : -1;
+    if(n == 0) { /* Only a body that runs until close may end here */
+      if(!isEcho && pConnection->isHeadDone && pConnection->framer.mode == BODY_UNTIL_CLOSE) return 2;
+      return -1;
+    }
+    pWorker->bytes += n;
+    if(isEcho) {
+      pConnection->echoReceived += n;
+      if(pConnection->echoReceived >= requestSize) return 1;
+      continue;
+    }
+    size_t bodyOffset = 0;
+    if(!pConnection->isHeadDone) {
+      int status = scanHead(pConnection, pWorker->scratch, n, &bodyOffset);
+      if(status <= 0) {
+        if(status < 0) return -1;
+        continue;
+      }
+    }
+    bodyFramerScan(&pConnection->framer, pWorker->scratch + bodyOffset, n - bodyOffset);
+    if(pConnection->framer.isComplete) return pConnection->response.isKeepAlive ? 1 : 2;
+  }
+}
+static int scanHead(loadConnection *pConnection, const char *data, size_t size, size_t *pBodyOffset) {
+  /* Collects the head across reads; 1 once it is parsed, with "*pBodyOffset" where the body starts in "data" */
+  size_t previousSize = pConnection->headSize;
+  size_t copied = (size < sizeof(pConnection->head) - 1 - previousSize) ? size : sizeof(pConnection->head) - 1 - previousSize;
+  memcpy(pConnection->head + previousSize, data, copied);
+  pConnection->headSize += copied;
+  pConnection->head[pConnection->headSize] = '\0';
+  char *pEnd = strstr(pConnection->head + ((previousSize > 3) ? previousSize - 3 : 0), "\r\n\r\n");
+  if(pEnd == NULL) return (pConnection->headSize == sizeof(pConnection->head) - 1) ? -1 : 0;
+
+  size_t headLength = pEnd + 4 - pConnection->head;
+  *pBodyOffset = headLength - previousSize;
+  pEnd[2] = '\0'; /* Keep the last header's CRLF */
+  char *pLine = pConnection->head, *pNext = strstr(pLine, "\r\n");
+  *pNext = '\0';
+  if(responseHeadParseStatus(&pConnection->response, pLine) < 0) return -1;
+  for(pLine = pNext + 2; *pLine; pLine = pNext + 2) {
+    pNext = strstr(pLine, "\r\n");
+    *pNext = '\0';
+    responseHeadAdd(&pConnection->response, pLine);
+  }
+  bodyFramerInit(&pConnection->framer, &pConnection->response);
+  pConnection->isHeadDone = 1;
+  return 1;
+}
+static void finishRequest(loadWorker *pWorker, int index, int isReusable) {
+  loadConnection *pConnection = &pWorker->connections[index];
+  if(!isEcho && (pConnection->response.statusCode < 200 || pConnection->response.statusCode >= 400)) pWorker->statusErrors++;
+  else {
+    pWorker->requests++;
+    histogramRecord(&pWorker->latency, nowNs() - pConnection->startNs);
+  }
+  if(!isReusable) closeConnection(pConnection);
+  pConnection->state = CONN_IDLE;
+  pWorker->idle[pWorker->idleCount++] = index;
+}
+static void failRequest(loadWorker *pWorker, int index, unsigned long long *pCounter) {
+  (*pCounter)++;
+  closeConnection(&pWorker->connections[index]);
+  pWorker->connections[index].state = CONN_IDLE;
+  pWorker->idle[pWorker->idleCount++] = index;
+}
+static void closeConnection(loadConnection *pConnection) {
+  if(pConnection->fd >= 0) close(pConnection->fd); /* Also leaves the epoll set */
+  pConnection->fd = -1;
+}
+static long long nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void histogramRecord(histogram *pHistogram, unsigned long long value) {
+  pHistogram->counts[histogramIndex(value)]++;
+  pHistogram->total++;
+  pHistogram->sum += value;
+  if(value < pHistogram->min) pHistogram->min = value;
+  if(value > pHistogram->max) pHistogram->max = value;
+}
+static void histogramMerge(histogram *pTotal, const histogram *pPart) {
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++) pTotal->counts[i] += pPart->counts[i];
+  pTotal->total += pPart->total;
+  pTotal->sum += pPart->sum;
+  if(pPart->min < pTotal->min) pTotal->min = pPart->min;
+  if(pPart->max > pTotal->max) pTotal->max = pPart->max;
+}
+static unsigned long long histogramPercentile(const histogram *pHistogram, double percentile) {
+  /* Upper edge of the bucket holding the percentile, never past the largest value seen */
+  unsigned long long rank = (unsigned long long)(percentile / 100 * pHistogram->total + 0.5), seen = 0;
+  if(rank == 0) rank = 1;
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += pHistogram->counts[i];
+    if(seen >= rank) return (histogramValue(i) < pHistogram->max) ? histogramValue(i) : pHistogram->max;
+  }
+  return pHistogram->max;
+}
+static int histogramIndex(unsigned long long value) {
+  if(value < HISTOGRAM_SUB_BUCKETS) return value;
+  int shift = 63 - __builtin_clzll(value) - 5; /* Leaves the top 6 bits: 32..63 */
+  return HISTOGRAM_SUB_BUCKETS + (shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2) + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS / 2);
+}
+static unsigned long long histogramValue(int index) {
+  if(index < HISTOGRAM_SUB_BUCKETS) return index;
+  int shift = (index - HISTOGRAM_SUB_BUCKETS) / (HISTOGRAM_SUB_BUCKETS / 2) + 1;
+  unsigned long long top = (index - HISTOGRAM_SUB_BUCKETS) % (HISTOGRAM_SUB_BUCKETS / 2) + HISTOGRAM_SUB_BUCKETS / 2;
+  return ((top + 1) << shift) - 1;
+}
@@ -0,0 +1,153 @@
+/*
+ * readline-bench - Times rio_readlineb against the byte-at-a-time loop
+ *   it replaced (one rio_read call per byte), both reading the same
+ *   file through a rio_t, and reports bytes and lines per second.
+ *
+ *   make readline-bench && ./readline-bench [megabytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../csapp.h"
+
+#define DEFAULT_MEGABYTES 64
+
+typedef struct {
+  const char *name;
+  const char *block; /* Repeated until the file is the requested size */
+} benchCase;
+
+static const benchCase cases[] = {
+  { "headers", "GET http://www.example.com/index.html HTTP/1.1\r\n"
+               "Host: www.example.com\r\n"
+               "User-Agent: curl/8.5.0\r\n"
+               "Accept: */*\r\n"
+               "Proxy-Connection: keep-alive\r\n"
+               "\r\n" },
+  { "browser", "HTTP/1.1 200 OK\r\n"
+               "Date: Fri, 17 May 2024 09:12:44 GMT\r\n"
+               "Server: Apache/2.4.58 (Ubuntu)\r\n"
+               "Last-Modified: Tue, 14 May 2024 18:03:21 GMT\r\n"
+               "ETag: \"5e1f-6a2b3c4d5e6f7\"\r\n"
+               "Accept-Ranges: bytes\r\n"
+               "Content-Length: 24095\r\n"
+               "Vary: Accept-Encoding\r\n"
+               "Cache-Control: public, max-age=3600\r\n"
+               "Content-Type: text/html; charset=UTF-8\r\n"
+               "\r\n" },
+  { "cookies", "Cookie: session=3f2a9c1be84d47a1b0c6d2e5f7a8b9c0; cart=af81c2d3e4f5a6b7c8d9e0f1a2b3c4d5e6f7a8b9; _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1715000000; prefs=theme%3Ddark%26lang%3Den%26currency%3DGBP; ab=variant-b\r\n"
+               "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 14_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Safari/605.1.15\r\n" },
+  { "chunks",  "1f4\r\n"
+               "\r\n"
+               "a\r\n"
+               "\r\n" },
+};
+
+static double elapsedNanoseconds(struct timespec start, struct timespec end);
+static int makeFile(const char *block, size_t size);
+static ssize_t legacyRead(rio_t *rp, char *usrbuf, size_t n);
+static ssize_t legacyReadline(rio_t *rp, void *usrbuf, size_t maxlen);
+static int readAll(int fd, ssize_t (*readline)(rio_t *, void *, size_t), unsigned long *pLines, unsigned long *pChecksum);
+
+int main(int argc, char **argv) {
+  size_t size = (size_t)((argc > 1) ? atol(argv[1]) : DEFAULT_MEGABYTES) << 20;
+
+  printf("%-8s %14s %14s %14s %8s\n", "lines", "legacy MB/s", "memchr MB/s", "memchr Mlines/s", "speedup");
+  for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    int fd = makeFile(cases[c].block, size);
+    unsigned long legacyLines, legacySum, lines, sum;
+    struct timespec start, middle, end;
+
+    /* Both Passes Start Cold From The Page Cache; Warm It First */
+    readAll(fd, rio_readlineb, &lines, &sum);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    readAll(fd, legacyReadline, &legacyLines, &legacySum);
+    clock_gettime(CLOCK_MONOTONIC, &middle);
+    readAll(fd, rio_readlineb, &lines, &sum);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Close(fd);
+
+    /* Same Lines From Both, Or The Timing Means Nothing */
+    if(lines != legacyLines || sum != legacySum) {
+      fprintf(stderr, "%s: lines differ (%lu/%lx legacy, %lu/%lx memchr)\n", cases[c].name, legacyLines, legacySum, lines, sum);
+      return 1;
+    }
+    double legacy = elapsedNanoseconds(start, middle);
+    double scan = elapsedNanoseconds(middle, end);
+    printf("%-8s %14.1f %14.1f %14.2f %7.2fx\n", cases[c].name, size / legacy * 1e9 / (1 << 20),
+           size / scan * 1e9 / (1 << 20), lines / scan * 1e3, legacy / scan);
+  }
+  return 0;
+}
+
+static double elapsedNanoseconds(struct timespec start, struct timespec end) {
+  return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+static int makeFile(const char *block, size_t size) {
+  /* An unlinked temporary file of "block" repeated; reads come from the page cache */
+  char path[] = "/tmp/readline-bench-XXXXXX";
+  size_t blockSize = strlen(block), written = 0;
+  int fd = mkstemp(path);
+  if(fd < 0) unix_error("mkstemp error");
+  unlink(path);
+  while(written < size) {
+    size_t n = (size - written < blockSize) ? size - written : blockSize;
+    Rio_writen(fd, (void *)block, n);
+    written += n;
+  }
+  return fd;
+}
+static ssize_t legacyRead(rio_t *rp, char *usrbuf, size_t n) {
+  /* "rio_read" as csapp.c has it */
+  int cnt;
+  while(rp->rio_cnt <= 0) {
+    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+    if(rp->rio_cnt < 0) {
+      if(errno != EINTR) return -1;
+    }
+    else if(rp->rio_cnt == 0) return 0;
+    else rp->rio_bufptr = rp->rio_buf;
+  }
+  cnt = n;
+  if(rp->rio_cnt < n) cnt = rp->rio_cnt;
+  memcpy(usrbuf, rp->rio_bufptr, cnt);
+  rp->rio_bufptr += cnt;
+  rp->rio_cnt -= cnt;
+  return cnt;
+}
+static ssize_t legacyReadline(rio_t *rp, void *usrbuf, size_t maxlen) {
+  /* What "rio_readlineb" did: one "rio_read" per byte up to and including '\n' */
+  int n, rc;
+  char c, *bufp = usrbuf;
+  for(n = 1; n < maxlen; n++) {
+    if((rc = legacyRead(rp, &c, 1)) == 1) {
+      *bufp++ = c;
+      if(c == '\n') {
+        n++;
+        break;
+      }
+    }
+    else if(rc == 0) {
+      if(n == 1) return 0;
+      else break;
+    }
+    else return -1;
+  }
+  *bufp = 0;
+  return n - 1;
+}
+static int readAll(int fd, ssize_t (*readline)(rio_t *, void *, size_t), unsigned long *pLines, unsigned long *pChecksum) {
+  /* Every line of the file, as a header loop would read it; the checksum covers each line's length and bytes */
+  static rio_t rio;
+  char line[MAXLINE];
+  ssize_t n;
+  *pLines = *pChecksum = 0;
+  if(lseek(fd, 0, SEEK_SET) < 0) unix_error("lseek error");
+  rio_readinitb(&rio, fd);
+  while((n = readline(&rio, line, MAXLINE)) > 0) {
+    (*pLines)++;
+    *pChecksum = *pChecksum * 31 + n + (unsigned char)line[0] + (unsigned char)line[n - 1];
+  }
+  return n;
+}
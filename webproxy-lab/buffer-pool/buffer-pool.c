@@ -0,0 +1,99 @@
+#include <pthread.h>
+#include "../csapp.h"
+#include "buffer-pool.h"
+
+/* Released buffers of one size class, chained through their own first bytes */
+typedef struct idleBuffer {
+  struct idleBuffer *pNext;
+} idleBuffer;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static idleBuffer *idleLists[BUFFER_POOL_CLASS_COUNT];
+static int idleCounts[BUFFER_POOL_CLASS_COUNT];
+static int classCount = 1; /* Classes a buffer may grow through, set from the per-connection cap */
+static size_t poolBudget;
+static bufferPoolStats stats;
+
+static size_t classSize(int sizeClass);
+static char *takeBuffer(int sizeClass);
+static void returnBuffer(char *data, int sizeClass);
+
+void bufferPoolInit(size_t maxBufferSize, size_t budget) {
+  /* "maxBufferSize" caps what one connection may hold; "budget" caps what all of them hold together */
+  classCount = 1;
+  while(classCount < BUFFER_POOL_CLASS_COUNT && classSize(classCount) <= maxBufferSize) classCount++;
+  poolBudget = budget;
+}
+void bufferPoolAcquire(pooledBuffer *pBuffer) {
+  /* The smallest class is never refused: a relay must make progress even when the budget is spent */
+  pthread_mutex_lock(&poolLock);
+  stats.inUseBytes += BUFFER_POOL_MIN_SIZE;
+  if(stats.inUseBytes > stats.peakBytes) stats.peakBytes = stats.inUseBytes;
+  pBuffer->data = takeBuffer(0);
+  pthread_mutex_unlock(&poolLock);
+  if(pBuffer->data == NULL) pBuffer->data = Malloc(BUFFER_POOL_MIN_SIZE);
+  pBuffer->capacity = BUFFER_POOL_MIN_SIZE;
+  pBuffer->sizeClass = 0;
+}
+int bufferPoolGrow(pooledBuffer *pBuffer) {
+  /* Swaps the buffer for one twice as large; its contents are not kept. Returns 0 at the cap or when over budget */
+  int nextClass = pBuffer->sizeClass + 1;
+  if(nextClass >= classCount) return 0;
+  size_t nextSize = classSize(nextClass);
+
+  pthread_mutex_lock(&poolLock);
+  if(stats.inUseBytes - pBuffer->capacity + nextSize > poolBudget) {
+    stats.refusals++;
+    pthread_mutex_unlock(&poolLock);
+    return 0;
+  }
+  stats.inUseBytes += nextSize - pBuffer->capacity;
+  if(stats.inUseBytes > stats.peakBytes) stats.peakBytes = stats.inUseBytes;
+  stats.grows++;
+  returnBuffer(pBuffer->data, pBuffer->sizeClass);
+  pBuffer->data = takeBuffer(nextClass);
+  pthread_mutex_unlock(&poolLock);
+  if(pBuffer->data == NULL) pBuffer->data = Malloc(nextSize);
+  pBuffer->capacity = nextSize;
+  pBuffer->sizeClass = nextClass;
+  return 1;
+}
+void bufferPoolRelease(pooledBuffer *pBuffer) {
+  if(pBuffer->data == NULL) return;
+  pthread_mutex_lock(&poolLock);
+  stats.inUseBytes -= pBuffer->capacity;
+  returnBuffer(pBuffer->data, pBuffer->sizeClass);
+  pthread_mutex_unlock(&poolLock);
+  pBuffer->data = NULL;
+  pBuffer->capacity = 0;
+}
+void bufferPoolGetStats(bufferPoolStats *pStats) {
+  pthread_mutex_lock(&poolLock);
+  *pStats = stats;
+  pthread_mutex_unlock(&poolLock);
+}
+
+static size_t classSize(int sizeClass) {
+  return (size_t)BUFFER_POOL_MIN_SIZE << sizeClass;
+}
+static char *takeBuffer(int sizeClass) {
+  /* Caller holds the pool lock; NULL means the caller allocates a fresh one */
+  idleBuffer *pIdle = idleLists[sizeClass];
+  if(pIdle == NULL) return NULL;
+  idleLists[sizeClass] = pIdle->pNext;
+  idleCounts[sizeClass]--;
+  stats.idleBytes -= classSize(sizeClass);
+  return (char *)pIdle;
+}
+static void returnBuffer(char *data, int sizeClass) {
+  /* Caller holds the pool lock */
+  if(idleCounts[sizeClass] >= BUFFER_POOL_IDLE_PER_CLASS) {
+    Free(data); /* Enough spares of this size: keep the resident set bounded */
+    return;
+  }
+  idleBuffer *pIdle = (idleBuffer *)data;
+  pIdle->pNext = idleLists[sizeClass];
+  idleLists[sizeClass] = pIdle;
+  idleCounts[sizeClass]++;
+  stats.idleBytes += classSize(sizeClass);
+}
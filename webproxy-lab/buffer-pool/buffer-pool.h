@@ -0,0 +1,31 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#define BUFFER_POOL_MIN_SIZE 8192 /* Every relay starts here: one MAXBUF */
+#define BUFFER_POOL_CLASS_COUNT 6 /* 8 KB, 16 KB, ... 256 KB */
+#define BUFFER_POOL_IDLE_PER_CLASS 16 /* Released buffers kept for reuse; the rest go back to malloc */
+
+/* A relay buffer on loan from the pool; "data" is NULL when none is held */
+typedef struct {
+  char *data;
+  size_t capacity;
+  int sizeClass;
+} pooledBuffer;
+
+typedef struct {
+  size_t inUseBytes; /* Held by connections right now */
+  size_t idleBytes; /* Parked in the free lists */
+  size_t peakBytes; /* Highest "inUseBytes" seen */
+  unsigned long grows; /* Buffers swapped for the next size class */
+  unsigned long refusals; /* Growths denied because the budget was spent */
+} bufferPoolStats;
+
+void bufferPoolInit(size_t maxBufferSize, size_t budget);
+void bufferPoolAcquire(pooledBuffer *pBuffer);
+int bufferPoolGrow(pooledBuffer *pBuffer);
+void bufferPoolRelease(pooledBuffer *pBuffer);
+void bufferPoolGetStats(bufferPoolStats *pStats);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * cache-test - Refreshes stale objects the way a 304 from the origin
+ *   does, and checks that the replacement is fresh again for the right
+ *   length of time and that its stored head carries the 304's fields,
+ *   in RAM and in the disk tier.
+ *
+ *   make cache-test && ./cache-test
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../csapp.h"
+#include "../response/response.h"
+#include "../disk-cache/disk-cache.h"
+#include "cache.h"
+
+static int failures;
+
+static void check(int isTrue, const char *what);
+static int hasLine(const cacheObject *pObject, const char *line);
+static size_t formatDate(char *date, size_t capacity, time_t when);
+static cacheObject *insertStale(const char *key, const char *headers);
+static int diskHasLine(const char *key, const char *line);
+
+int main(void) {
+  char headers[MAXBUF], update[MAXBUF], oldDate[64], newDate[64], expires[64], line[MAXLINE], diskPath[] = "/tmp/cache-test.XXXXXX";
+  time_t now = time(NULL);
+  int diskfd = mkstemp(diskPath);
+  cacheInit(1 << 20, 100 * 1024);
+  if(diskfd < 0 || diskCacheInit(diskPath, 4 << 20) < 0) {
+    printf("FAIL cannot set up the disk tier\n");
+    return 1;
+  }
+  close(diskfd);
+  formatDate(oldDate, sizeof(oldDate), now - 1000);
+
+  /* A 304 Without A Date: Freshness Runs From The Refresh, Not The First Fetch */
+  snprintf(headers, sizeof(headers), "Date: %s\r\nCache-Control: max-age=60\r\nETag: \"v1\"\r\nContent-Length: 5\r\nX-Kept: yes\r\n", oldDate);
+  cacheObject *pStale = insertStale("origin:80/max-age", headers);
+  check(cacheFreshness(pStale, now) == CACHE_STALE, "max-age: stale before the refresh");
+  snprintf(update, sizeof(update), "HTTP/1.1 304 Not Modified\r\nCache-Control: max-age=120\r\nETag: \"v2\"\r\nConnection: keep-alive\r\nContent-Length: 0\r\n");
+  cacheObject *pFresh = cacheRefresh(pStale, update, strlen(update));
+  check(pFresh != NULL, "max-age: refreshed");
+  if(pFresh != NULL) {
+    check(cacheFreshness(pFresh, now) == CACHE_FRESH, "max-age: fresh after the refresh");
+    check(pFresh->freshUntil >= now + 120 && pFresh->freshUntil <= time(NULL) + 120, "max-age: lifetime measured from the refresh");
+    check(!strncmp(pFresh->data, "HTTP/1.1 200 OK\r\n", 17), "max-age: stored status line kept");
+    check(hasLine(pFresh, "Cache-Control: max-age=120") && !hasLine(pFresh, "Cache-Control: max-age=60"), "max-age: Cache-Control replaced");
+    check(hasLine(pFresh, "ETag: \"v2\"") && !hasLine(pFresh, "ETag: \"v1\""), "max-age: ETag replaced");
+    check(pFresh->etag != NULL && pFresh->etagLength == 4 && !memcmp(pFresh->etag, "\"v2\"", 4), "max-age: next revalidation sends the new ETag");
+    snprintf(line, sizeof(line), "Date: %s", oldDate);
+    check(!hasLine(pFresh, line), "max-age: stored Date dropped");
+    int isDated = 0;
+    for(time_t when = now; when <= time(NULL); when++) { /* The refresh may have crossed a second */
+      formatDate(newDate, sizeof(newDate), when);
+      snprintf(line, sizeof(line), "Date: %s", newDate);
+      isDated |= hasLine(pFresh, line);
+    }
+    check(isDated, "max-age: Date of the refresh added by the cache");
+    check(hasLine(pFresh, "X-Kept: yes") && hasLine(pFresh, "Content-Length: 5"), "max-age: other fields and the body's framing kept");
+    check(!hasLine(pFresh, "Connection: keep-alive") && !hasLine(pFresh, "Content-Length: 0"), "max-age: hop-by-hop fields and Content-Length left out");
+    check(pFresh->size - pFresh->headerSize == 7 && !memcmp(pFresh->data + pFresh->headerSize, "\r\nhello", 7), "max-age: body kept");
+    cacheObject *pCurrent = cacheAcquire("origin:80/max-age");
+    check(pCurrent == pFresh, "max-age: refreshed copy replaced the stale one");
+    if(pCurrent != NULL) cacheRelease(pCurrent);
+    check(cacheRefresh(pStale, update, strlen(update)) == NULL, "max-age: a replaced object is not refreshed again");
+    check(diskHasLine("origin:80/max-age", "Cache-Control: max-age=120") && diskHasLine("origin:80/max-age", "X-Kept: yes"), "max-age: disk tier holds the refreshed head");
+    cacheRelease(pFresh);
+  }
+  cacheRelease(pStale);
+
+  /* Expires And Date From The 304 Replace The Stored Ones */
+  snprintf(headers, sizeof(headers), "Date: %s\r\nExpires: %s\r\nLast-Modified: %s\r\nContent-Length: 5\r\n", oldDate, oldDate, oldDate);
+  pStale = insertStale("origin:80/expires", headers);
+  check(cacheFreshness(pStale, now) == CACHE_STALE, "expires: stale before the refresh");
+  formatDate(newDate, sizeof(newDate), now);
+  formatDate(expires, sizeof(expires), now + 600);
+  snprintf(update, sizeof(update), "Date: %s\r\nExpires: %s\r\n", newDate, expires);
+  pFresh = cacheRefresh(pStale, update, strlen(update));
+  check(pFresh != NULL, "expires: refreshed");
+  if(pFresh != NULL) {
+    check(pFresh->freshUntil == now + 600, "expires: lifetime from the 304's Expires and Date");
+    snprintf(line, sizeof(line), "Expires: %s", expires);
+    check(hasLine(pFresh, line), "expires: Expires replaced");
+    snprintf(line, sizeof(line), "Date: %s", newDate);
+    check(hasLine(pFresh, line), "expires: Date replaced");
+    check(pFresh->lastModified != NULL && !memcmp(pFresh->lastModified, oldDate, pFresh->lastModifiedLength), "expires: Last-Modified kept");
+    cacheRelease(pFresh);
+  }
+  cacheRelease(pStale);
+
+  unlink(diskPath);
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
+
+static void check(int isTrue, const char *what) {
+  if(isTrue) return;
+  printf("FAIL %s\n", what);
+  failures++;
+}
+static int hasLine(const cacheObject *pObject, const char *line) {
+  /* Whether the stored head holds "line" as a whole header line; the body starts with the blank line, so it cannot match */
+  char wanted[MAXLINE + 4];
+  snprintf(wanted, sizeof(wanted), "\r\n%s\r\n", line);
+  size_t length = strlen(wanted);
+  for(size_t i = 0; i + length <= pObject->headerSize + 2; i++) { /* Object data is not NUL-terminated */
+    if(!memcmp(pObject->data + i, wanted, length)) return 1;
+  }
+  return 0;
+}
+static size_t formatDate(char *date, size_t capacity, time_t when) {
+  struct tm fields;
+  gmtime_r(&when, &fields);
+  return strftime(date, capacity, "%a, %d %b %Y %H:%M:%S GMT", &fields);
+}
+static cacheObject *insertStale(const char *key, const char *headers) {
+  /* A cached 200 with a five-byte body, held by the caller */
+  char *data = Malloc(MAXBUF);
+  size_t size = snprintf(data, MAXBUF, "HTTP/1.1 200 OK\r\n%s\r\nhello", headers);
+  cacheInsert(key, data, size, BODY_LENGTH);
+  return cacheAcquire(key);
+}
+static int diskHasLine(const char *key, const char *line) {
+  /* Whether the disk tier's record for "key" holds "line" in its head */
+  diskObject object;
+  char data[MAXBUF], wanted[MAXLINE + 4];
+  int isFound = 0;
+  if(diskCacheAcquire(key, &object) < 0) return 0;
+  size_t size = object.headerSize < sizeof(data) ? object.headerSize : sizeof(data);
+  ssize_t n = pread(object.fd, data, size, object.offset);
+  diskCacheRelease(&object);
+  snprintf(wanted, sizeof(wanted), "\r\n%s\r\n", line);
+  size_t length = strlen(wanted);
+  for(ssize_t i = 0; n > 0 && i + (ssize_t)length <= n; i++) isFound |= !memcmp(data + i, wanted, length);
+  return isFound;
+}
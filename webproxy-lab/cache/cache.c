@@ -0,0 +1,341 @@
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "../csapp.h"
+#include "../response/response.h"
+#include "../disk-cache/disk-cache.h"
+#include "cache.h"
+
+/* One lock stripe: its own LRU list, hash buckets and byte budget */
+typedef struct {
+  pthread_mutex_t lock;
+  cacheObject *pHead, *pTail;
+  cacheObject *buckets[CACHE_BUCKET_COUNT];
+  size_t totalSize;
+} cacheShard;
+
+static cacheShard shards[CACHE_SHARD_COUNT];
+static size_t shardCapacity;
+static size_t objectCapacity;
+
+static unsigned int hashKey(const char *key);
+static cacheShard *shardOf(unsigned int hash);
+static cacheObject **bucketOf(cacheShard *pShard, unsigned int hash);
+static cacheObject *findObject(cacheShard *pShard, const char *key, unsigned int hash);
+static void linkFront(cacheShard *pShard, cacheObject *pObject);
+static void unlinkList(cacheShard *pShard, cacheObject *pObject);
+static void unlinkBucket(cacheShard *pShard, cacheObject *pObject);
+static void evictObject(cacheShard *pShard, cacheObject *pObject);
+static void freeObject(cacheObject *pObject);
+static cacheObject *insertObject(const char *key, char *data, size_t size, int bodyMode, int referenceCount, cacheObject *pReplacing);
+static int isCacheableResponse(const char *response, size_t size);
+static size_t findHeaderEnd(const char *data, size_t size);
+static void applyPolicy(cacheObject *pObject, const responseCachePolicy *pPolicy, long long now);
+static size_t formatDateLine(char *line, size_t capacity, time_t now);
+
+void cacheInit(size_t maxCacheSize, size_t maxObjectSize) {
+  shardCapacity = maxCacheSize / CACHE_SHARD_COUNT;
+  objectCapacity = maxObjectSize < shardCapacity ? maxObjectSize : shardCapacity;
+  for(int i = 0; i < CACHE_SHARD_COUNT; i++) {
+    memset(&shards[i], 0, sizeof(cacheShard));
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+}
+void cacheMakeKey(char *key, size_t capacity, const char *hostname, const char *port, const char *path) {
+  /* Normalize: lower-case host, explicit port, "/" for an empty path */
+  size_t offset = 0;
+  for(const char *p = hostname; *p && offset < capacity - 1; p++) key[offset++] = tolower((unsigned char)*p);
+  key[offset] = '\0';
+  snprintf(key + offset, capacity - offset, ":%s%s", (*port) ? port : "80", (*path) ? path : "/");
+}
+size_t cacheObjectCapacity(void) {
+  return objectCapacity;
+}
+cacheObject *cacheAcquire(const char *key) {
+  unsigned int hash = hashKey(key);
+  cacheShard *pShard = shardOf(hash);
+
+  pthread_mutex_lock(&pShard->lock);
+  cacheObject *pObject = findObject(pShard, key, hash);
+  if(pObject != NULL) {
+    pObject->referenceCount++;
+    unlinkList(pShard, pObject); /* Touch: move to the most recently used position */
+    linkFront(pShard, pObject);
+  }
+  pthread_mutex_unlock(&pShard->lock);
+  return pObject;
+}
+void cacheRetain(cacheObject *pObject) {
+  /* Another reference to an object the caller already holds */
+  cacheShard *pShard = shardOf(pObject->hash);
+  pthread_mutex_lock(&pShard->lock);
+  pObject->referenceCount++;
+  pthread_mutex_unlock(&pShard->lock);
+}
+void cacheRelease(cacheObject *pObject) {
+  cacheShard *pShard = shardOf(pObject->hash);
+  int isLastReader;
+
+  pthread_mutex_lock(&pShard->lock);
+  pObject->referenceCount--;
+  isLastReader = (pObject->isEvicted && pObject->referenceCount == 0);
+  pthread_mutex_unlock(&pShard->lock);
+  if(isLastReader) freeObject(pObject);
+}
+int cacheFreshness(cacheObject *pObject, long long now) {
+  /* CACHE_* for a wall-clock "now" */
+  cacheShard *pShard = shardOf(pObject->hash);
+  int freshness = CACHE_STALE;
+  pthread_mutex_lock(&pShard->lock);
+  if(now < pObject->freshUntil) freshness = CACHE_FRESH;
+  else if(now < pObject->freshUntil + pObject->staleWhileRevalidate) freshness = CACHE_STALE_WHILE_REVALIDATE;
+  pthread_mutex_unlock(&pShard->lock);
+  return freshness;
+}
+int cacheServesOnError(cacheObject *pObject, long long now) {
+  /* Whether stale-if-error still lets the object answer for an origin that failed or returned a 5xx */
+  cacheShard *pShard = shardOf(pObject->hash);
+  pthread_mutex_lock(&pShard->lock);
+  int isServable = (now < pObject->freshUntil + pObject->staleIfError);
+  pthread_mutex_unlock(&pShard->lock);
+  return isServable;
+}
+int cacheClaimRevalidation(cacheObject *pObject) {
+  /* 1 for exactly one caller until "cacheEndRevalidation" or "cacheRefresh": only that one schedules the fetch */
+  cacheShard *pShard = shardOf(pObject->hash);
+  pthread_mutex_lock(&pShard->lock);
+  int isClaimed = !pObject->isRevalidating && !pObject->isEvicted;
+  if(isClaimed) pObject->isRevalidating = 1;
+  pthread_mutex_unlock(&pShard->lock);
+  return isClaimed;
+}
+void cacheEndRevalidation(cacheObject *pObject) {
+  cacheShard *pShard = shardOf(pObject->hash);
+  pthread_mutex_lock(&pShard->lock);
+  pObject->isRevalidating = 0;
+  pthread_mutex_unlock(&pShard->lock);
+}
+cacheObject *cacheRefresh(cacheObject *pObject, const char *headers, size_t size) {
+  /* A 304 for the object's validators (RFC 9111 4.3.4): a copy whose head takes the 304's end-to-end fields, body unchanged, replaces it.
+     Returns the copy with a reference for the caller, or NULL when the object was already replaced or the copy is too large */
+  responseCachePolicy policy;
+  cacheShard *pShard = shardOf(pObject->hash);
+  pthread_mutex_lock(&pShard->lock);
+  int isCurrent = !pObject->isEvicted;
+  pObject->isRevalidating = 0;
+  pthread_mutex_unlock(&pShard->lock);
+  if(!isCurrent) return NULL; /* A newer response took its place */
+
+  /* Without A Date The Stored One Would Date The Refresh: RFC 9110 6.6.1 Has The Cache Add Its Own */
+  char *update = Malloc(size + MAXLINE);
+  memcpy(update, headers, size);
+  responseCachePolicyInit(&policy);
+  responseCachePolicyScan(&policy, headers, size);
+  if(policy.date < 0) size += formatDateLine(update + size, MAXLINE, time(NULL));
+
+  size_t bodySize = pObject->size - pObject->headerSize; /* From the blank line on */
+  char *data = Malloc(pObject->headerSize + size + bodySize);
+  size_t headerSize = responseHeadMerge(data, pObject->data, pObject->headerSize, update, size);
+  memcpy(data + headerSize, pObject->data + pObject->headerSize, bodySize);
+  Free(update);
+  return insertObject(pObject->key, data, headerSize + bodySize, pObject->bodyMode, 1, pObject); /* Write-through replaces the disk copy too, unless a newer response got there first */
+}
+int cacheInsert(const char *key, char *data, size_t size, int bodyMode) {
+  /* Takes ownership of "data": it is either linked into the cache or freed */
+  return (insertObject(key, data, size, bodyMode, 0, NULL) != NULL) ? 0 : -1;
+}
+void cacheCaptureInit(cacheCapture *pCapture) {
+  pCapture->data = NULL;
+  pCapture->size = pCapture->capacity = 0;
+  pCapture->isCapturing = 1;
+  pCapture->isHeadChecked = 0;
+}
+void cacheCaptureAppend(cacheCapture *pCapture, const char *data, size_t size) {
+  if(!pCapture->isCapturing) return;
+  if(pCapture->size + size > objectCapacity) { /* Too large to cache: the caller keeps streaming, we stop capturing */
+    cacheCaptureDiscard(pCapture);
+    pCapture->isCapturing = 0;
+    return;
+  }
+  if(pCapture->size + size > pCapture->capacity) { /* Relay chunks can outgrow one doubling */
+    if(pCapture->capacity == 0) pCapture->capacity = MAXBUF;
+    while(pCapture->capacity < pCapture->size + size) pCapture->capacity *= 2;
+    if(pCapture->capacity > objectCapacity) pCapture->capacity = objectCapacity;
+    pCapture->data = Realloc(pCapture->data, pCapture->capacity);
+  }
+  memcpy(pCapture->data + pCapture->size, data, size);
+  pCapture->size += size;
+  if(pCapture->size >= 12 && !isCacheableResponse(pCapture->data, pCapture->size)) { /* Status line decides early */
+    cacheCaptureDiscard(pCapture);
+    pCapture->isCapturing = 0;
+  }
+  if(pCapture->isCapturing && !pCapture->isHeadChecked) { /* Cache-Control decides too, before any follower streams the body */
+    size_t headerSize = findHeaderEnd(pCapture->data, pCapture->size);
+    if(headerSize == pCapture->size) return; /* The blank line is not in yet */
+    responseCachePolicy policy;
+    responseCachePolicyInit(&policy);
+    responseCachePolicyScan(&policy, pCapture->data, headerSize);
+    pCapture->isHeadChecked = 1;
+    if(!policy.isStorable) {
+      cacheCaptureDiscard(pCapture);
+      pCapture->isCapturing = 0;
+    }
+  }
+}
+void cacheCaptureCommit(cacheCapture *pCapture, const char *key, int bodyMode) {
+  if(pCapture->isCapturing && isCacheableResponse(pCapture->data, pCapture->size)) {
+    cacheInsert(key, pCapture->data, pCapture->size, bodyMode); /* The cache owns the data from here */
+    pCapture->data = NULL;
+    pCapture->size = pCapture->capacity = 0;
+  }
+  else cacheCaptureDiscard(pCapture);
+}
+cacheObject *cacheCaptureCommitAcquire(cacheCapture *pCapture, const char *key, int bodyMode) {
+  /* Commit that keeps a reference, for readers still streaming the captured bytes; NULL when nothing was cached */
+  cacheObject *pObject = NULL;
+  if(pCapture->isCapturing && isCacheableResponse(pCapture->data, pCapture->size)) {
+    pObject = insertObject(key, pCapture->data, pCapture->size, bodyMode, 1, NULL);
+    pCapture->data = NULL;
+    pCapture->size = pCapture->capacity = 0;
+  }
+  else cacheCaptureDiscard(pCapture);
+  return pObject;
+}
+void cacheCaptureDiscard(cacheCapture *pCapture) {
+  if(pCapture->data != NULL) Free(pCapture->data);
+  pCapture->data = NULL;
+  pCapture->size = pCapture->capacity = 0;
+}
+
+static unsigned int hashKey(const char *key) {
+  unsigned int hash = 2166136261u; /* FNV-1a */
+  for(const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+static cacheShard *shardOf(unsigned int hash) {
+  return &shards[hash % CACHE_SHARD_COUNT];
+}
+static cacheObject **bucketOf(cacheShard *pShard, unsigned int hash) {
+  return &pShard->buckets[(hash / CACHE_SHARD_COUNT) % CACHE_BUCKET_COUNT];
+}
+static cacheObject *findObject(cacheShard *pShard, const char *key, unsigned int hash) {
+  for(cacheObject *p = *bucketOf(pShard, hash); p != NULL; p = p->pBucketNext) {
+    if(p->hash == hash && !strcmp(p->key, key)) return p;
+  }
+  return NULL;
+}
+static void linkFront(cacheShard *pShard, cacheObject *pObject) {
+  pObject->pPrevious = NULL;
+  pObject->pNext = pShard->pHead;
+  if(pShard->pHead != NULL) pShard->pHead->pPrevious = pObject;
+  pShard->pHead = pObject;
+  if(pShard->pTail == NULL) pShard->pTail = pObject;
+}
+static void unlinkList(cacheShard *pShard, cacheObject *pObject) {
+  if(pObject->pPrevious != NULL) pObject->pPrevious->pNext = pObject->pNext;
+  else pShard->pHead = pObject->pNext;
+  if(pObject->pNext != NULL) pObject->pNext->pPrevious = pObject->pPrevious;
+  else pShard->pTail = pObject->pPrevious;
+  pObject->pPrevious = pObject->pNext = NULL;
+}
+static void unlinkBucket(cacheShard *pShard, cacheObject *pObject) {
+  cacheObject **ppLink = bucketOf(pShard, pObject->hash);
+  while(*ppLink != NULL && *ppLink != pObject) ppLink = &(*ppLink)->pBucketNext;
+  if(*ppLink != NULL) *ppLink = pObject->pBucketNext;
+}
+static void evictObject(cacheShard *pShard, cacheObject *pObject) {
+  /* Caller holds the shard lock */
+  unlinkList(pShard, pObject);
+  unlinkBucket(pShard, pObject);
+  pShard->totalSize -= pObject->size;
+  pObject->isEvicted = 1;
+  if(pObject->referenceCount == 0) freeObject(pObject); /* Otherwise the last "cacheRelease" frees it */
+}
+static void freeObject(cacheObject *pObject) {
+  Free(pObject->key);
+  Free(pObject->data);
+  Free(pObject);
+}
+static cacheObject *insertObject(const char *key, char *data, size_t size, int bodyMode, int referenceCount, cacheObject *pReplacing) {
+  /* Takes ownership of "data"; the new object starts with "referenceCount" readers. With "pReplacing" it only goes in in that object's place */
+  if(size == 0 || size > objectCapacity) {
+    Free(data);
+    return NULL;
+  }
+  cacheObject *pObject = Malloc(sizeof(cacheObject));
+  pObject->key = Malloc(strlen(key) + 1);
+  strcpy(pObject->key, key);
+  pObject->data = data;
+  pObject->size = size;
+  pObject->headerSize = findHeaderEnd(data, size);
+  pObject->bodyMode = bodyMode;
+  pObject->hash = hashKey(key);
+  pObject->referenceCount = referenceCount;
+  pObject->isEvicted = 0;
+  pObject->isRevalidating = 0;
+  responseCachePolicy policy;
+  responseCachePolicyInit(&policy);
+  responseCachePolicyScan(&policy, data, pObject->headerSize);
+  applyPolicy(pObject, &policy, time(NULL));
+  pObject->etag = policy.etag; /* Point into "data", which never changes */
+  pObject->etagLength = policy.etagLength;
+  pObject->lastModified = policy.lastModifiedValue;
+  pObject->lastModifiedLength = policy.lastModifiedLength;
+  cacheShard *pShard = shardOf(pObject->hash);
+
+  pthread_mutex_lock(&pShard->lock);
+  cacheObject *pExisting = findObject(pShard, key, pObject->hash);
+  if(pReplacing != NULL && pExisting != pReplacing) { /* Replaced while the copy was made: the newer response stays */
+    pthread_mutex_unlock(&pShard->lock);
+    freeObject(pObject);
+    return NULL;
+  }
+  diskCacheStore(key, data, size, pObject->headerSize, bodyMode, pObject->freshUntil); /* Write-through, only once the object is going in; a copy into the map, so the lock keeps both tiers in the same order */
+  if(pExisting != NULL) evictObject(pShard, pExisting); /* A concurrent miss fetched the same object: keep the newest */
+  while(pShard->totalSize + size > shardCapacity && pShard->pTail != NULL) evictObject(pShard, pShard->pTail);
+  cacheObject **pBucket = bucketOf(pShard, pObject->hash);
+  pObject->pBucketNext = *pBucket;
+  *pBucket = pObject;
+  linkFront(pShard, pObject);
+  pShard->totalSize += size;
+  pthread_mutex_unlock(&pShard->lock);
+  return pObject;
+}
+static int isCacheableResponse(const char *response, size_t size) {
+  /* Only complete "200 OK" responses are worth replaying */
+  if(size < 12 || strncmp(response, "HTTP/1.", 7)) return 0;
+  return !strncmp(response + 8, " 200", 4);
+}
+static size_t findHeaderEnd(const char *data, size_t size) {
+  /* Offset of the CRLF that ends the header block, or "size" when there is none */
+  for(size_t i = 0; i + 4 <= size; i++) {
+    if(data[i] == '\r' && !memcmp(data + i, "\r\n\r\n", 4)) return i + 2;
+  }
+  return size;
+}
+static void applyPolicy(cacheObject *pObject, const responseCachePolicy *pPolicy, long long now) {
+  /* RFC 9111 4.2: freshness runs from the response's Date, or from now when it has none or is ahead of this clock */
+  long long generated = (pPolicy->date >= 0 && pPolicy->date <= now) ? pPolicy->date : now;
+  long long lifetime;
+  if(pPolicy->isNoCache) lifetime = 0;
+  else if(pPolicy->sharedMaxAge >= 0) lifetime = pPolicy->sharedMaxAge;
+  else if(pPolicy->maxAge >= 0) lifetime = pPolicy->maxAge;
+  else if(pPolicy->expires >= 0) lifetime = pPolicy->expires - ((pPolicy->date >= 0) ? pPolicy->date : now);
+  else if(pPolicy->lastModified >= 0 && pPolicy->lastModified <= generated) { /* Heuristic: what has not changed in a while will not soon */
+    lifetime = (generated - pPolicy->lastModified) / 10;
+    if(lifetime > CACHE_HEURISTIC_MAX_LIFETIME) lifetime = CACHE_HEURISTIC_MAX_LIFETIME;
+  }
+  else lifetime = CACHE_DEFAULT_LIFETIME;
+  pObject->freshUntil = generated + ((lifetime > 0) ? lifetime : 0);
+  pObject->staleWhileRevalidate = pPolicy->isMustRevalidate ? 0 : pPolicy->staleWhileRevalidate;
+  pObject->staleIfError = pPolicy->isMustRevalidate ? 0 : pPolicy->staleIfError;
+}
+static size_t formatDateLine(char *line, size_t capacity, time_t now) {
+  /* "Date: " and an IMF-fixdate, CRLF-terminated */
+  struct tm fields;
+  gmtime_r(&now, &fields);
+  return strftime(line, capacity, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &fields);
+}
@@ -0,0 +1,63 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#define CACHE_SHARD_COUNT 8 /* Every shard must be able to hold one MAX_OBJECT_SIZE object */
+#define CACHE_BUCKET_COUNT 256 /* Hash buckets per shard */
+#define CACHE_KEY_SIZE 8192
+#define CACHE_DEFAULT_LIFETIME 300 /* Seconds a response with no Cache-Control, Expires or Last-Modified stays fresh */
+#define CACHE_HEURISTIC_MAX_LIFETIME 86400 /* Cap on the Last-Modified heuristic: a tenth of the time since the last change */
+
+/* How a stored response may be used now, as "cacheFreshness" reports it */
+#define CACHE_FRESH 0 /* Served without asking the origin */
+#define CACHE_STALE_WHILE_REVALIDATE 1 /* Served, while a background fetch revalidates it */
+#define CACHE_STALE 2 /* Revalidated before it is served; may still stand in for an origin that fails */
+
+/* One cached response: status line, end-to-end headers, blank line and body */
+typedef struct cacheObject {
+  char *key;
+  char *data;
+  size_t size;
+  size_t headerSize; /* Bytes before the blank line: where the proxy adds its own Connection header */
+  int bodyMode; /* BODY_* from response.h: whether the body frames itself on a persistent connection */
+  long long freshUntil; /* Wall-clock second it goes stale */
+  long long staleWhileRevalidate; /* Seconds past "freshUntil" it is still served while it is revalidated in the background */
+  long long staleIfError; /* Seconds past "freshUntil" it may stand in for an origin that fails */
+  const char *etag, *lastModified; /* Validators inside "data", NULL when the origin sent none */
+  size_t etagLength, lastModifiedLength;
+  int isRevalidating; /* A background revalidation is queued or running, guarded by the shard lock */
+  unsigned int hash;
+  int referenceCount; /* Readers currently streaming this object, guarded by the shard lock */
+  int isEvicted; /* Unlinked from its shard, freed by the last reader */
+  struct cacheObject *pPrevious, *pNext; /* LRU list: head is the most recently used */
+  struct cacheObject *pBucketNext; /* Hash bucket chain */
+} cacheObject;
+
+/* Copy of a response accumulated while it streams to the client */
+typedef struct {
+  char *data;
+  size_t size, capacity;
+  int isCapturing; /* Cleared once the response is known to be uncacheable (too large, not 200, no-store) */
+  int isHeadChecked; /* The whole header block has been seen and allows storing */
+} cacheCapture;
+
+void cacheInit(size_t maxCacheSize, size_t maxObjectSize);
+void cacheMakeKey(char *key, size_t capacity, const char *hostname, const char *port, const char *path);
+size_t cacheObjectCapacity(void);
+cacheObject *cacheAcquire(const char *key);
+void cacheRetain(cacheObject *pObject);
+void cacheRelease(cacheObject *pObject);
+int cacheFreshness(cacheObject *pObject, long long now);
+int cacheServesOnError(cacheObject *pObject, long long now);
+int cacheClaimRevalidation(cacheObject *pObject);
+void cacheEndRevalidation(cacheObject *pObject);
+cacheObject *cacheRefresh(cacheObject *pObject, const char *headers, size_t size);
+int cacheInsert(const char *key, char *data, size_t size, int bodyMode);
+void cacheCaptureInit(cacheCapture *pCapture);
+void cacheCaptureAppend(cacheCapture *pCapture, const char *data, size_t size);
+void cacheCaptureCommit(cacheCapture *pCapture, const char *key, int bodyMode);
+cacheObject *cacheCaptureCommitAcquire(cacheCapture *pCapture, const char *key, int bodyMode);
+void cacheCaptureDiscard(cacheCapture *pCapture);
+
+#endif
@@ -792,6 +792,35 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write every byte described by an iovec array,
+ *    resuming after short writes. Consumes the array: entries are
+ *    advanced past what was written. Returns the byte count or -1.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    ssize_t total = 0, nwritten;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    return -1;           /* errno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) { /* Drop finished entries */
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {      /* Partly written entry */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -865,34 +894,238 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). Each pass scans
+ *    the unread part of the internal buffer with memchr (vectorized in
+ *    libc) and copies up to the newline in one memcpy, instead of one
+ *    rio_read call per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *newline = NULL;
+
+    while (n + 1 < maxlen && newline == NULL) {
+	while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+			       sizeof(rp->rio_buf));
+	    if (rp->rio_cnt < 0) {
+		if (errno != EINTR) /* Interrupted by sig handler return */
+		    return -1;	  /* Error */
+	    }
+	    else if (rp->rio_cnt == 0) {  /* EOF */
+		if (n == 0)
+		    return 0; /* EOF, no data read */
+		bufp[n] = 0;
+		return n;     /* EOF, some data was read */
+	    }
+	    else 
+		rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+	}
+
+	/* Copy through the newline, or as much as fits */
+	cnt = maxlen - 1 - n;
+	if ((size_t)rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((newline = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = newline - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
-    return n-1;
+    if (maxlen > 0)
+	bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readsomeb - Read at most n bytes (buffered), returning as soon as
+ *    any are available instead of waiting for all n. Used on persistent
+ *    connections, where the peer does not close after a message. Once
+ *    the internal buffer is empty, requests of RIO_BUFSIZE or more read
+ *    straight into usrbuf, so a large caller buffer is filled in one
+ *    read instead of RIO_BUFSIZE-sized pieces.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t cnt;
+
+    if (rp->rio_cnt > 0 || n < RIO_BUFSIZE)
+	return rio_read(rp, usrbuf, n);
+    while ((cnt = read(rp->rio_fd, usrbuf, n)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    return cnt;
+}
+
+/*
+ * Ring reader - A buffered reader that hands out views into its own
+ *    storage instead of copying into the caller's buffer. Reads go
+ *    through readv into both free spans of the ring, so a refill takes
+ *    every byte that fits in one call even when the unread bytes sit in
+ *    the middle. When a line or head fills the ring, the ring doubles up
+ *    to RIO_RING_MAXSIZE instead of truncating. A view stays valid until
+ *    the next fill or pullup on the same ring.
+ */
+static void rio_reverse(char *p, size_t n)
+{
+    char c, *q = p + n - 1;
+
+    if (n < 2)
+	return;
+    while (p < q) {
+	c = *p;
+	*p++ = *q;
+	*q-- = c;
+    }
+}
+
+/* $begin rio_ringinitb */
+void rio_ringinitb(rio_ring_t *rp, int fd) 
+{
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
+    rp->rio_start = 0;
+    rp->rio_size = RIO_BUFSIZE;
+    rp->rio_data = rp->rio_init;
+}
+/* $end rio_ringinitb */
+
+/*
+ * rio_ringfreeb - Release grown storage; the ring can be initialized again
+ */
+void rio_ringfreeb(rio_ring_t *rp) 
+{
+    if (rp->rio_data != rp->rio_init)
+	free(rp->rio_data);
+    rp->rio_data = rp->rio_init;
+    rp->rio_size = RIO_BUFSIZE;
+    rp->rio_cnt = rp->rio_start = 0;
+}
+
+/*
+ * rio_ringfillb - Read more after the unread bytes, growing the ring
+ *    first if they fill it. Returns the number of bytes read, 0 on EOF,
+ *    -1 on error, or -2 if the unread bytes already fill a ring of
+ *    RIO_RING_MAXSIZE.
+ */
+ssize_t rio_ringfillb(rio_ring_t *rp) 
+{
+    struct iovec iov[2];
+    int iovcnt = 0;
+    size_t end, first;
+    ssize_t n;
+
+    if (rp->rio_cnt == rp->rio_size) {
+	char *data;
+	size_t size = rp->rio_size * 2;
+
+	if (rp->rio_size >= RIO_RING_MAXSIZE)
+	    return -2;
+	if (size > RIO_RING_MAXSIZE)
+	    size = RIO_RING_MAXSIZE;
+	data = Malloc(size);
+	first = rp->rio_size - rp->rio_start; /* Unread bytes up to the end of the old ring */
+	memcpy(data, rp->rio_data + rp->rio_start, first);
+	memcpy(data + first, rp->rio_data, rp->rio_cnt - first);
+	if (rp->rio_data != rp->rio_init)
+	    free(rp->rio_data);
+	rp->rio_data = data;
+	rp->rio_size = size;
+	rp->rio_start = 0;
+    }
+
+    /* Free space: after the unread bytes, then before them once wrapped */
+    end = rp->rio_start + rp->rio_cnt;
+    if (end < rp->rio_size) {
+	iov[iovcnt].iov_base = rp->rio_data + end;
+	iov[iovcnt++].iov_len = rp->rio_size - end;
+	if (rp->rio_start > 0) {
+	    iov[iovcnt].iov_base = rp->rio_data;
+	    iov[iovcnt++].iov_len = rp->rio_start;
+	}
+    }
+    else {
+	iov[iovcnt].iov_base = rp->rio_data + end - rp->rio_size;
+	iov[iovcnt++].iov_len = rp->rio_size - rp->rio_cnt;
+    }
+    while ((n = readv(rp->rio_fd, iov, iovcnt)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_cnt += n;
+    return n;
+}
+
+/*
+ * rio_ringpullupb - Return the first n unread bytes (n <= rio_cnt) as one
+ *    contiguous view. Only a view that runs past the end of the ring
+ *    costs anything: the ring is rotated in place so it starts at 0.
+ */
+char *rio_ringpullupb(rio_ring_t *rp, size_t n) 
+{
+    if (rp->rio_start + n > rp->rio_size) {
+	rio_reverse(rp->rio_data, rp->rio_start);
+	rio_reverse(rp->rio_data + rp->rio_start, rp->rio_size - rp->rio_start);
+	rio_reverse(rp->rio_data, rp->rio_size);
+	rp->rio_start = 0;
+    }
+    return rp->rio_data + rp->rio_start;
+}
+
+/*
+ * rio_ringconsumeb - Drop the first n unread bytes (n <= rio_cnt). Their
+ *    storage is not reused before the next fill.
+ */
+void rio_ringconsumeb(rio_ring_t *rp, size_t n) 
+{
+    rp->rio_start += n;
+    if (rp->rio_start >= rp->rio_size)
+	rp->rio_start -= rp->rio_size;
+    rp->rio_cnt -= n;
+    if (rp->rio_cnt == 0)
+	rp->rio_start = 0; /* Keep the next fill in one span */
+}
+
+/*
+ * rio_ringlineb - Point *linep at the next text line, newline included,
+ *    and consume it; the line is not NUL-terminated. Returns its length,
+ *    0 on EOF with no data, -1 on error, or -2 if the line is longer than
+ *    RIO_RING_MAXSIZE. A last line without a newline is returned at EOF.
+ */
+/* $begin rio_ringlineb */
+ssize_t rio_ringlineb(rio_ring_t *rp, char **linep) 
+{
+    size_t scanned = 0;
+    char *data, *newline;
+    ssize_t n;
+
+    while (1) {
+	data = rio_ringpullupb(rp, rp->rio_cnt);
+	if ((newline = memchr(data + scanned, '\n', rp->rio_cnt - scanned)) != NULL) {
+	    n = newline - data + 1;
+	    break;
+	}
+	scanned = rp->rio_cnt; /* Bytes already searched stay searched after a fill */
+	if ((n = rio_ringfillb(rp)) < 0)
+	    return n;
+	if (n == 0) {
+	    if (rp->rio_cnt == 0)
+		return 0; /* EOF, no data read */
+	    data = rio_ringpullupb(rp, rp->rio_cnt);
+	    n = rp->rio_cnt; /* EOF, some data was read */
+	    break;
+	}
+    }
+    *linep = data;
+    rio_ringconsumeb(rp, n);
+    return n;
+}
+/* $end rio_ringlineb */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -934,6 +1167,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_ringlineb(rio_ring_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_ringlineb(rp, linep)) == -1)
+	unix_error("Rio_ringlineb error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -994,7 +1236,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1019,6 +1261,13 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Lets several sockets bind the same port; the kernel spreads connections across them */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1041,6 +1290,20 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but with SO_REUSEPORT set
+ *     so that one listener per thread can share the same port.
+ */
+int open_reuseport_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1064,6 +1327,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port) 
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+	unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -51,6 +52,19 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Growable ring for the ring reader: filled with readv, read through views */
+/* $begin rio_ring_t */
+#define RIO_RING_MAXSIZE (64 * 1024) /* Largest a ring grows to for one line or head */
+typedef struct {
+    int rio_fd;                 /* Descriptor for this ring */
+    size_t rio_cnt;             /* Unread bytes in the ring */
+    size_t rio_start;           /* Offset of the first unread byte */
+    size_t rio_size;            /* Capacity of rio_data */
+    char *rio_data;             /* rio_init, or a heap buffer once grown */
+    char rio_init[RIO_BUFSIZE]; /* Storage until a line or head needs more */
+} rio_ring_t;
+/* $end rio_ring_t */
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -178,6 +192,14 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_writev(int fd, struct iovec *iov, int iovcnt);
+void rio_ringinitb(rio_ring_t *rp, int fd); 
+void rio_ringfreeb(rio_ring_t *rp);
+ssize_t	rio_ringfillb(rio_ring_t *rp);
+char *rio_ringpullupb(rio_ring_t *rp, size_t n);
+void rio_ringconsumeb(rio_ring_t *rp, size_t n);
+ssize_t	rio_ringlineb(rio_ring_t *rp, char **linep);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -185,14 +207,17 @@ void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_ringlineb(rio_ring_t *rp, char **linep);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_reuseport_listenfd(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_reuseport_listenfd(char *port);
 
 
 #endif /* __CSAPP_H__ */
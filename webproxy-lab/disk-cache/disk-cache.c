@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "../csapp.h"
+#include "../event-log/event-log.h"
+#include "disk-cache.h"
+
+#define FILE_MAGIC 0x3145484341435850ULL /* "PXCACHE1" */
+#define FILE_VERSION 2 /* 2: records carry their freshness; older files are reformatted */
+#define RECORD_MAGIC 0x44524352u /* "RCRD" */
+#define PAGE_SIZE 4096 /* The header page; the index is padded to whole pages too */
+#define RECORD_ALIGNMENT 64
+
+/* First page of the file */
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t bucketCount, bucketSlots;
+  uint64_t fileSize;
+  uint64_t dataOffset, dataSize; /* The record log */
+  uint64_t writeOffset; /* Where the next record goes, relative to "dataOffset" */
+  uint32_t sequence; /* Number of the newest record */
+} fileHeader;
+
+/* Index entry: where the newest record for a key hash was written */
+typedef struct {
+  uint64_t hash;
+  uint64_t offset; /* Relative to "dataOffset" */
+  uint32_t length; /* Whole record, padded */
+  uint32_t sequence; /* 0 when empty; must match the record, so entries for overwritten records never resolve */
+} indexSlot;
+
+/* Precedes the key and the response bytes of every record */
+typedef struct {
+  uint32_t magic; /* Set last: a half-written record is never valid */
+  uint32_t sequence;
+  uint32_t keyLength;
+  uint32_t headerSize;
+  uint64_t size;
+  int32_t bodyMode;
+  uint32_t reserved;
+  int64_t freshUntil; /* Wall-clock second the response goes stale, as the RAM tier computed it */
+} recordHeader;
+
+/* Log range a reader is sending from */
+typedef struct {
+  uint64_t offset, length;
+  int isUsed;
+} diskPin;
+
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+static int diskfd = -1;
+static char *pMap; /* NULL: the disk tier is off */
+static fileHeader *pHeader;
+static indexSlot *pIndex;
+static char *pData;
+static diskPin pins[DISK_CACHE_MAX_PINS];
+static int pinCount;
+static diskCacheStats stats;
+
+static int isFormatted(size_t size, size_t dataOffset);
+static void formatFile(size_t size, size_t dataOffset);
+static indexSlot *findSlot(uint64_t hash);
+static void indexRecord(uint64_t hash, uint64_t offset, uint32_t length, uint32_t sequence);
+static recordHeader *validRecord(const indexSlot *pSlot, const char *key, size_t keyLength);
+static int isPinned(uint64_t offset, uint64_t length);
+static uint64_t hashKey(const char *key);
+
+int diskCacheInit(const char *path, size_t size) {
+  /* Maps the file and formats it when it is new or laid out differently; -1 leaves the proxy RAM-only */
+  size_t indexSize = sizeof(indexSlot) * DISK_CACHE_BUCKET_COUNT * DISK_CACHE_BUCKET_SLOTS;
+  size_t dataOffset = PAGE_SIZE + (indexSize + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+  struct stat status;
+  char message[EVENT_LOG_MESSAGE_SIZE];
+
+  if(size <= dataOffset + PAGE_SIZE) return -1;
+  if((diskfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(diskfd, &status) < 0) {
+    writeEvent("Disk cache disabled: cannot open its file.");
+    if(diskfd >= 0) close(diskfd);
+    diskfd = -1;
+    return -1;
+  }
+  if((size_t)status.st_size != size) {
+    if(ftruncate(diskfd, size) == 0) posix_fallocate(diskfd, 0, size); /* Reserve the blocks now; stays sparse where unsupported */
+    else status.st_size = -1;
+  }
+  if(status.st_size < 0 || (pMap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfd, 0)) == MAP_FAILED) {
+    writeEvent("Disk cache disabled: cannot map its file.");
+    close(diskfd);
+    diskfd = -1;
+    pMap = NULL;
+    return -1;
+  }
+  pHeader = (fileHeader *)pMap;
+  pIndex = (indexSlot *)(pMap + PAGE_SIZE);
+  pData = pMap + dataOffset;
+
+  /* A Restarted Proxy Reuses The Index In Place: Nothing To Load */
+  if(isFormatted(size, dataOffset)) {
+    int entryCount = 0;
+    for(int i = 0; i < DISK_CACHE_BUCKET_COUNT * DISK_CACHE_BUCKET_SLOTS; i++) entryCount += (pIndex[i].sequence != 0);
+    snprintf(message, sizeof(message), "Disk cache warm: %d records indexed.", entryCount);
+    writeEvent(message);
+  }
+  else formatFile(size, dataOffset);
+  return 0;
+}
+void diskCacheStore(const char *key, const char *data, size_t size, size_t headerSize, int bodyMode, long long freshUntil) {
+  /* Appends a record at the log head, overwriting the oldest records there */
+  if(pMap == NULL) return;
+  size_t keyLength = strlen(key);
+  uint64_t length = (sizeof(recordHeader) + keyLength + size + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+  uint64_t hash = hashKey(key);
+
+  pthread_mutex_lock(&diskLock);
+  uint64_t offset = pHeader->writeOffset;
+  if(offset + length > pHeader->dataSize) offset = 0; /* Wrap: the records left at the tail survive until the next lap */
+  if(length > pHeader->dataSize / 4 || isPinned(offset, length)) { /* A reader is still sending what would be overwritten */
+    stats.skipped++;
+    pthread_mutex_unlock(&diskLock);
+    return;
+  }
+  recordHeader *pRecord = (recordHeader *)(pData + offset);
+  pRecord->magic = 0;
+  memcpy(pRecord + 1, key, keyLength);
+  memcpy((char *)(pRecord + 1) + keyLength, data, size);
+  if(++pHeader->sequence == 0) pHeader->sequence = 1; /* 0 marks an empty index slot */
+  pRecord->sequence = pHeader->sequence;
+  pRecord->keyLength = keyLength;
+  pRecord->headerSize = headerSize;
+  pRecord->size = size;
+  pRecord->bodyMode = bodyMode;
+  pRecord->reserved = 0;
+  pRecord->freshUntil = freshUntil;
+  pRecord->magic = RECORD_MAGIC;
+  pHeader->writeOffset = offset + length;
+  indexRecord(hash, offset, length, pRecord->sequence);
+  stats.stores++;
+  pthread_mutex_unlock(&diskLock);
+}
+int diskCacheAcquire(const char *key, diskObject *pObject) {
+  /* On a hit the record is pinned until "diskCacheRelease"; -1 on a miss, and for a stale record the origin is asked instead */
+  if(pMap == NULL) return -1;
+  size_t keyLength = strlen(key);
+  uint64_t hash = hashKey(key);
+  int status = -1;
+
+  pthread_mutex_lock(&diskLock);
+  indexSlot *pSlot = findSlot(hash);
+  recordHeader *pRecord = (pSlot != NULL) ? validRecord(pSlot, key, keyLength) : NULL;
+  int isStale = (pRecord != NULL && pRecord->freshUntil <= (int64_t)time(NULL));
+  if(pRecord != NULL && !isStale && pinCount < DISK_CACHE_MAX_PINS) {
+    int pin = 0;
+    while(pins[pin].isUsed) pin++;
+    pins[pin].offset = pSlot->offset;
+    pins[pin].length = pSlot->length;
+    pins[pin].isUsed = 1;
+    pinCount++;
+    pObject->fd = diskfd;
+    pObject->offset = ((char *)(pRecord + 1) + keyLength) - pMap;
+    pObject->size = pRecord->size;
+    pObject->headerSize = pRecord->headerSize;
+    pObject->bodyMode = pRecord->bodyMode;
+    pObject->pin = pin;
+    status = 0;
+  }
+  if(status == 0) stats.hits++;
+  else if(isStale) stats.stale++;
+  else stats.misses++;
+  pthread_mutex_unlock(&diskLock);
+  return status;
+}
+void diskCacheRelease(diskObject *pObject) {
+  pthread_mutex_lock(&diskLock);
+  pins[pObject->pin].isUsed = 0;
+  pinCount--;
+  pthread_mutex_unlock(&diskLock);
+}
+void diskCacheGetStats(diskCacheStats *pStats) {
+  pthread_mutex_lock(&diskLock);
+  *pStats = stats;
+  pthread_mutex_unlock(&diskLock);
+}
+
+static int isFormatted(size_t size, size_t dataOffset) {
+  return pHeader->magic == FILE_MAGIC && pHeader->version == FILE_VERSION && pHeader->fileSize == size
+    && pHeader->bucketCount == DISK_CACHE_BUCKET_COUNT && pHeader->bucketSlots == DISK_CACHE_BUCKET_SLOTS
+    && pHeader->dataOffset == dataOffset && pHeader->writeOffset <= pHeader->dataSize;
+}
+static void formatFile(size_t size, size_t dataOffset) {
+  /* Only the header and index are cleared: stale log bytes can never match an index entry */
+  memset(pMap, 0, dataOffset);
+  pHeader->version = FILE_VERSION;
+  pHeader->bucketCount = DISK_CACHE_BUCKET_COUNT;
+  pHeader->bucketSlots = DISK_CACHE_BUCKET_SLOTS;
+  pHeader->fileSize = size;
+  pHeader->dataOffset = dataOffset;
+  pHeader->dataSize = size - dataOffset;
+  pHeader->writeOffset = 0;
+  pHeader->sequence = 0;
+  pHeader->magic = FILE_MAGIC;
+}
+static indexSlot *findSlot(uint64_t hash) {
+  indexSlot *pBucket = pIndex + (hash % DISK_CACHE_BUCKET_COUNT) * DISK_CACHE_BUCKET_SLOTS;
+  for(int i = 0; i < DISK_CACHE_BUCKET_SLOTS; i++) {
+    if(pBucket[i].sequence != 0 && pBucket[i].hash == hash) return &pBucket[i];
+  }
+  return NULL;
+}
+static void indexRecord(uint64_t hash, uint64_t offset, uint32_t length, uint32_t sequence) {
+  /* Replaces an older record of the same key, else an empty slot, else the bucket's oldest */
+  indexSlot *pSlot = findSlot(hash);
+  if(pSlot == NULL) {
+    indexSlot *pBucket = pIndex + (hash % DISK_CACHE_BUCKET_COUNT) * DISK_CACHE_BUCKET_SLOTS;
+    pSlot = &pBucket[0];
+    for(int i = 1; i < DISK_CACHE_BUCKET_SLOTS; i++) {
+      if(pBucket[i].sequence < pSlot->sequence) pSlot = &pBucket[i];
+    }
+  }
+  pSlot->hash = hash;
+  pSlot->offset = offset;
+  pSlot->length = length;
+  pSlot->sequence = sequence;
+}
+static recordHeader *validRecord(const indexSlot *pSlot, const char *key, size_t keyLength) {
+  /* The log may have lapped this entry: trust it only if the record still carries its number and key */
+  if(pSlot->offset + pSlot->length > pHeader->dataSize || pSlot->length < sizeof(recordHeader)) return NULL;
+  recordHeader *pRecord = (recordHeader *)(pData + pSlot->offset);
+  if(pRecord->magic != RECORD_MAGIC || pRecord->sequence != pSlot->sequence || pRecord->keyLength != keyLength) return NULL;
+  if(sizeof(recordHeader) + keyLength + pRecord->size > pSlot->length || pRecord->headerSize > pRecord->size) return NULL;
+  if(memcmp(pRecord + 1, key, keyLength)) return NULL;
+  return pRecord;
+}
+static int isPinned(uint64_t offset, uint64_t length) {
+  for(int i = 0, seen = 0; seen < pinCount; i++) {
+    if(!pins[i].isUsed) continue;
+    seen++;
+    if(pins[i].offset < offset + length && offset < pins[i].offset + pins[i].length) return 1;
+  }
+  return 0;
+}
+static uint64_t hashKey(const char *key) {
+  uint64_t hash = 14695981039346656037ULL; /* 64-bit FNV-1a: the index keeps no key to resolve collisions */
+  for(const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,36 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define DISK_CACHE_SIZE 67108864 /* Whole file, allocated up front: header, index and record log */
+#define DISK_CACHE_BUCKET_COUNT 8192 /* Index buckets */
+#define DISK_CACHE_BUCKET_SLOTS 4 /* Records remembered per bucket; the oldest gives way */
+#define DISK_CACHE_MAX_PINS 1024 /* Records being sent at once; the log never overwrites one */
+
+/* A record being served straight from the file */
+typedef struct {
+  int fd;
+  off_t offset; /* Where the cached response starts in the file */
+  size_t size;
+  size_t headerSize; /* Bytes before the blank line, as in "cacheObject" */
+  int bodyMode;
+  int pin; /* Released by "diskCacheRelease" */
+} diskObject;
+
+typedef struct {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stores;
+  unsigned long skipped; /* Stores dropped: too large, or the log head was pinned by a reader */
+  unsigned long stale; /* Lookups that found a record past its freshness lifetime: left to the origin */
+} diskCacheStats;
+
+int diskCacheInit(const char *path, size_t size);
+void diskCacheStore(const char *key, const char *data, size_t size, size_t headerSize, int bodyMode, long long freshUntil);
+int diskCacheAcquire(const char *key, diskObject *pObject);
+void diskCacheRelease(diskObject *pObject);
+void diskCacheGetStats(diskCacheStats *pStats);
+
+#endif
@@ -1,18 +1,143 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include "event-log.h"
 
 #define TARGET_DIRECTORY "event-log"
 #define FILE_NAME "event-log/proxy-event.log"
 
+typedef struct {
+  time_t time;
+  char message[EVENT_LOG_MESSAGE_SIZE];
+} eventSlot;
+
+/* Single-producer single-consumer ring: its thread appends, the writer drains */
+typedef struct eventRing {
+  eventSlot slots[EVENT_LOG_RING_SLOTS];
+  atomic_uint head; /* Next slot the writer reads, advanced by the writer only */
+  atomic_uint tail; /* Next slot the thread fills, advanced by the thread only */
+  atomic_ulong dropped; /* Events lost because the ring was full */
+  struct eventRing *pNext; /* Registry, only ever prepended */
+} eventRing;
+
+static _Atomic(eventRing *) pRings;
+static __thread eventRing *pThreadRing;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER; /* One consumer at a time: the writer or a final flush */
+static int logfd = -1;
+static sigset_t shutdownSignals;
+static unsigned long reportedDrops; /* Guarded by "drainLock" */
+
+static eventRing *threadRing(void);
+static void *writerThread(void *pArgument);
+static int drainRings(void);
+static size_t formatTime(char *buffer, time_t time);
+
+void eventLogInit(void) {
+  /* Call before any other thread starts: they all inherit the blocked shutdown signals, which only the writer takes */
+  pthread_t threadId;
+  logfd = open(FILE_NAME, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  sigemptyset(&shutdownSignals);
+  sigaddset(&shutdownSignals, SIGINT);
+  sigaddset(&shutdownSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &shutdownSignals, NULL);
+  atexit(eventLogFlush); /* Fatal csapp errors exit() too: their last events still land */
+  if(pthread_create(&threadId, NULL, writerThread, NULL) == 0) pthread_detach(threadId);
+}
 void writeEvent(const char *message) {
-  FILE *pFile = fopen(FILE_NAME, "a");
-  if(pFile == NULL) return;
+  /* Lock-free: copy into this thread's ring, or count a drop when the writer is behind */
+  eventRing *pRing = threadRing();
+  if(pRing == NULL) return;
+  unsigned int tail = atomic_load_explicit(&pRing->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&pRing->head, memory_order_acquire);
+  if(tail - head == EVENT_LOG_RING_SLOTS) {
+    atomic_fetch_add_explicit(&pRing->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  eventSlot *pSlot = &pRing->slots[tail % EVENT_LOG_RING_SLOTS];
+  pSlot->time = time(NULL);
+  strncpy(pSlot->message, message, EVENT_LOG_MESSAGE_SIZE - 1);
+  pSlot->message[EVENT_LOG_MESSAGE_SIZE - 1] = '\0';
+  atomic_store_explicit(&pRing->tail, tail + 1, memory_order_release); /* Publishes the slot */
+}
+void eventLogFlush(void) {
+  while(drainRings() > 0);
+}
+unsigned long eventLogDropped(void) {
+  unsigned long dropped = 0;
+  for(eventRing *p = atomic_load(&pRings); p != NULL; p = p->pNext) dropped += atomic_load_explicit(&p->dropped, memory_order_relaxed);
+  return dropped;
+}
 
-  time_t currentUtc = time(NULL);
-  struct tm *pCurrentLocal = localtime(&currentUtc);
+static eventRing *threadRing(void) {
+  /* Allocated on a thread's first event and kept for the life of the process */
+  if(pThreadRing != NULL) return pThreadRing;
+  eventRing *pRing = calloc(1, sizeof(eventRing));
+  if(pRing == NULL) return NULL;
+  pRing->pNext = atomic_load(&pRings);
+  while(!atomic_compare_exchange_weak(&pRings, &pRing->pNext, pRing));
+  pThreadRing = pRing;
+  return pRing;
+}
+static void *writerThread(void *pArgument) {
+  struct timespec idle = { 0, EVENT_LOG_IDLE_MS * 1000000L };
+  while(1) {
+    if(drainRings() > 0) continue; /* Keep going while events arrive */
+    if(sigtimedwait(&shutdownSignals, NULL, &idle) > 0) { /* Ctrl-C or kill: flush, then leave */
+      writeEvent("Shutting down.");
+      exit(0); /* Runs "eventLogFlush" */
+    }
+  }
+  return NULL;
+}
+static int drainRings(void) {
+  /* Formats every published event into one batch per write(); returns how many were written */
+  static char batch[EVENT_LOG_BATCH_SIZE];
+  size_t size = 0;
+  int count = 0;
 
-  fprintf(pFile, "[%04d-%02d-%02d %02d:%02d:%02d] %s\n", pCurrentLocal->tm_year + 1900, pCurrentLocal->tm_mon + 1, pCurrentLocal->tm_mday, pCurrentLocal->tm_hour, pCurrentLocal->tm_min, pCurrentLocal->tm_sec, message);
-  fclose(pFile);
+  pthread_mutex_lock(&drainLock);
+  for(eventRing *pRing = atomic_load(&pRings); pRing != NULL; pRing = pRing->pNext) {
+    unsigned int head = atomic_load_explicit(&pRing->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&pRing->tail, memory_order_acquire);
+    for(; head != tail; head++, count++) {
+      eventSlot *pSlot = &pRing->slots[head % EVENT_LOG_RING_SLOTS];
+      if(size + EVENT_LOG_MESSAGE_SIZE + 32 > sizeof(batch)) {
+        if(logfd >= 0 && write(logfd, batch, size) < 0) { /* Nowhere left to report it */ }
+        size = 0;
+      }
+      size += formatTime(batch + size, pSlot->time);
+      size += snprintf(batch + size, sizeof(batch) - size, "%s\n", pSlot->message);
+    }
+    atomic_store_explicit(&pRing->head, head, memory_order_release); /* Hands the slots back */
+  }
+  unsigned long dropped = eventLogDropped();
+  if(dropped != reportedDrops && size + 64 <= sizeof(batch)) {
+    size += formatTime(batch + size, time(NULL));
+    size += snprintf(batch + size, sizeof(batch) - size, "%lu events dropped: log rings were full.\n", dropped - reportedDrops);
+    reportedDrops = dropped;
+  }
+  if(size > 0 && logfd >= 0 && write(logfd, batch, size) < 0) { /* Nowhere left to report it */ }
+  pthread_mutex_unlock(&drainLock);
+  return count;
+}
+static size_t formatTime(char *buffer, time_t time) {
+  /* Caller holds "drainLock": the formatted prefix is reused for every event of the same second */
+  static time_t cachedTime = -1;
+  static char cachedPrefix[32];
+  static size_t cachedSize;
+  if(time != cachedTime) {
+    struct tm local;
+    localtime_r(&time, &local);
+    cachedSize = strftime(cachedPrefix, sizeof(cachedPrefix), "[%Y-%m-%d %H:%M:%S] ", &local);
+    cachedTime = time;
+  }
+  memcpy(buffer, cachedPrefix, cachedSize);
+  return cachedSize;
 }
@@ -1,6 +1,14 @@
 #ifndef EVENT_LOG_H
 #define EVENT_LOG_H
 
+#define EVENT_LOG_RING_SLOTS 256 /* Events a thread may have in flight before it starts dropping */
+#define EVENT_LOG_MESSAGE_SIZE 240 /* Longer messages are cut */
+#define EVENT_LOG_BATCH_SIZE 65536 /* Bytes the writer formats before each write() */
+#define EVENT_LOG_IDLE_MS 50 /* How long the writer sleeps when every ring is empty */
+
+void eventLogInit(void);
 void writeEvent(const char *message);
+void eventLogFlush(void);
+unsigned long eventLogDropped(void);
 
 #endif
@@ -0,0 +1,12 @@
+/* Kept apart from csapp.h: _GNU_SOURCE makes netdb.h declare a conflicting "gai_error" */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include "cpu-affinity.h"
+
+int pinThreadToCpu(int cpu) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) ? -1 : 0;
+}
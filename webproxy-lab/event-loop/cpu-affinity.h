@@ -0,0 +1,6 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+int pinThreadToCpu(int cpu);
+
+#endif
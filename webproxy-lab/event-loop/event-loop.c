@@ -0,0 +1,619 @@
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include "../csapp.h"
+#include "../proxy-help.h"
+#include "../event-log/event-log.h"
+#include "../cache/cache.h"
+#include "../request/request.h"
+#include "../relay/relay.h"
+#include "../response/response.h"
+#include "../resolver/resolver.h"
+#include "../buffer-pool/buffer-pool.h"
+#include "../slab/slab.h"
+#include "../flight/flight.h"
+#include "../disk-cache/disk-cache.h"
+#include "../metrics/metrics.h"
+#include "../revalidator/revalidator.h"
+#include "event-loop.h"
+#include "cpu-affinity.h"
+
+#define MAX_EVENTS 256 /* Events handled per epoll_wait */
+#define CONNECTIONS_PER_SLAB 16
+
+#define STEP_WAIT 0 /* Blocked on the kernel: wait for the next edge */
+#define STEP_NEXT 1 /* State changed: keep driving */
+#define STEP_CLOSE 2 /* Transaction finished or failed */
+
+typedef enum {
+  STATE_READING_REQUEST, /* Accumulating the client header block */
+  STATE_FOLLOWING, /* Waiting for another request's fetch of the same object to settle */
+  STATE_RESOLVING, /* Waiting for a resolver thread to look up the origin */
+  STATE_CONNECTING, /* Non-blocking connect to the origin in flight */
+  STATE_WRITING_REQUEST, /* Sending the rewritten request to the origin */
+  STATE_RELAYING, /* Origin response flowing to the client through "output" while it is captured */
+  STATE_SPLICING, /* Uncacheable remainder moving origin -> pipe -> client inside the kernel */
+  STATE_WRITING_CACHED, /* Cached object flowing to the client */
+  STATE_SENDING_DISK /* Disk-cached object flowing from the page cache to the client */
+} connectionState;
+
+struct connection;
+typedef struct {
+  struct connection *pConnection;
+  int fd;
+} endpoint; /* What "epoll_event.data.ptr" points at: one side of a connection */
+
+typedef struct connection {
+  connectionState state;
+  endpoint client, server;
+  char input[MAXBUF]; /* Client header block */
+  size_t inputSize;
+  requestParser request; /* Resumed on every read until the head is complete */
+  headerBuilder outbound; /* Request toward the origin: slices of "input" plus the proxy's lines */
+  int partsSent; /* Whole parts written; the next one is advanced past any partial write */
+  pooledBuffer output; /* Response chunks toward the client, borrowed only while relaying */
+  size_t outputSize, outputSent;
+  char *cacheKey;
+  char hostname[RESOLVER_HOST_SIZE], port[16]; /* Origin, kept while its address is looked up */
+  int addressIndex; /* Next of the origin's addresses to dial: a failed connect moves on to it */
+  flight *pFlight; /* Fetch this connection leads or follows */
+  int isFlightLeader;
+  int isParked; /* Linked into the loop's "pParked" list */
+  struct connection *pPreviousParked, *pNextParked;
+  cacheCapture capture;
+  int pipefd[2]; /* Splice pipe, opened once the response stops being captured */
+  size_t pipeSize; /* Bytes sitting in the pipe */
+  int isSpliceable;
+  cacheObject *pObject; /* Set while a cache hit is being written */
+  int isStale; /* "pObject" is past its freshness lifetime: served while it is revalidated, or for a failed origin */
+  cacheObject *pStale; /* Stale object being refetched; answers instead if the origin cannot be reached */
+  size_t objectSent; /* Also counts what was sent of "disk" */
+  diskObject disk;
+  int isDiskPinned; /* "disk" holds a record until the connection closes */
+  long long requestNs; /* When the request head was complete */
+  long long stageNs; /* When the current timed stage began */
+  int hasFirstByte; /* The origin has answered */
+  int isClosed;
+  struct connection *pNextClosed;
+} connection;
+
+typedef struct {
+  int epollfd;
+  int listenfd;
+  int cpu; /* Core this loop is pinned to, or -1 */
+  int notifyfd; /* eventfd the resolver threads and flight leaders poke when something settles */
+  endpoint notifier; /* Tags "notifyfd" events: it has no connection */
+  connection *pParked; /* Connections waiting on a lookup or a flight */
+  connection *pClosed; /* Freed after the current batch: later events in it may still point here */
+  slabCache connections; /* Only this loop's thread allocates and frees them */
+} eventLoop;
+
+static eventLoop *createLoop(int listenfd, unsigned int listenEvents, int cpu);
+static void startLoop(eventLoop *pLoop, int isLast);
+static void *loopThread(void *pArgument);
+static void runLoop(eventLoop *pLoop);
+static void acceptConnections(eventLoop *pLoop);
+static void driveConnection(eventLoop *pLoop, connection *pConnection, int isServerEvent, unsigned int events);
+static int readRequest(eventLoop *pLoop, connection *pConnection);
+static int beginTransaction(eventLoop *pLoop, connection *pConnection);
+static int followFlight(eventLoop *pLoop, connection *pConnection);
+static int resolveOrigin(eventLoop *pLoop, connection *pConnection);
+static void parkConnection(eventLoop *pLoop, connection *pConnection);
+static void retryParked(eventLoop *pLoop);
+static void unlinkParked(eventLoop *pLoop, connection *pConnection);
+static int finishConnect(connection *pConnection, int isServerEvent, unsigned int events);
+static int writeRequest(connection *pConnection);
+static int relayResponse(connection *pConnection);
+static int spliceResponse(connection *pConnection);
+static int writeCached(connection *pConnection);
+static int sendDiskObject(connection *pConnection);
+static void noteOriginBytes(connection *pConnection, ssize_t size);
+static int clientFailed(void);
+static int originUnreachable(connection *pConnection);
+static int finishTransaction(connection *pConnection, metricCounter source);
+static void closeConnection(eventLoop *pLoop, connection *pConnection);
+static int openNonblockingClientfd(const resolverResult *pResult, int *pIndex, int *pIsConnected);
+static int watchEndpoint(eventLoop *pLoop, endpoint *pEndpoint);
+static void raiseDescriptorLimit(void);
+
+void eventLoopRun(int listenfd, int loopCount) {
+  raiseDescriptorLimit();
+  fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+  /* Every loop watches the shared listener; EPOLLEXCLUSIVE wakes only one of them per connection */
+  for(int i = 0; i < loopCount; i++) startLoop(createLoop(listenfd, EPOLLIN | EPOLLEXCLUSIVE, -1), i == loopCount - 1);
+}
+void eventLoopRunReactors(char *port, int loopCount, int isPinned) {
+  int cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  raiseDescriptorLimit();
+
+  /* One SO_REUSEPORT listener per reactor: the kernel picks the reactor, nothing is handed across cores */
+  for(int i = 0; i < loopCount; i++) {
+    int listenfd = Open_reuseport_listenfd(port);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    startLoop(createLoop(listenfd, EPOLLIN, isPinned ? i % cpuCount : -1), i == loopCount - 1);
+  }
+}
+
+static eventLoop *createLoop(int listenfd, unsigned int listenEvents, int cpu) {
+  eventLoop *pLoop = Malloc(sizeof(eventLoop));
+  pLoop->listenfd = listenfd;
+  pLoop->cpu = cpu;
+  pLoop->pClosed = NULL;
+  pLoop->pParked = NULL;
+  slabInit(&pLoop->connections, sizeof(connection), CONNECTIONS_PER_SLAB);
+  if((pLoop->epollfd = epoll_create1(0)) < 0) unix_error("epoll_create1 error");
+  struct epoll_event event = { .events = listenEvents, .data.ptr = NULL };
+  if(epoll_ctl(pLoop->epollfd, EPOLL_CTL_ADD, listenfd, &event) < 0) unix_error("epoll_ctl error");
+  if((pLoop->notifyfd = eventfd(0, EFD_NONBLOCK)) < 0) unix_error("eventfd error");
+  pLoop->notifier.pConnection = NULL;
+  pLoop->notifier.fd = pLoop->notifyfd;
+  struct epoll_event notifyEvent = { .events = EPOLLIN, .data.ptr = &pLoop->notifier };
+  if(epoll_ctl(pLoop->epollfd, EPOLL_CTL_ADD, pLoop->notifyfd, &notifyEvent) < 0) unix_error("epoll_ctl error");
+  return pLoop;
+}
+static void startLoop(eventLoop *pLoop, int isLast) {
+  pthread_t threadId;
+  if(isLast) runLoop(pLoop); /* The calling thread drives the last loop */
+  else Pthread_create(&threadId, NULL, loopThread, pLoop);
+}
+static void *loopThread(void *pArgument) {
+  Pthread_detach(Pthread_self());
+  runLoop((eventLoop *)pArgument);
+  return NULL;
+}
+static void runLoop(eventLoop *pLoop) {
+  struct epoll_event events[MAX_EVENTS];
+  if(pLoop->cpu >= 0 && pinThreadToCpu(pLoop->cpu) < 0) writeEvent("Failed to pin event loop to its CPU.");
+  while(True) {
+    int n = epoll_wait(pLoop->epollfd, events, MAX_EVENTS, -1);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      unix_error("epoll_wait error");
+    }
+    for(int i = 0; i < n; i++) {
+      endpoint *pEndpoint = events[i].data.ptr;
+      if(pEndpoint == NULL) {
+        acceptConnections(pLoop);
+        continue;
+      }
+      if(pEndpoint == &pLoop->notifier) {
+        retryParked(pLoop);
+        continue;
+      }
+      connection *pConnection = pEndpoint->pConnection;
+      if(pConnection->isClosed) continue;
+      driveConnection(pLoop, pConnection, pEndpoint == &pConnection->server, events[i].events);
+    }
+    while(pLoop->pClosed != NULL) {
+      connection *pConnection = pLoop->pClosed;
+      pLoop->pClosed = pConnection->pNextClosed;
+      slabFree(&pLoop->connections, pConnection);
+    }
+  }
+}
+static void acceptConnections(eventLoop *pLoop) {
+  while(True) {
+    int clientfd = accept(pLoop->listenfd, NULL, NULL);
+    if(clientfd < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EMFILE || errno == ENFILE) writeEvent("Descriptor limit reached: connection left in the listen backlog.");
+      if(errno == ECONNABORTED) { /* Reset while queued: the next one may be fine */
+        metricsCount(METRIC_ACCEPT_ERRORS, 1);
+        continue;
+      }
+      if(errno != EAGAIN && errno != EWOULDBLOCK) metricsCount(METRIC_ACCEPT_ERRORS, 1);
+      return; /* EAGAIN: another loop took it, or the backlog is drained */
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+    metricsCount(METRIC_CONNECTIONS_ACCEPTED, 1);
+    connection *pConnection = slabAlloc(&pLoop->connections);
+    pConnection->state = STATE_READING_REQUEST;
+    pConnection->client.pConnection = pConnection->server.pConnection = pConnection;
+    pConnection->client.fd = clientfd;
+    pConnection->server.fd = -1;
+    pConnection->addressIndex = 0;
+    pConnection->inputSize = 0;
+    requestParserInit(&pConnection->request);
+    pConnection->output.data = NULL;
+    pConnection->outputSize = pConnection->outputSent = 0;
+    pConnection->cacheKey = NULL;
+    pConnection->pFlight = NULL;
+    pConnection->isFlightLeader = False;
+    pConnection->isParked = False;
+    cacheCaptureInit(&pConnection->capture);
+    pConnection->pipefd[0] = pConnection->pipefd[1] = -1;
+    pConnection->pipeSize = 0;
+    pConnection->isSpliceable = True;
+    pConnection->pObject = NULL;
+    pConnection->isStale = False;
+    pConnection->pStale = NULL;
+    pConnection->objectSent = 0;
+    pConnection->isDiskPinned = False;
+    pConnection->hasFirstByte = False;
+    pConnection->isClosed = False;
+    if(watchEndpoint(pLoop, &pConnection->client) < 0) closeConnection(pLoop, pConnection); /* Data that is already queued raises the first edge immediately */
+  }
+}
+static void driveConnection(eventLoop *pLoop, connection *pConnection, int isServerEvent, unsigned int events) {
+  /* Edge-triggered: every step runs until the kernel says EAGAIN, so no readiness is ever left unconsumed */
+  int step = STEP_NEXT;
+  while(step == STEP_NEXT) {
+    switch(pConnection->state) {
+      case STATE_READING_REQUEST: step = readRequest(pLoop, pConnection); break;
+      case STATE_FOLLOWING: step = followFlight(pLoop, pConnection); break;
+      case STATE_RESOLVING: step = resolveOrigin(pLoop, pConnection); break;
+      case STATE_CONNECTING: step = finishConnect(pConnection, isServerEvent, events); break;
+      case STATE_WRITING_REQUEST: step = writeRequest(pConnection); break;
+      case STATE_RELAYING: step = relayResponse(pConnection); break;
+      case STATE_SPLICING: step = spliceResponse(pConnection); break;
+      case STATE_WRITING_CACHED: step = writeCached(pConnection); break;
+      case STATE_SENDING_DISK: step = sendDiskObject(pConnection); break;
+    }
+  }
+  if(step == STEP_CLOSE) closeConnection(pLoop, pConnection);
+}
+static int readRequest(eventLoop *pLoop, connection *pConnection) {
+  while(True) {
+    size_t capacity = sizeof(pConnection->input);
+    if(pConnection->inputSize == capacity) { /* Header block larger than the proxy accepts */
+      if(write(pConnection->client.fd, REQUEST_TOO_LARGE_RESPONSE, strlen(REQUEST_TOO_LARGE_RESPONSE)) < 0) { /* Best effort: closing anyway */ }
+      writeEvent("Request head larger than the read buffer: answered 431.");
+      return STEP_CLOSE;
+    }
+    ssize_t n = read(pConnection->client.fd, pConnection->input + pConnection->inputSize, capacity - pConnection->inputSize);
+    if(n > 0) {
+      pConnection->inputSize += n;
+      int status = requestParse(&pConnection->request, pConnection->input, pConnection->inputSize); /* Picks up where the last read stopped */
+      if(status == PARSE_DONE) {
+        pConnection->requestNs = metricsNow();
+        metricsCount(METRIC_REQUESTS, 1);
+        return beginTransaction(pLoop, pConnection);
+      }
+      if(status == PARSE_ERROR) return STEP_CLOSE;
+      continue;
+    }
+    if(n == 0) return STEP_CLOSE;
+    if(errno == EINTR) continue;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? STEP_WAIT : STEP_CLOSE;
+  }
+}
+static int beginTransaction(eventLoop *pLoop, connection *pConnection) {
+  char hostname[MAXLINE], port[16], path[MAXLINE]; /* Components Of URI */
+  char cacheKey[CACHE_KEY_SIZE];
+  const requestParser *pRequest = &pConnection->request;
+
+  /* Use The Parsed Head */
+  if(!requestSpanEquals(pConnection->input, pRequest->method, "GET")) return STEP_CLOSE;
+  requestCopyTarget(pConnection->input, pRequest, hostname, port, path); /* Parse hostname, port, path */
+  headerBuilderBuild(&pConnection->outbound, pConnection->input, pRequest, user_agent_hdr, False); /* HTTP/1.0: the origin closes after the response */
+
+  /* Serve From The Cache */
+  cacheMakeKey(cacheKey, sizeof(cacheKey), hostname, port, path);
+  pConnection->stageNs = metricsRecord(METRIC_STAGE_PARSE, pConnection->requestNs); /* Resolving starts the connect stage */
+  pConnection->pObject = cacheAcquire(cacheKey);
+  int role = FLIGHT_LEADER;
+  if(pConnection->pObject != NULL) {
+    int freshness = cacheFreshness(pConnection->pObject, time(NULL));
+    if(freshness == CACHE_STALE) { /* Fetched again whole: responses are relayed verbatim here, so a 304 could not be turned into the stored copy */
+      pConnection->pStale = pConnection->pObject;
+      pConnection->pObject = NULL;
+    }
+    else if(freshness == CACHE_STALE_WHILE_REVALIDATE && cacheClaimRevalidation(pConnection->pObject)) revalidatorSchedule(pConnection->pObject, hostname, port, path);
+    pConnection->isStale = (freshness != CACHE_FRESH);
+  }
+  if(pConnection->pObject == NULL && pConnection->pStale == NULL && diskCacheAcquire(cacheKey, &pConnection->disk) == 0) { /* Evicted from RAM, or cached before a restart */
+    pConnection->isDiskPinned = True;
+    pConnection->state = STATE_SENDING_DISK;
+    return STEP_NEXT;
+  }
+  if(pConnection->pObject == NULL && pConnection->pStale == NULL) role = flightJoin(cacheKey, &pConnection->pFlight, &pConnection->pObject); /* Concurrent misses on one key share a single fetch */
+  pConnection->isFlightLeader = (role == FLIGHT_LEADER); /* From here on, closing abandons a flight it leads */
+  if(pConnection->pObject != NULL) {
+    pConnection->state = STATE_WRITING_CACHED;
+    return STEP_NEXT;
+  }
+  pConnection->cacheKey = Malloc(strlen(cacheKey) + 1);
+  strcpy(pConnection->cacheKey, cacheKey);
+
+  /* Start Resolving; The Request Stays As Slices Until It Is Written */
+  pConnection->partsSent = 0;
+  if(strlen(hostname) >= sizeof(pConnection->hostname) || strlen(port) >= sizeof(pConnection->port)) return STEP_CLOSE;
+  strcpy(pConnection->hostname, hostname);
+  strcpy(pConnection->port, port);
+  pConnection->state = (role == FLIGHT_FOLLOWER) ? STATE_FOLLOWING : STATE_RESOLVING;
+  return STEP_NEXT;
+}
+static int followFlight(eventLoop *pLoop, connection *pConnection) {
+  int status = flightPoll(pConnection->pFlight, pLoop->notifyfd, &pConnection->pObject);
+  if(status == FLIGHT_PENDING) {
+    parkConnection(pLoop, pConnection);
+    return STEP_WAIT;
+  }
+  if(pConnection->isParked) unlinkParked(pLoop, pConnection);
+  flightLeave(pConnection->pFlight, False);
+  pConnection->pFlight = NULL;
+  pConnection->stageNs = metricsNow(); /* Abandoned: the connect stage starts only now */
+  pConnection->state = (status == FLIGHT_COMPLETE) ? STATE_WRITING_CACHED : STATE_RESOLVING; /* Abandoned: fetch it without a flight */
+  return STEP_NEXT;
+}
+static int resolveOrigin(eventLoop *pLoop, connection *pConnection) {
+  resolverResult result;
+  int status = resolverLookupAsync(pConnection->hostname, pConnection->port, &result, pLoop->notifyfd);
+  if(status == RESOLVER_PENDING) {
+    parkConnection(pLoop, pConnection);
+    return STEP_WAIT;
+  }
+  if(pConnection->isParked) unlinkParked(pLoop, pConnection);
+  if(status == RESOLVER_FAILED) {
+    writeEvent("Failed to resolve server.");
+    metricsCount(METRIC_ORIGIN_CONNECT_ERRORS, 1);
+    return originUnreachable(pConnection);
+  }
+
+  /* Start Connecting */
+  int isConnected;
+  pConnection->server.fd = openNonblockingClientfd(&result, &pConnection->addressIndex, &isConnected);
+  if(pConnection->server.fd < 0) {
+    writeEvent("Failed to connect to server.");
+    metricsCount(METRIC_ORIGIN_CONNECT_ERRORS, 1);
+    return originUnreachable(pConnection);
+  }
+  if(watchEndpoint(pLoop, &pConnection->server) < 0) {
+    metricsCount(METRIC_ORIGIN_CONNECT_ERRORS, 1);
+    return STEP_CLOSE;
+  }
+  if(isConnected) pConnection->stageNs = metricsRecord(METRIC_STAGE_CONNECT, pConnection->stageNs);
+  pConnection->state = isConnected ? STATE_WRITING_REQUEST : STATE_CONNECTING;
+  return isConnected ? STEP_NEXT : STEP_WAIT;
+}
+static void parkConnection(eventLoop *pLoop, connection *pConnection) {
+  if(pConnection->isParked) return; /* Parked until "notifyfd" fires */
+  pConnection->isParked = True;
+  pConnection->pPreviousParked = NULL;
+  pConnection->pNextParked = pLoop->pParked;
+  if(pLoop->pParked != NULL) pLoop->pParked->pPreviousParked = pConnection;
+  pLoop->pParked = pConnection;
+}
+static void retryParked(eventLoop *pLoop) {
+  /* Some lookup or flight settled: every parked connection asks again, the settled ones move on */
+  uint64_t count;
+  if(read(pLoop->notifyfd, &count, sizeof(count)) < 0) { /* Already drained */ }
+  connection *pConnection = pLoop->pParked;
+  pLoop->pParked = NULL;
+  while(pConnection != NULL) {
+    connection *pNext = pConnection->pNextParked;
+    pConnection->isParked = False; /* Still-pending ones park themselves again */
+    driveConnection(pLoop, pConnection, False, 0);
+    pConnection = pNext;
+  }
+}
+static void unlinkParked(eventLoop *pLoop, connection *pConnection) {
+  if(pConnection->pPreviousParked != NULL) pConnection->pPreviousParked->pNextParked = pConnection->pNextParked;
+  else pLoop->pParked = pConnection->pNextParked;
+  if(pConnection->pNextParked != NULL) pConnection->pNextParked->pPreviousParked = pConnection->pPreviousParked;
+  pConnection->isParked = False;
+}
+static int finishConnect(connection *pConnection, int isServerEvent, unsigned int events) {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if(!isServerEvent || !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return STEP_WAIT; /* Not the origin's writable edge yet */
+  if(getsockopt(pConnection->server.fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+    close(pConnection->server.fd); /* Also drops it from the epoll set */
+    pConnection->server.fd = -1;
+    pConnection->state = STATE_RESOLVING; /* The answer is cached: the next address is dialed at once, and failing all of them closes */
+    return STEP_NEXT;
+  }
+  struct sockaddr_storage peer;
+  socklen_t peerLength = sizeof(peer);
+  if(getpeername(pConnection->server.fd, (struct sockaddr *)&peer, &peerLength) < 0) return STEP_WAIT; /* A late edge of an address already given up on */
+  pConnection->stageNs = metricsRecord(METRIC_STAGE_CONNECT, pConnection->stageNs);
+  pConnection->state = STATE_WRITING_REQUEST;
+  return STEP_NEXT;
+}
+static int writeRequest(connection *pConnection) {
+  struct iovec *parts = pConnection->outbound.parts;
+  int partCount = pConnection->outbound.partCount;
+  while(pConnection->partsSent < partCount) {
+    ssize_t n = writev(pConnection->server.fd, parts + pConnection->partsSent, partCount - pConnection->partsSent);
+    if(n > 0) {
+      while(pConnection->partsSent < partCount && (size_t)n >= parts[pConnection->partsSent].iov_len) n -= parts[pConnection->partsSent++].iov_len;
+      if(n > 0) { /* Short write inside a part */
+        parts[pConnection->partsSent].iov_base = (char *)parts[pConnection->partsSent].iov_base + n;
+        parts[pConnection->partsSent].iov_len -= n;
+      }
+    }
+    else if(n < 0 && errno == EINTR) continue;
+    else return (n < 0 && errno == EAGAIN) ? STEP_WAIT : STEP_CLOSE;
+  }
+  pConnection->stageNs = metricsRecord(METRIC_STAGE_WRITE, pConnection->stageNs);
+  bufferPoolAcquire(&pConnection->output);
+  pConnection->outputSize = pConnection->outputSent = 0;
+  pConnection->state = STATE_RELAYING;
+  return STEP_NEXT;
+}
+static int relayResponse(connection *pConnection) {
+  while(True) {
+    /* Flush What The Client Has Not Taken Yet */
+    if(pConnection->outputSent < pConnection->outputSize) {
+      ssize_t n = write(pConnection->client.fd, pConnection->output.data + pConnection->outputSent, pConnection->outputSize - pConnection->outputSent);
+      if(n > 0) {
+        pConnection->outputSent += n;
+        metricsCount(METRIC_CLIENT_BYTES_SENT, n);
+      }
+      else if(n < 0 && errno == EINTR) continue;
+      else return (n < 0 && errno == EAGAIN) ? STEP_WAIT : clientFailed(); /* Client went away: the capture is dropped */
+      continue;
+    }
+
+    /* Stop Copying Once Nothing Needs Capturing */
+    if(!pConnection->capture.isCapturing && pConnection->isSpliceable) {
+      if(relayOpenPipe(pConnection->pipefd) == 0) {
+        bufferPoolRelease(&pConnection->output); /* The kernel holds the bytes from here */
+        pConnection->state = STATE_SPLICING;
+        return STEP_NEXT;
+      }
+      pConnection->isSpliceable = False;
+    }
+
+    /* Pull The Next Chunk From The Origin */
+    if(pConnection->outputSize == pConnection->output.capacity) bufferPoolGrow(&pConnection->output); /* The last read filled it: a fast link */
+    ssize_t n = read(pConnection->server.fd, pConnection->output.data, pConnection->output.capacity);
+    if(n > 0) {
+      noteOriginBytes(pConnection, n);
+      pConnection->outputSize = n;
+      pConnection->outputSent = 0;
+      flightAppend(pConnection->pFlight, &pConnection->capture, pConnection->output.data, n);
+      continue;
+    }
+    if(n == 0) { /* Origin closed: the response is complete */
+      flightFinish(pConnection->pFlight, &pConnection->capture, pConnection->cacheKey, BODY_UNTIL_CLOSE, True); /* Framing was never parsed here */
+      return finishTransaction(pConnection, METRIC_MISSES);
+    }
+    if(errno == EINTR) continue;
+    if(errno == EAGAIN || errno == EWOULDBLOCK) return STEP_WAIT;
+    metricsCount(METRIC_ORIGIN_RESPONSE_ERRORS, 1);
+    return STEP_CLOSE;
+  }
+}
+static int spliceResponse(connection *pConnection) {
+  while(True) {
+    ssize_t n;
+    if(pConnection->pipeSize > 0) { /* Drain the pipe into the client first */
+      n = relaySpliceChunk(pConnection->pipefd[0], pConnection->client.fd, pConnection->pipeSize);
+      if(n > 0) {
+        pConnection->pipeSize -= n;
+        metricsCount(METRIC_CLIENT_BYTES_SENT, n);
+      }
+      else if(n < 0 && errno == EINTR) continue;
+      else return (n < 0 && errno == EAGAIN) ? STEP_WAIT : clientFailed();
+      continue;
+    }
+    n = relaySpliceChunk(pConnection->server.fd, pConnection->pipefd[1], RELAY_CHUNK_SIZE);
+    if(n > 0) {
+      noteOriginBytes(pConnection, n);
+      pConnection->pipeSize += n;
+      continue;
+    }
+    if(n == 0) return finishTransaction(pConnection, METRIC_MISSES); /* Origin closed: the response is complete */
+    if(errno == EINTR) continue;
+    if(errno == EINVAL) { /* Descriptors splice() cannot handle: go back to copying */
+      pConnection->isSpliceable = False;
+      bufferPoolAcquire(&pConnection->output);
+      pConnection->outputSize = pConnection->outputSent = 0;
+      pConnection->state = STATE_RELAYING;
+      return STEP_NEXT;
+    }
+    if(errno == EAGAIN) return STEP_WAIT;
+    metricsCount(METRIC_ORIGIN_RESPONSE_ERRORS, 1);
+    return STEP_CLOSE;
+  }
+}
+static int writeCached(connection *pConnection) {
+  cacheObject *pObject = pConnection->pObject;
+  while(pConnection->objectSent < pObject->size) {
+    ssize_t n = write(pConnection->client.fd, pObject->data + pConnection->objectSent, pObject->size - pConnection->objectSent);
+    if(n > 0) pConnection->objectSent += n;
+    else if(n < 0 && errno == EINTR) continue;
+    else return (n < 0 && errno == EAGAIN) ? STEP_WAIT : clientFailed();
+  }
+  metricsCount(METRIC_CLIENT_BYTES_SENT, pObject->size);
+  if(pConnection->isStale) return finishTransaction(pConnection, METRIC_STALE_HITS);
+  return finishTransaction(pConnection, pConnection->isFlightLeader ? METRIC_CACHE_HITS : METRIC_COALESCED);
+}
+static int sendDiskObject(connection *pConnection) {
+  diskObject *pObject = &pConnection->disk;
+  while(pConnection->objectSent < pObject->size) {
+    ssize_t n = relaySendfileChunk(pObject->fd, pObject->offset + pConnection->objectSent, pConnection->client.fd, pObject->size - pConnection->objectSent);
+    if(n > 0) pConnection->objectSent += n;
+    else if(n < 0 && errno == EINTR) continue;
+    else return (n < 0 && errno == EAGAIN) ? STEP_WAIT : clientFailed();
+  }
+  metricsCount(METRIC_CLIENT_BYTES_SENT, pObject->size);
+  return finishTransaction(pConnection, METRIC_DISK_HITS);
+}
+static void noteOriginBytes(connection *pConnection, ssize_t size) {
+  metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, size);
+  if(pConnection->hasFirstByte) return;
+  pConnection->hasFirstByte = True;
+  pConnection->stageNs = metricsRecord(METRIC_STAGE_FIRST_BYTE, pConnection->stageNs); /* Relaying starts now */
+}
+static int clientFailed(void) {
+  /* A send to the client failed for good: only this connection closes */
+  metricsCount(METRIC_CLIENT_SEND_ERRORS, 1);
+  return STEP_CLOSE;
+}
+static int originUnreachable(connection *pConnection) {
+  /* Resolving or connecting failed: a stale object stale-if-error still covers is sent instead */
+  cacheObject *pStale = pConnection->pStale;
+  if(pStale == NULL || !cacheServesOnError(pStale, time(NULL))) return STEP_CLOSE;
+  pConnection->pObject = pStale;
+  pConnection->pStale = NULL;
+  pConnection->state = STATE_WRITING_CACHED;
+  return STEP_NEXT;
+}
+static int finishTransaction(connection *pConnection, metricCounter source) {
+  /* The response reached the client whole: the connection closes with it */
+  if(pConnection->hasFirstByte) metricsRecord(METRIC_STAGE_RELAY, pConnection->stageNs);
+  metricsCount(source, 1);
+  metricsRecord(METRIC_STAGE_TOTAL, pConnection->requestNs);
+  return STEP_CLOSE;
+}
+static void closeConnection(eventLoop *pLoop, connection *pConnection) {
+  close(pConnection->client.fd); /* Closing also drops the descriptor from the epoll set */
+  if(pConnection->server.fd >= 0) close(pConnection->server.fd);
+  if(pConnection->pipefd[0] >= 0) {
+    close(pConnection->pipefd[0]);
+    close(pConnection->pipefd[1]);
+  }
+  flightLeave(pConnection->pFlight, pConnection->isFlightLeader); /* Before the capture goes: followers may still read it */
+  cacheCaptureDiscard(&pConnection->capture);
+  bufferPoolRelease(&pConnection->output);
+  if(pConnection->pObject != NULL) cacheRelease(pConnection->pObject);
+  if(pConnection->pStale != NULL) cacheRelease(pConnection->pStale);
+  if(pConnection->isDiskPinned) diskCacheRelease(&pConnection->disk);
+  if(pConnection->cacheKey != NULL) Free(pConnection->cacheKey);
+  if(pConnection->isParked) unlinkParked(pLoop, pConnection);
+  metricsCount(METRIC_CONNECTIONS_CLOSED, 1);
+  pConnection->isClosed = True;
+  pConnection->pNextClosed = pLoop->pClosed;
+  pLoop->pClosed = pConnection;
+}
+static int openNonblockingClientfd(const resolverResult *pResult, int *pIndex, int *pIsConnected) {
+  /* Same walk as "open_clientfd" from address "*pIndex" on, but the connect is left in flight for epoll to finish */
+  int clientfd = -1;
+
+  for(int i = *pIndex; i < pResult->count; i++) {
+    const resolverAddress *pAddress = &pResult->addresses[i];
+    *pIndex = i + 1;
+    if((clientfd = socket(pAddress->family, pAddress->socktype | SOCK_NONBLOCK, pAddress->protocol)) < 0) continue;
+    if(connect(clientfd, (const struct sockaddr *)&pAddress->address, pAddress->length) == 0) {
+      *pIsConnected = True;
+      break;
+    }
+    if(errno == EINPROGRESS) {
+      *pIsConnected = False;
+      break;
+    }
+    close(clientfd);
+    clientfd = -1;
+  }
+  return clientfd;
+}
+static int watchEndpoint(eventLoop *pLoop, endpoint *pEndpoint) {
+  /* -1 when the kernel cannot watch one more descriptor: the caller drops this connection, the loop keeps running */
+  struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = pEndpoint };
+  if(epoll_ctl(pLoop->epollfd, EPOLL_CTL_ADD, pEndpoint->fd, &event) < 0) {
+    writeEvent("Failed to watch a connection.");
+    return -1;
+  }
+  return 0;
+}
+static void raiseDescriptorLimit(void) {
+  /* Tens of thousands of client/origin pairs need far more than the usual 1024 descriptors */
+  struct rlimit limit;
+  if(getrlimit(RLIMIT_NOFILE, &limit) < 0) return;
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+}
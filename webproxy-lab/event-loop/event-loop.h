@@ -0,0 +1,7 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+void eventLoopRun(int listenfd, int loopCount);
+void eventLoopRunReactors(char *port, int loopCount, int isPinned);
+
+#endif
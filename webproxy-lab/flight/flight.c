@@ -0,0 +1,295 @@
+#include <stdint.h>
+#include <pthread.h>
+#include "../csapp.h"
+#include "flight.h"
+
+typedef enum {
+  STAGE_FETCHING, /* Head not published yet, or the body length is unknown: followers wait for the end */
+  STAGE_STREAMING, /* The whole object is known to fit: followers copy bytes as they arrive */
+  STAGE_COMPLETE, /* Cached; "pObject" keeps the bytes alive for followers still reading */
+  STAGE_ABANDONED /* The leader failed or the response cannot be cached */
+} flightStage;
+
+/* Event-loop descriptor to poke when a flight settles */
+typedef struct flightWaiter {
+  int notifyfd;
+  struct flightWaiter *pNext;
+} flightWaiter;
+
+struct flight {
+  char *key;
+  unsigned int hash;
+  int isRegistered; /* Still found by "flightJoin", guarded by the shard lock */
+  pthread_mutex_t lock;
+  pthread_cond_t changed; /* Broadcast on every append and stage change */
+  flightStage stage;
+  int referenceCount; /* Leader and followers attached */
+  cacheCapture *pCapture; /* The leader's capture, read by followers under "lock" until the flight settles */
+  cacheObject *pObject;
+  size_t size; /* Bytes published so far */
+  size_t headerSize;
+  int bodyMode;
+  flightWaiter *pWaiters;
+  struct flight *pBucketNext;
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  flight *buckets[FLIGHT_BUCKET_COUNT];
+  flightStats stats; /* Counted under "lock", summed by "flightGetStats" */
+} flightShard;
+
+static flightShard shards[FLIGHT_SHARD_COUNT];
+
+static flight *createFlight(const char *key, unsigned int hash);
+static flightWaiter *settleFlight(flight *pFlight, flightStage stage);
+static void retireFlight(flight *pFlight, flightWaiter *pWaiters, int isAbandoned);
+static void freeFlight(flight *pFlight);
+static unsigned int hashKey(const char *key);
+static flightShard *shardOf(unsigned int hash);
+static flight **bucketOf(flightShard *pShard, unsigned int hash);
+
+void flightInit(void) {
+  for(int i = 0; i < FLIGHT_SHARD_COUNT; i++) {
+    memset(&shards[i], 0, sizeof(flightShard));
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+}
+int flightJoin(const char *key, flight **ppFlight, cacheObject **ppObject) {
+  /* Called after a cache miss: the first caller leads the fetch, later ones follow it until it settles */
+  unsigned int hash = hashKey(key);
+  flightShard *pShard = shardOf(hash);
+  flight *pFlight;
+  int role;
+
+  *ppObject = NULL;
+  pthread_mutex_lock(&pShard->lock);
+  for(pFlight = *bucketOf(pShard, hash); pFlight != NULL; pFlight = pFlight->pBucketNext) {
+    if(pFlight->hash == hash && !strcmp(pFlight->key, key)) break;
+  }
+  if(pFlight != NULL) {
+    pthread_mutex_lock(&pFlight->lock);
+    pFlight->referenceCount++;
+    pthread_mutex_unlock(&pFlight->lock);
+    pShard->stats.followers++;
+    role = FLIGHT_FOLLOWER;
+  }
+  else if((*ppObject = cacheAcquire(key)) != NULL) role = FLIGHT_CACHED; /* A flight completed between the caller's miss and here */
+  else {
+    pFlight = createFlight(key, hash);
+    flight **pBucket = bucketOf(pShard, hash);
+    pFlight->pBucketNext = *pBucket;
+    *pBucket = pFlight;
+    pShard->stats.leaders++;
+    role = FLIGHT_LEADER;
+  }
+  pthread_mutex_unlock(&pShard->lock);
+  *ppFlight = pFlight;
+  return role;
+}
+void flightLeave(flight *pFlight, int isLeader) {
+  /* A leader leaving an unsettled flight abandons it: its followers fetch on their own */
+  flightWaiter *pWaiters = NULL;
+  int isAbandoning = 0, isLast;
+  if(pFlight == NULL) return;
+
+  pthread_mutex_lock(&pFlight->lock);
+  if(isLeader && pFlight->stage <= STAGE_STREAMING) {
+    pWaiters = settleFlight(pFlight, STAGE_ABANDONED);
+    isAbandoning = 1;
+  }
+  pthread_mutex_unlock(&pFlight->lock);
+  if(isAbandoning) retireFlight(pFlight, pWaiters, 1); /* Before dropping the reference: the last follower may free it right after */
+
+  pthread_mutex_lock(&pFlight->lock);
+  isLast = (--pFlight->referenceCount == 0);
+  pthread_mutex_unlock(&pFlight->lock);
+  if(isLast) freeFlight(pFlight);
+}
+void flightAppend(flight *pFlight, cacheCapture *pCapture, const char *data, size_t size) {
+  flightWaiter *pWaiters;
+  if(pFlight == NULL) {
+    cacheCaptureAppend(pCapture, data, size);
+    return;
+  }
+
+  pthread_mutex_lock(&pFlight->lock);
+  if(pFlight->stage > STAGE_STREAMING) { /* Settled: nobody reads this capture any more */
+    pthread_mutex_unlock(&pFlight->lock);
+    cacheCaptureAppend(pCapture, data, size);
+    return;
+  }
+  pFlight->pCapture = pCapture;
+  cacheCaptureAppend(pCapture, data, size);
+  if(!pCapture->isCapturing) { /* Too large or not a 200: the bytes are gone, so are the followers */
+    pWaiters = settleFlight(pFlight, STAGE_ABANDONED);
+    pthread_mutex_unlock(&pFlight->lock);
+    retireFlight(pFlight, pWaiters, 1);
+    return;
+  }
+  pFlight->size = pCapture->size;
+  pthread_cond_broadcast(&pFlight->changed);
+  pthread_mutex_unlock(&pFlight->lock);
+}
+void flightPublishHead(flight *pFlight, cacheCapture *pCapture, int bodyMode, long long bodyLength) {
+  /* Called once the header block and its blank line are appended; "bodyLength" is -1 when it is unknown */
+  if(pFlight == NULL) return;
+  pthread_mutex_lock(&pFlight->lock);
+  if(pFlight->stage == STAGE_FETCHING && pCapture->isCapturing && bodyLength >= 0 && pCapture->size + bodyLength <= cacheObjectCapacity()) {
+    pFlight->stage = STAGE_STREAMING; /* It will all fit, so followers may start sending */
+    pFlight->headerSize = pCapture->size - 2;
+    pFlight->bodyMode = bodyMode;
+    pthread_cond_broadcast(&pFlight->changed);
+  }
+  pthread_mutex_unlock(&pFlight->lock);
+}
+void flightFinish(flight *pFlight, cacheCapture *pCapture, const char *key, int bodyMode, int isComplete) {
+  /* Commits or discards the capture; with a flight, under its lock so no follower reads freed bytes */
+  flightWaiter *pWaiters;
+  if(pFlight != NULL) pthread_mutex_lock(&pFlight->lock);
+  if(pFlight == NULL || pFlight->stage > STAGE_STREAMING) {
+    if(pFlight != NULL) pthread_mutex_unlock(&pFlight->lock);
+    if(isComplete) cacheCaptureCommit(pCapture, key, bodyMode);
+    else cacheCaptureDiscard(pCapture);
+    return;
+  }
+
+  cacheObject *pObject = NULL;
+  if(isComplete) pObject = cacheCaptureCommitAcquire(pCapture, key, bodyMode);
+  else cacheCaptureDiscard(pCapture);
+  if(pObject != NULL) {
+    pFlight->pObject = pObject; /* Same bytes the followers were reading: the cache took the buffer as is */
+    pFlight->size = pObject->size;
+    pFlight->headerSize = pObject->headerSize;
+    pFlight->bodyMode = pObject->bodyMode;
+  }
+  pWaiters = settleFlight(pFlight, (pObject != NULL) ? STAGE_COMPLETE : STAGE_ABANDONED);
+  pthread_mutex_unlock(&pFlight->lock);
+  retireFlight(pFlight, pWaiters, pObject == NULL);
+}
+int flightWaitHead(flight *pFlight, size_t *pHeaderSize, int *pBodyMode) {
+  /* Blocks until followers may start sending; -1 when the flight was abandoned first */
+  int status;
+  pthread_mutex_lock(&pFlight->lock);
+  while(pFlight->stage == STAGE_FETCHING) pthread_cond_wait(&pFlight->changed, &pFlight->lock);
+  status = (pFlight->stage == STAGE_ABANDONED) ? -1 : 0;
+  *pHeaderSize = pFlight->headerSize;
+  *pBodyMode = pFlight->bodyMode;
+  pthread_mutex_unlock(&pFlight->lock);
+  return status;
+}
+ssize_t flightRead(flight *pFlight, size_t offset, char *buffer, size_t capacity) {
+  /* Copies published bytes from "offset", blocking until there are some; 0 at the end, -1 when abandoned */
+  ssize_t n = -1;
+  pthread_mutex_lock(&pFlight->lock);
+  while(pFlight->stage == STAGE_STREAMING && pFlight->size <= offset) pthread_cond_wait(&pFlight->changed, &pFlight->lock);
+  if(pFlight->stage != STAGE_ABANDONED) {
+    const char *data = (pFlight->stage == STAGE_COMPLETE) ? pFlight->pObject->data : pFlight->pCapture->data;
+    n = (pFlight->size - offset < capacity) ? pFlight->size - offset : capacity;
+    memcpy(buffer, data + offset, n);
+  }
+  pthread_mutex_unlock(&pFlight->lock);
+  return n;
+}
+int flightPoll(flight *pFlight, int notifyfd, cacheObject **ppObject) {
+  /* Never blocks: event loops wait for the whole object, then serve it like a cache hit */
+  int status = FLIGHT_PENDING;
+  pthread_mutex_lock(&pFlight->lock);
+  if(pFlight->stage == STAGE_COMPLETE) {
+    cacheRetain(pFlight->pObject);
+    *ppObject = pFlight->pObject;
+    status = FLIGHT_COMPLETE;
+  }
+  else if(pFlight->stage == STAGE_ABANDONED) status = FLIGHT_ABANDONED;
+  else {
+    flightWaiter *pWaiter = pFlight->pWaiters;
+    while(pWaiter != NULL && pWaiter->notifyfd != notifyfd) pWaiter = pWaiter->pNext;
+    if(pWaiter == NULL) { /* One poke per descriptor is enough: the loop retries every parked connection */
+      pWaiter = Malloc(sizeof(flightWaiter));
+      pWaiter->notifyfd = notifyfd;
+      pWaiter->pNext = pFlight->pWaiters;
+      pFlight->pWaiters = pWaiter;
+    }
+  }
+  pthread_mutex_unlock(&pFlight->lock);
+  return status;
+}
+void flightGetStats(flightStats *pStats) {
+  memset(pStats, 0, sizeof(flightStats));
+  for(int i = 0; i < FLIGHT_SHARD_COUNT; i++) {
+    pthread_mutex_lock(&shards[i].lock);
+    pStats->leaders += shards[i].stats.leaders;
+    pStats->followers += shards[i].stats.followers;
+    pStats->abandoned += shards[i].stats.abandoned;
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+}
+
+static flight *createFlight(const char *key, unsigned int hash) {
+  flight *pFlight = Malloc(sizeof(flight));
+  pFlight->key = Malloc(strlen(key) + 1);
+  strcpy(pFlight->key, key);
+  pFlight->hash = hash;
+  pFlight->isRegistered = 1;
+  pthread_mutex_init(&pFlight->lock, NULL);
+  pthread_cond_init(&pFlight->changed, NULL);
+  pFlight->stage = STAGE_FETCHING;
+  pFlight->referenceCount = 1; /* The leader */
+  pFlight->pCapture = NULL;
+  pFlight->pObject = NULL;
+  pFlight->size = pFlight->headerSize = 0;
+  pFlight->bodyMode = 0;
+  pFlight->pWaiters = NULL;
+  return pFlight;
+}
+static flightWaiter *settleFlight(flight *pFlight, flightStage stage) {
+  /* Caller holds the flight lock; returns the event loops to poke once it is dropped */
+  flightWaiter *pWaiters = pFlight->pWaiters;
+  pFlight->stage = stage;
+  pFlight->pCapture = NULL; /* The leader may free it from here on */
+  pFlight->pWaiters = NULL;
+  pthread_cond_broadcast(&pFlight->changed);
+  return pWaiters;
+}
+static void retireFlight(flight *pFlight, flightWaiter *pWaiters, int isAbandoned) {
+  /* Settled: later misses either hit the cache or start a new flight */
+  flightShard *pShard = shardOf(pFlight->hash);
+  pthread_mutex_lock(&pShard->lock);
+  if(pFlight->isRegistered) {
+    flight **ppLink = bucketOf(pShard, pFlight->hash);
+    while(*ppLink != pFlight) ppLink = &(*ppLink)->pBucketNext;
+    *ppLink = pFlight->pBucketNext;
+    pFlight->isRegistered = 0;
+  }
+  if(isAbandoned) pShard->stats.abandoned++;
+  pthread_mutex_unlock(&pShard->lock);
+
+  while(pWaiters != NULL) {
+    uint64_t one = 1;
+    flightWaiter *pNext = pWaiters->pNext;
+    if(write(pWaiters->notifyfd, &one, sizeof(one)) < 0) { /* Full: a poke is already pending, which is all the loop needs */ }
+    Free(pWaiters);
+    pWaiters = pNext;
+  }
+}
+static void freeFlight(flight *pFlight) {
+  if(pFlight->pObject != NULL) cacheRelease(pFlight->pObject);
+  pthread_mutex_destroy(&pFlight->lock);
+  pthread_cond_destroy(&pFlight->changed);
+  Free(pFlight->key);
+  Free(pFlight);
+}
+static unsigned int hashKey(const char *key) {
+  unsigned int hash = 2166136261u; /* FNV-1a */
+  for(const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+static flightShard *shardOf(unsigned int hash) {
+  return &shards[hash % FLIGHT_SHARD_COUNT];
+}
+static flight **bucketOf(flightShard *pShard, unsigned int hash) {
+  return &pShard->buckets[(hash / FLIGHT_SHARD_COUNT) % FLIGHT_BUCKET_COUNT];
+}
@@ -0,0 +1,45 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <sys/types.h>
+#include "../cache/cache.h"
+
+#define FLIGHT_SHARD_COUNT 8
+#define FLIGHT_BUCKET_COUNT 64 /* Hash buckets per shard */
+
+/* What "flightJoin" made of a cache miss */
+#define FLIGHT_CACHED 0 /* The object landed in the cache meanwhile: "*ppObject" holds a reference */
+#define FLIGHT_LEADER 1 /* Nobody is fetching it: the caller fetches and publishes through the flight */
+#define FLIGHT_FOLLOWER 2 /* Another request is fetching it: the caller reads what it publishes */
+
+/* Where a fetch stands, as "flightPoll" reports it */
+#define FLIGHT_PENDING 0 /* Still coming: the notify descriptor fires when it settles */
+#define FLIGHT_COMPLETE 1 /* Cached: "*ppObject" holds a reference */
+#define FLIGHT_ABANDONED 2 /* Failed or uncacheable: followers fetch on their own */
+
+/* One in-progress origin fetch, shared by every concurrent miss on its cache key */
+typedef struct flight flight;
+
+typedef struct {
+  unsigned long leaders; /* Misses that went to the origin */
+  unsigned long followers; /* Misses that attached to a fetch already in flight */
+  unsigned long abandoned; /* Fetches whose followers had to go to the origin themselves */
+} flightStats;
+
+void flightInit(void);
+int flightJoin(const char *key, flight **ppFlight, cacheObject **ppObject);
+void flightLeave(flight *pFlight, int isLeader);
+
+/* Leader side; "pFlight" may be NULL for a fetch nobody can follow */
+void flightAppend(flight *pFlight, cacheCapture *pCapture, const char *data, size_t size);
+void flightPublishHead(flight *pFlight, cacheCapture *pCapture, int bodyMode, long long bodyLength);
+void flightFinish(flight *pFlight, cacheCapture *pCapture, const char *key, int bodyMode, int isComplete);
+
+/* Follower side */
+int flightWaitHead(flight *pFlight, size_t *pHeaderSize, int *pBodyMode);
+ssize_t flightRead(flight *pFlight, size_t offset, char *buffer, size_t capacity);
+int flightPoll(flight *pFlight, int notifyfd, cacheObject **ppObject);
+
+void flightGetStats(flightStats *pStats);
+
+#endif
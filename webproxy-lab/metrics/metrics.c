@@ -0,0 +1,215 @@
+#include <stdarg.h>
+#include <pthread.h>
+#include "../csapp.h"
+#include "../event-log/event-log.h"
+#include "../resolver/resolver.h"
+#include "../flight/flight.h"
+#include "../buffer-pool/buffer-pool.h"
+#include "../disk-cache/disk-cache.h"
+#include "metrics.h"
+
+#define RENDER_SIZE 65536
+#define SCRAPE_TIMEOUT 2 /* Seconds a scraper may take to send its request */
+
+/* One thread's counters: only that thread writes them, so updates are plain stores a scrape may read mid-way */
+typedef struct metricsShard {
+  unsigned long counters[METRIC_COUNTER_COUNT];
+  unsigned long buckets[METRIC_STAGE_COUNT][METRICS_BUCKET_COUNT + 1]; /* Last one: +Inf */
+  unsigned long long sums[METRIC_STAGE_COUNT]; /* Nanoseconds */
+  struct metricsShard *pNext;
+} metricsShard;
+
+/* Text being rendered; "size" stops growing once the buffer is full */
+typedef struct {
+  char *data;
+  size_t size, capacity;
+} renderBuffer;
+
+static const char *stageNames[METRIC_STAGE_COUNT] = { "accept", "parse", "connect", "write", "first_byte", "relay", "total" };
+
+static __thread metricsShard *pLocalShard;
+static metricsShard *pShards; /* Every thread that ever recorded; threads live as long as the proxy, so shards are never freed */
+static pthread_mutex_t shardsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static metricsShard *localShard(void);
+static void add(unsigned long *pValue, unsigned long amount);
+static unsigned long load(const unsigned long *pValue);
+static void sumShards(metricsShard *pTotal);
+static void append(renderBuffer *pBuffer, const char *format, ...);
+static void appendCounter(renderBuffer *pBuffer, const char *name, const char *help, const char *type, const char *label, unsigned long value);
+static void *serveScrapes(void *pArgument);
+
+long long metricsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now); /* vDSO: no system call */
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+void metricsCount(metricCounter counter, unsigned long amount) {
+  add(&localShard()->counters[counter], amount);
+}
+long long metricsRecord(metricStage stage, long long startNs) {
+  /* Records the time since "startNs" and returns now, the start of whatever comes next */
+  metricsShard *pShard = localShard();
+  long long now = metricsNow();
+  unsigned long long elapsed = (now > startNs) ? now - startNs : 0, microseconds = elapsed / 1000;
+  int bucket = (microseconds <= 1) ? 0 : 64 - __builtin_clzll(microseconds - 1); /* Smallest power of two not below it */
+  if(bucket > METRICS_BUCKET_COUNT) bucket = METRICS_BUCKET_COUNT;
+  add(&pShard->buckets[stage][bucket], 1);
+  __atomic_store_n(&pShard->sums[stage], pShard->sums[stage] + elapsed, __ATOMIC_RELAXED);
+  return now;
+}
+size_t metricsRender(char *data, size_t capacity) {
+  /* Prometheus text exposition format */
+  renderBuffer buffer = { data, 0, capacity };
+  metricsShard total;
+  resolverStats resolver;
+  flightStats flights;
+  bufferPoolStats buffers;
+  diskCacheStats disk;
+  sumShards(&total);
+  resolverGetStats(&resolver);
+  flightGetStats(&flights);
+  bufferPoolGetStats(&buffers);
+  diskCacheGetStats(&disk);
+  unsigned long *counters = total.counters;
+
+  /* Traffic */
+  appendCounter(&buffer, "proxy_connections_accepted_total", "Client connections accepted.", "counter", "", counters[METRIC_CONNECTIONS_ACCEPTED]);
+  appendCounter(&buffer, "proxy_connections_active", "Client connections open now.", "gauge", "", counters[METRIC_CONNECTIONS_ACCEPTED] - counters[METRIC_CONNECTIONS_CLOSED]);
+  appendCounter(&buffer, "proxy_requests_total", "Requests parsed.", "counter", "", counters[METRIC_REQUESTS]);
+  appendCounter(&buffer, "proxy_responses_total", "Responses by where they came from.", "counter", "source=\"cache\"", counters[METRIC_CACHE_HITS]);
+  appendCounter(&buffer, "proxy_responses_total", NULL, NULL, "source=\"disk\"", counters[METRIC_DISK_HITS]);
+  appendCounter(&buffer, "proxy_responses_total", NULL, NULL, "source=\"coalesced\"", counters[METRIC_COALESCED]);
+  appendCounter(&buffer, "proxy_responses_total", NULL, NULL, "source=\"origin\"", counters[METRIC_MISSES]);
+  appendCounter(&buffer, "proxy_responses_total", NULL, NULL, "source=\"revalidated\"", counters[METRIC_REVALIDATED_HITS]);
+  appendCounter(&buffer, "proxy_responses_total", NULL, NULL, "source=\"stale\"", counters[METRIC_STALE_HITS]);
+  appendCounter(&buffer, "proxy_revalidations_total", "Stale objects checked with the origin, by its answer.", "counter", "result=\"not_modified\"", counters[METRIC_REVALIDATIONS_NOT_MODIFIED]);
+  appendCounter(&buffer, "proxy_revalidations_total", NULL, NULL, "result=\"modified\"", counters[METRIC_REVALIDATIONS_MODIFIED]);
+  appendCounter(&buffer, "proxy_revalidations_total", NULL, NULL, "result=\"failed\"", counters[METRIC_REVALIDATIONS_FAILED]);
+  appendCounter(&buffer, "proxy_client_bytes_sent_total", "Response bytes sent to clients.", "counter", "", counters[METRIC_CLIENT_BYTES_SENT]);
+  appendCounter(&buffer, "proxy_origin_bytes_received_total", "Response bytes received from origins.", "counter", "", counters[METRIC_ORIGIN_BYTES_RECEIVED]);
+  appendCounter(&buffer, "proxy_origin_errors_total", "Origin failures.", "counter", "kind=\"connect\"", counters[METRIC_ORIGIN_CONNECT_ERRORS]);
+  appendCounter(&buffer, "proxy_origin_errors_total", NULL, NULL, "kind=\"response\"", counters[METRIC_ORIGIN_RESPONSE_ERRORS]);
+  appendCounter(&buffer, "proxy_client_errors_total", "Client failures; the proxy drops the connection and keeps serving.", "counter", "kind=\"send\"", counters[METRIC_CLIENT_SEND_ERRORS]);
+  appendCounter(&buffer, "proxy_client_errors_total", NULL, NULL, "kind=\"accept\"", counters[METRIC_ACCEPT_ERRORS]);
+
+  /* Stage Latency */
+  append(&buffer, "# HELP proxy_stage_seconds Time spent in each stage of a transaction.\n# TYPE proxy_stage_seconds histogram\n");
+  for(int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+    unsigned long cumulative = 0;
+    for(int i = 0; i < METRICS_BUCKET_COUNT; i++) {
+      cumulative += total.buckets[stage][i];
+      append(&buffer, "proxy_stage_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %lu\n", stageNames[stage], (1 << i) / 1e6, cumulative);
+    }
+    cumulative += total.buckets[stage][METRICS_BUCKET_COUNT];
+    append(&buffer, "proxy_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", stageNames[stage], cumulative);
+    append(&buffer, "proxy_stage_seconds_sum{stage=\"%s\"} %.9f\n", stageNames[stage], total.sums[stage] / 1e9);
+    append(&buffer, "proxy_stage_seconds_count{stage=\"%s\"} %lu\n", stageNames[stage], cumulative);
+  }
+
+  /* What The Other Modules Already Count */
+  appendCounter(&buffer, "proxy_dns_lookups_total", "Origin name lookups by outcome.", "counter", "result=\"hit\"", resolver.hits);
+  appendCounter(&buffer, "proxy_dns_lookups_total", NULL, NULL, "result=\"negative_hit\"", resolver.negativeHits);
+  appendCounter(&buffer, "proxy_dns_lookups_total", NULL, NULL, "result=\"miss\"", resolver.misses);
+  appendCounter(&buffer, "proxy_dns_lookups_total", NULL, NULL, "result=\"coalesced\"", resolver.coalesced);
+  appendCounter(&buffer, "proxy_dns_failures_total", "getaddrinfo errors.", "counter", "", resolver.failures);
+  appendCounter(&buffer, "proxy_dns_evictions_total", "Cached names dropped to keep the table bounded.", "counter", "", resolver.evictions);
+  appendCounter(&buffer, "proxy_origin_connects_total", "Threaded origin connects that did not go to plan.", "counter", "outcome=\"fallback\"", resolver.connectFallbacks);
+  appendCounter(&buffer, "proxy_origin_connects_total", NULL, NULL, "outcome=\"timeout\"", resolver.connectTimeouts);
+  appendCounter(&buffer, "proxy_flights_total", "Cache misses by fetch role.", "counter", "role=\"leader\"", flights.leaders);
+  appendCounter(&buffer, "proxy_flights_total", NULL, NULL, "role=\"follower\"", flights.followers);
+  appendCounter(&buffer, "proxy_flights_abandoned_total", "Fetches whose followers had to go to the origin themselves.", "counter", "", flights.abandoned);
+  appendCounter(&buffer, "proxy_relay_buffer_bytes", "Relay buffer memory.", "gauge", "state=\"in_use\"", buffers.inUseBytes);
+  appendCounter(&buffer, "proxy_relay_buffer_bytes", NULL, NULL, "state=\"idle\"", buffers.idleBytes);
+  appendCounter(&buffer, "proxy_relay_buffer_peak_bytes", "Most relay buffer memory in use at once.", "gauge", "", buffers.peakBytes);
+  appendCounter(&buffer, "proxy_relay_buffer_grows_total", "Relay buffers swapped for a larger size.", "counter", "", buffers.grows);
+  appendCounter(&buffer, "proxy_relay_buffer_refusals_total", "Relay buffer growths refused by the memory budget.", "counter", "", buffers.refusals);
+  appendCounter(&buffer, "proxy_disk_cache_lookups_total", "Disk tier lookups by outcome.", "counter", "result=\"hit\"", disk.hits);
+  appendCounter(&buffer, "proxy_disk_cache_lookups_total", NULL, NULL, "result=\"miss\"", disk.misses);
+  appendCounter(&buffer, "proxy_disk_cache_lookups_total", NULL, NULL, "result=\"stale\"", disk.stale);
+  appendCounter(&buffer, "proxy_disk_cache_stores_total", "Disk tier writes by outcome.", "counter", "result=\"stored\"", disk.stores);
+  appendCounter(&buffer, "proxy_disk_cache_stores_total", NULL, NULL, "result=\"skipped\"", disk.skipped);
+  appendCounter(&buffer, "proxy_event_log_dropped_total", "Events lost to a full ring.", "counter", "", eventLogDropped());
+  return buffer.size;
+}
+int metricsServe(const char *port) {
+  /* Answers scrapes on a port of their own, off every engine's hot path */
+  pthread_t threadId;
+  int *pListenfd = Malloc(sizeof(int));
+  if((*pListenfd = open_listenfd((char *)port)) < 0) {
+    Free(pListenfd);
+    writeEvent("Metrics disabled: cannot listen on the metrics port.");
+    return -1;
+  }
+  Pthread_create(&threadId, NULL, serveScrapes, pListenfd);
+  return 0;
+}
+
+static metricsShard *localShard(void) {
+  if(pLocalShard == NULL) { /* First record on this thread */
+    pLocalShard = Calloc(1, sizeof(metricsShard));
+    pthread_mutex_lock(&shardsLock);
+    pLocalShard->pNext = pShards;
+    pShards = pLocalShard;
+    pthread_mutex_unlock(&shardsLock);
+  }
+  return pLocalShard;
+}
+static void add(unsigned long *pValue, unsigned long amount) {
+  __atomic_store_n(pValue, *pValue + amount, __ATOMIC_RELAXED); /* Sole writer: no locked instruction needed */
+}
+static unsigned long load(const unsigned long *pValue) {
+  return __atomic_load_n(pValue, __ATOMIC_RELAXED);
+}
+static void sumShards(metricsShard *pTotal) {
+  memset(pTotal, 0, sizeof(metricsShard));
+  pthread_mutex_lock(&shardsLock);
+  for(metricsShard *pShard = pShards; pShard != NULL; pShard = pShard->pNext) {
+    for(int i = 0; i < METRIC_COUNTER_COUNT; i++) pTotal->counters[i] += load(&pShard->counters[i]);
+    for(int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+      for(int i = 0; i <= METRICS_BUCKET_COUNT; i++) pTotal->buckets[stage][i] += load(&pShard->buckets[stage][i]);
+      pTotal->sums[stage] += __atomic_load_n(&pShard->sums[stage], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&shardsLock);
+}
+static void append(renderBuffer *pBuffer, const char *format, ...) {
+  va_list arguments;
+  if(pBuffer->size >= pBuffer->capacity) return;
+  va_start(arguments, format);
+  int n = vsnprintf(pBuffer->data + pBuffer->size, pBuffer->capacity - pBuffer->size, format, arguments);
+  va_end(arguments);
+  if(n > 0) pBuffer->size = (pBuffer->size + n < pBuffer->capacity) ? pBuffer->size + n : pBuffer->capacity;
+}
+static void appendCounter(renderBuffer *pBuffer, const char *name, const char *help, const char *type, const char *label, unsigned long value) {
+  /* "help" NULL: another sample of the metric just declared */
+  if(help != NULL) append(pBuffer, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  if(*label) append(pBuffer, "%s{%s} %lu\n", name, label, value);
+  else append(pBuffer, "%s %lu\n", name, value);
+}
+static void *serveScrapes(void *pArgument) {
+  int listenfd = *(int *)pArgument;
+  struct timeval timeout = { SCRAPE_TIMEOUT, 0 };
+  char *body = Malloc(RENDER_SIZE), request[MAXLINE], head[MAXLINE];
+  Free(pArgument);
+  Pthread_detach(Pthread_self());
+  while(1) {
+    int clientfd = accept(listenfd, NULL, NULL);
+    if(clientfd < 0) continue;
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); /* A silent scraper must not stall the next one */
+    ssize_t n = read(clientfd, request, sizeof(request) - 1);
+    if(n > 0) {
+      request[n] = '\0';
+      size_t bodySize = 0;
+      const char *status = "404 Not Found";
+      if(!strncmp(request, "GET " METRICS_PATH " ", strlen("GET " METRICS_PATH " ")) || !strncmp(request, "GET / ", 6)) {
+        bodySize = metricsRender(body, RENDER_SIZE);
+        status = "200 OK";
+      }
+      int headSize = snprintf(head, sizeof(head), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, bodySize);
+      if(rio_writen(clientfd, head, headSize) >= 0) rio_writen(clientfd, body, bodySize);
+    }
+    close(clientfd);
+  }
+  return NULL;
+}
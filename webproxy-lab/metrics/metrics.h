@@ -0,0 +1,49 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+#define METRICS_BUCKET_COUNT 24 /* Latency buckets: 1 us doubling up to ~8.4 s, then +Inf */
+#define METRICS_PATH "/metrics"
+
+/* Timed steps of a transaction; a stage an engine does not have is never recorded */
+typedef enum {
+  METRIC_STAGE_ACCEPT, /* Accepted connection waiting for a worker (threaded engine) */
+  METRIC_STAGE_PARSE, /* Request head in -> target split, origin request built, cache key made */
+  METRIC_STAGE_CONNECT, /* Origin connection: pooled, or DNS plus connect */
+  METRIC_STAGE_WRITE, /* Request sent to the origin */
+  METRIC_STAGE_FIRST_BYTE, /* Request sent -> first response byte */
+  METRIC_STAGE_RELAY, /* First response byte -> response relayed */
+  METRIC_STAGE_TOTAL, /* Request head in -> response sent, cache hits included */
+  METRIC_STAGE_COUNT
+} metricStage;
+
+typedef enum {
+  METRIC_CONNECTIONS_ACCEPTED,
+  METRIC_CONNECTIONS_CLOSED,
+  METRIC_REQUESTS,
+  METRIC_CACHE_HITS, /* Served from RAM */
+  METRIC_DISK_HITS, /* Served from the disk tier */
+  METRIC_COALESCED, /* Attached to another request's fetch */
+  METRIC_MISSES, /* Fetched from the origin */
+  METRIC_REVALIDATED_HITS, /* Served from RAM once the origin answered 304 to its validators */
+  METRIC_STALE_HITS, /* Served past its freshness lifetime: during a background revalidation, or for a failing origin */
+  METRIC_REVALIDATIONS_NOT_MODIFIED, /* Revalidations, on a request or in the background, by how the origin answered */
+  METRIC_REVALIDATIONS_MODIFIED,
+  METRIC_REVALIDATIONS_FAILED,
+  METRIC_CLIENT_BYTES_SENT,
+  METRIC_ORIGIN_BYTES_RECEIVED,
+  METRIC_ORIGIN_CONNECT_ERRORS,
+  METRIC_ORIGIN_RESPONSE_ERRORS, /* Origin closed or failed before the response ended */
+  METRIC_CLIENT_SEND_ERRORS, /* Client reset, timed out or closed while its response was being sent */
+  METRIC_ACCEPT_ERRORS, /* Connections the listener failed to accept: aborted, or out of descriptors */
+  METRIC_COUNTER_COUNT
+} metricCounter;
+
+long long metricsNow(void);
+void metricsCount(metricCounter counter, unsigned long amount);
+long long metricsRecord(metricStage stage, long long startNs);
+size_t metricsRender(char *buffer, size_t capacity);
+int metricsServe(const char *port);
+
+#endif
@@ -1,6 +1,18 @@
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+
+/* Relay buffers: one connection's grows up to RELAY_BUFFER_MAX on a fast link, all of them share RELAY_MEMORY_BUDGET */
+#define RELAY_BUFFER_MAX 262144
+#define RELAY_MEMORY_BUDGET 67108864
+
+/* Default worker pool shape, overridable with -t and -q */
+#define DEFAULT_THREAD_COUNT 16
+#define DEFAULT_QUEUE_DEPTH 64
+#define WORKER_STACK_SIZE 65536 /* Per-connection buffers live in a slab, so workers need only a small stack */
+
+/* Seconds a keep-alive client may stay silent between requests */
+#define CLIENT_IDLE_TIMEOUT 5
 #define True 1
 #define False 0
 
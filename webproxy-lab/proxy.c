@@ -1,162 +1,551 @@
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "proxy-help.h"
 #include "event-log/event-log.h"
+#include "cache/cache.h"
+#include "sbuf/sbuf.h"
+#include "request/request.h"
+#include "event-loop/event-loop.h"
+#include "relay/relay.h"
+#include "response/response.h"
+#include "upstream/upstream.h"
+#include "resolver/resolver.h"
+#include "buffer-pool/buffer-pool.h"
+#include "slab/slab.h"
+#include "flight/flight.h"
+#include "disk-cache/disk-cache.h"
+#include "metrics/metrics.h"
+#include "revalidator/revalidator.h"
 
-static void processTransaction(int originfd);
-static int parseRequestLine(rio_t *clientBuffer, char *method, char *uri, char *version, char *proxyBuffer);
-static void parseURI(const char *uri, char *hostname, char *port, char *path);
-static void appendToBuffer(char *buffer, size_t *offset, size_t capacity, const char *append);
-static void buildHeaderBuffer(rio_t *clientBuffer, const char *hostname, char *headerBuffer);
-static void deliverResponse(rio_t *serverBuffer, int originfd);
+#define ENGINE_THREAD 0 /* Blocking worker per connection */
+#define ENGINE_EPOLL 1 /* Non-blocking event loops */
+#define ENGINE_REACTOR 2 /* Event loop per core, each with its own SO_REUSEPORT listener */
+
+#define UPSTREAM_FAILED -1 /* Nothing came back: the request may be retried on another connection */
+#define UPSTREAM_DONE 0 /* Response relayed, the origin connection must be closed */
+#define UPSTREAM_REUSABLE 1 /* Response relayed and fully framed: the connection can go back to the pool */
+
+#define STALE_UNUSED 0 /* The origin's own response went to the client */
+#define STALE_REVALIDATED 1 /* The origin answered 304 to the proxy's validators: the stored object is fresh again */
+#define STALE_FOR_ERROR 2 /* The origin failed, and stale-if-error lets the stored object answer instead */
+
+typedef struct {
+  char *port;
+  int engine;
+  int threadCount; /* Prethreaded workers, or event loops for the epoll and reactor engines */
+  int queueDepth; /* Accepted connections waiting for a worker */
+  int isPinned; /* Reactor engine: pin each reactor to a core */
+  char *diskCachePath; /* NULL: RAM cache only */
+  char *metricsPort; /* NULL: no metrics listener */
+  int connectTimeoutMs; /* Deadline for reaching any of an origin's addresses */
+} proxyConfig;
+
+/* Parse state and I/O buffers of one client connection: kept off the worker's small stack and reused by its next connection */
+typedef struct {
+  rio_ring_t clientBuffer; /* Lives as long as the connection: pipelined requests wait in it; grows for large heads */
+  rio_t serverBuffer; /* Internal Buffer */
+  requestParser request; /* Spans into the client's ring */
+  char hostname[MAXLINE], port[16], path[MAXLINE]; /* Components Of URI */
+  char cacheKey[CACHE_KEY_SIZE];
+  headerBuilder headers;
+  struct iovec parts[HEADER_BUILDER_MAX_PARTS]; /* Consumed by each send, so refilled per attempt */
+  char lineBuffer[MAXLINE]; /* One origin header line */
+  char headerBlock[MAXBUF]; /* Rewritten status line and headers, sent in one write */
+  long long requestSentNs; /* When the request reached the origin: the first-byte wait starts here */
+  cacheObject *pStale; /* Cached response past its freshness lifetime, checked with the origin by this transaction */
+  int isRevalidating; /* The origin request carries "pStale"'s validators: a 304 is the proxy's to consume */
+  int staleOutcome; /* STALE_*: whether the client gets "pStale" after all */
+  int isClientGone; /* A send to the client failed: nothing more is sent, and the connection ends after this transaction */
+} connectionContext;
+
+static sbuf connectionQueue;
+
+static int parseConfig(int argc, char **argv, proxyConfig *pConfig);
+static void processConnection(connectionContext *pContext, int originfd);
+static int processTransaction(connectionContext *pContext, int originfd);
+static int readRequest(rio_ring_t *clientBuffer, requestParser *pRequest, const char **ppRequest);
+static int keepsClientAlive(int isKeepAlive, int isHttp11, int bodyMode);
+static int sendToClient(connectionContext *pContext, int originfd, const void *data, size_t size);
+static void markClientGone(connectionContext *pContext);
+static int writeCachedObject(connectionContext *pContext, int originfd, cacheObject *pObject, int isHttp11, int isKeepAlive);
+static int writeDiskObject(connectionContext *pContext, int originfd, diskObject *pObject, int isHttp11, int isKeepAlive);
+static int followFlight(connectionContext *pContext, flight *pFlight, int originfd, int isHttp11, int *pIsKeepAlive);
+static int deliverResponse(connectionContext *pContext, flight *pFlight, int originfd, int isHttp11, int *pIsKeepAlive);
+static int withholdResponse(connectionContext *pContext, responseHead *pHead, size_t headerSize);
+static void flushHeaderBlock(connectionContext *pContext, int originfd, flight *pFlight, cacheCapture *pCapture, char *headerBlock, size_t *pHeaderSize);
+static ssize_t spliceBody(connectionContext *pContext, int originfd, bodyFramer *pFramer);
 static void *thread(void *pArgument);
 
 int main(int argc, char **argv) {
-  if(argc != 2) {
-    writeEvent("Invalid number of arguments: expected 2 arguments(name, port number).");
+  proxyConfig config;
+  eventLogInit(); /* First: every thread started later inherits its signal mask */
+  if(parseConfig(argc, argv, &config) < 0) {
+    writeEvent("Invalid arguments: expected <port> [-e thread|epoll|reactor] [-t thread count] [-q queue depth] [-p] [-d disk cache file] [-m metrics port] [-c connect timeout ms].");
     exit(1);
   }
   Signal(SIGPIPE, SIG_IGN);
+  cacheInit(MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+  if(config.diskCachePath != NULL) diskCacheInit(config.diskCachePath, DISK_CACHE_SIZE); /* On failure the proxy runs RAM-only */
+  flightInit();
+  upstreamInit();
+  resolverInit(RESOLVER_WORKER_COUNT, config.connectTimeoutMs);
+  revalidatorInit(REVALIDATOR_WORKER_COUNT);
+  bufferPoolInit(RELAY_BUFFER_MAX, RELAY_MEMORY_BUDGET);
+  if(config.metricsPort != NULL) metricsServe(config.metricsPort); /* On failure the proxy runs without it */
 
   int listenfd, originfd;
   struct sockaddr_storage clientAddress;
   socklen_t sizeOfClientAddress;
-  listenfd = Open_listenfd(argv[1]);
+  pthread_t threadId;
+  pthread_attr_t workerAttributes;
+  if(config.engine == ENGINE_REACTOR) {
+    eventLoopRunReactors(config.port, config.threadCount, config.isPinned); /* Never returns */
+  }
+  listenfd = Open_listenfd(config.port);
+  if(config.engine == ENGINE_EPOLL) {
+    eventLoopRun(listenfd, config.threadCount); /* Never returns */
+  }
+  sbufInit(&connectionQueue, config.queueDepth);
+  pthread_attr_init(&workerAttributes);
+  pthread_attr_setstacksize(&workerAttributes, WORKER_STACK_SIZE); /* Buffers live in each worker's slab, not on its stack */
+  for(int i = 0; i < config.threadCount; i++) Pthread_create(&threadId, &workerAttributes, thread, NULL); /* Prethread the workers */
   while (True) {
     sizeOfClientAddress = sizeof(clientAddress);
-    originfd = Accept(listenfd, (SA *)&clientAddress, &sizeOfClientAddress);
-    int *pCopyOfOriginfd = Malloc(sizeof(int));
-    *pCopyOfOriginfd = originfd;
-    pthread_t threadId;
-    Pthread_create(&threadId, NULL, thread, pCopyOfOriginfd);
+    if((originfd = accept(listenfd, (SA *)&clientAddress, &sizeOfClientAddress)) < 0) { /* Aborted or out of descriptors: keep serving */
+      if(errno == EMFILE || errno == ENFILE) writeEvent("Descriptor limit reached: connection left in the listen backlog.");
+      if(errno != EINTR) metricsCount(METRIC_ACCEPT_ERRORS, 1);
+      continue;
+    }
+    metricsCount(METRIC_CONNECTIONS_ACCEPTED, 1);
+    sbufInsert(&connectionQueue, originfd, metricsNow()); /* Blocks while the queue is full, leaving new clients in the listen backlog */
   }
   return 0;
 }
 
-static void processTransaction(int originfd) {
-  rio_t clientBuffer, serverBuffer; /* Internal Buffer */
-  char proxyBuffer[MAXLINE]; /* User Buffer */
-  char method[MAXLINE], uri[MAXLINE], version[MAXLINE]; /* Components Of Request Line */
-  char hostname[MAXLINE], port[16], path[MAXLINE]; /* Components Of URI */
+static int parseConfig(int argc, char **argv, proxyConfig *pConfig) {
+  int option;
+  pConfig->engine = ENGINE_THREAD;
+  pConfig->threadCount = 0;
+  pConfig->queueDepth = DEFAULT_QUEUE_DEPTH;
+  pConfig->isPinned = False;
+  pConfig->diskCachePath = NULL; /* Opt-in: the file is preallocated and outlives the process */
+  pConfig->metricsPort = NULL;
+  pConfig->connectTimeoutMs = RESOLVER_CONNECT_TIMEOUT_MS;
+  while((option = getopt(argc, argv, "e:t:q:pd:m:c:")) != -1) {
+    switch(option) {
+      case 'e':
+        if(!strcmp(optarg, "thread")) pConfig->engine = ENGINE_THREAD;
+        else if(!strcmp(optarg, "epoll")) pConfig->engine = ENGINE_EPOLL;
+        else if(!strcmp(optarg, "reactor")) pConfig->engine = ENGINE_REACTOR;
+        else return -1;
+        break;
+      case 't': pConfig->threadCount = atoi(optarg); if(pConfig->threadCount <= 0) return -1; break;
+      case 'q': pConfig->queueDepth = atoi(optarg); break;
+      case 'p': pConfig->isPinned = True; break;
+      case 'd': pConfig->diskCachePath = strcmp(optarg, "off") ? optarg : NULL; break; /* "off" as before: RAM only */
+      case 'm': pConfig->metricsPort = optarg; break;
+      case 'c': pConfig->connectTimeoutMs = atoi(optarg); if(pConfig->connectTimeoutMs <= 0) return -1; break;
+      default: return -1;
+    }
+  }
+  if(optind != argc - 1 || pConfig->queueDepth <= 0) return -1;
+  if(pConfig->threadCount == 0) { /* Engine default: a worker per concurrent client, or an event loop per core */
+    if(pConfig->engine != ENGINE_THREAD) pConfig->threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    else pConfig->threadCount = DEFAULT_THREAD_COUNT;
+  }
+  pConfig->port = argv[optind];
+  return 0;
+}
+static void processConnection(connectionContext *pContext, int originfd) {
+  struct timeval idleTimeout = { CLIENT_IDLE_TIMEOUT, 0 };
+  int optval = 1;
+
+  setsockopt(originfd, SOL_SOCKET, SO_RCVTIMEO, &idleTimeout, sizeof(idleTimeout)); /* An idle keep-alive client must not pin its worker */
+  setsockopt(originfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)); /* Header and body writes must not wait on delayed ACKs */
+  rio_ringinitb(&pContext->clientBuffer, originfd);
+  pContext->isClientGone = False;
+  while(processTransaction(pContext, originfd) && !pContext->isClientGone); /* One request after another until either side closes */
+  rio_ringfreeb(&pContext->clientBuffer); /* A grown ring goes back to its inline buffer for the next connection */
+}
+static int processTransaction(connectionContext *pContext, int originfd) {
+  /* Returns True when the client connection stays open for the next request */
+  rio_ring_t *clientBuffer = &pContext->clientBuffer;
+  requestParser *pParser = &pContext->request;
+  headerBuilder *pHeaders = &pContext->headers;
+  char *hostname = pContext->hostname, *port = pContext->port, *path = pContext->path;
   
   /* Read Client Request */
-  Rio_readinitb(&clientBuffer, originfd);
-  if(parseRequestLine(&clientBuffer, method, uri, version, proxyBuffer) < 0) return; /* Parse method, uri, version */
-  parseURI(uri, hostname, port, path); /* Parse hostname, port, path */
+  const char *pRequest;
+  int status = readRequest(clientBuffer, pParser, &pRequest);
+  if(status == -2) {
+    rio_writen(originfd, REQUEST_TOO_LARGE_RESPONSE, strlen(REQUEST_TOO_LARGE_RESPONSE));
+    writeEvent("Request head larger than the largest read ring: answered 431.");
+  }
+  if(status < 0) return False; /* Closed, reset, idle for too long, malformed or too large */
+  long long requestNs = metricsNow(), stageNs;
+  metricsCount(METRIC_REQUESTS, 1);
+  if(!requestSpanEquals(pRequest, pParser->method, "GET")) return False;
+  requestCopyTarget(pRequest, pParser, hostname, port, path); /* Parse hostname, port, path */
+  headerBuilderBuild(pHeaders, pRequest, pParser, user_agent_hdr, True); /* Build request line and headers as slices of the client buffer */
+  int isHttp11 = requestSpanEquals(pRequest, pParser->version, "HTTP/1.1");
+  int isKeepAlive = requestIsKeepAlive(isHttp11, pHeaders);
+
+  /* Serve From The Cache */
+  cacheMakeKey(pContext->cacheKey, sizeof(pContext->cacheKey), hostname, port, path);
+  stageNs = metricsRecord(METRIC_STAGE_PARSE, requestNs);
+  cacheObject *pObject = cacheAcquire(pContext->cacheKey);
+  flight *pFlight = NULL;
+  int role = FLIGHT_LEADER, freshness = CACHE_FRESH;
+  diskObject disk;
+  pContext->pStale = NULL;
+  pContext->isRevalidating = False;
+  pContext->staleOutcome = STALE_UNUSED;
+  if(pObject != NULL && (freshness = cacheFreshness(pObject, time(NULL))) == CACHE_STALE) { /* Not sent until the origin has had its say */
+    pContext->pStale = pObject;
+    pObject = NULL;
+  }
+  else if(freshness == CACHE_STALE_WHILE_REVALIDATE && cacheClaimRevalidation(pObject)) revalidatorSchedule(pObject, hostname, port, path); /* Sent now, refreshed behind it */
+  if(pObject == NULL && pContext->pStale == NULL && diskCacheAcquire(pContext->cacheKey, &disk) == 0) { /* Evicted from RAM, or cached before a restart */
+    isKeepAlive = writeDiskObject(pContext, originfd, &disk, isHttp11, isKeepAlive);
+    diskCacheRelease(&disk);
+    metricsCount(METRIC_DISK_HITS, 1);
+    metricsRecord(METRIC_STAGE_TOTAL, requestNs);
+    return isKeepAlive;
+  }
+  if(pObject == NULL && pContext->pStale == NULL) role = flightJoin(pContext->cacheKey, &pFlight, &pObject); /* Concurrent misses on one key share a single fetch */
+  if(pObject != NULL) {
+    isKeepAlive = writeCachedObject(pContext, originfd, pObject, isHttp11, isKeepAlive); /* Hit: the origin is never contacted */
+    cacheRelease(pObject);
+    metricsCount((freshness == CACHE_FRESH) ? METRIC_CACHE_HITS : METRIC_STALE_HITS, 1);
+    metricsRecord(METRIC_STAGE_TOTAL, requestNs);
+    return isKeepAlive;
+  }
+
+  /* Stream Another Request's Fetch */
+  if(role == FLIGHT_FOLLOWER) {
+    int isServed = followFlight(pContext, pFlight, originfd, isHttp11, &isKeepAlive);
+    flightLeave(pFlight, False);
+    if(isServed) {
+      metricsCount(METRIC_COALESCED, 1);
+      metricsRecord(METRIC_STAGE_TOTAL, requestNs);
+      return isKeepAlive;
+    }
+    pFlight = NULL; /* Abandoned before anything was sent: fetch it without a flight */
+  }
   
+  /* Ask With The Stale Object's Validators, Unless The Client Brought Its Own */
+  cacheObject *pStale = pContext->pStale;
+  if(pStale != NULL && !pHeaders->isConditional) {
+    if(pStale->etag != NULL) headerBuilderAddValidator(pHeaders, "If-None-Match: ", pStale->etag, pStale->etagLength);
+    if(pStale->lastModified != NULL) headerBuilderAddValidator(pHeaders, "If-Modified-Since: ", pStale->lastModified, pStale->lastModifiedLength);
+    pContext->isRevalidating = True;
+  }
+
   /* Send Request To The Destination Server */
-  int destinationfd = Open_clientfd(hostname, port); /* Open the client socket connecting to the destination server */
-  if(destinationfd < 0) {
-    writeEvent("Failed to connect to server.");
-    return;
-  }
-  Rio_readinitb(&serverBuffer, destinationfd); /* Setting up the internal buffer to read data from socket */
-  char requestLine[MAXLINE], headerBuffer[MAXBUF];
-  sprintf(requestLine, "GET %s HTTP/1.0\r\n", path); /* Build request line */
-  buildHeaderBuffer(&clientBuffer, hostname, headerBuffer); /* Build header line */
-  Rio_writen(destinationfd, requestLine, strlen(requestLine)); /* Write the request line on the socket */
-  Rio_writen(destinationfd, headerBuffer, strlen(headerBuffer)); /* Write the header line on the socket */
-
-  /* Send Response Back To Client */
-  deliverResponse(&serverBuffer, originfd);
-  Close(destinationfd);
-}
-static int parseRequestLine(rio_t *clientBuffer, char *method, char *uri, char *version, char *proxyBuffer) {
-  if(Rio_readlineb(clientBuffer, proxyBuffer, MAXLINE) <= 0) return -1;
-  if(sscanf(proxyBuffer, "%s %s %s", method, uri, version) != 3) return -1;
-  if(strcasecmp(method, "GET")) return -1;
+  int destinationfd, isReused, result = UPSTREAM_FAILED;
+  do {
+    stageNs = metricsNow();
+    destinationfd = upstreamAcquire(hostname, port); /* Reuse an idle keep-alive connection when there is one */
+    isReused = (destinationfd >= 0);
+    if(!isReused) destinationfd = resolverOpenClientfd(hostname, port); /* Open the client socket connecting to the destination server, with a cached lookup */
+    if(destinationfd < 0) {
+      writeEvent("Failed to connect to server.");
+      metricsCount(METRIC_ORIGIN_CONNECT_ERRORS, 1);
+      break;
+    }
+    stageNs = metricsRecord(METRIC_STAGE_CONNECT, stageNs);
+    Rio_readinitb(&pContext->serverBuffer, destinationfd); /* Setting up the internal buffer to read data from socket */
+    result = UPSTREAM_FAILED;
+    memcpy(pContext->parts, pHeaders->parts, pHeaders->partCount * sizeof(struct iovec));
+    if(rio_writev(destinationfd, pContext->parts, pHeaders->partCount) >= 0) { /* One syscall, one segment for the whole request */
+      pContext->requestSentNs = metricsRecord(METRIC_STAGE_WRITE, stageNs);
+      result = deliverResponse(pContext, pFlight, originfd, isHttp11, &isKeepAlive); /* Send Response Back To Client */
+    }
+    if(result == UPSTREAM_REUSABLE) upstreamRelease(hostname, port, destinationfd);
+    else close(destinationfd);
+  } while(result == UPSTREAM_FAILED && isReused); /* The origin dropped a pooled connection before answering: retry */
+  flightLeave(pFlight, True); /* Settled by now, unless no response ever came */
+  if(result == UPSTREAM_FAILED && destinationfd >= 0) {
+    writeEvent("Origin closed the connection without a response.");
+    metricsCount(METRIC_ORIGIN_RESPONSE_ERRORS, 1);
+  }
+
+  /* Settle The Stale Object: Confirmed, Standing In For A Failed Origin, Or Replaced */
+  pStale = pContext->pStale; /* A 304 swapped in the refreshed copy */
+  if(pStale != NULL) {
+    if(result == UPSTREAM_FAILED && cacheServesOnError(pStale, time(NULL))) pContext->staleOutcome = STALE_FOR_ERROR;
+    if(pContext->staleOutcome == STALE_REVALIDATED) metricsCount(METRIC_REVALIDATIONS_NOT_MODIFIED, 1);
+    else if(result == UPSTREAM_FAILED || pContext->staleOutcome == STALE_FOR_ERROR) metricsCount(METRIC_REVALIDATIONS_FAILED, 1);
+    else metricsCount(METRIC_REVALIDATIONS_MODIFIED, 1);
+    if(pContext->staleOutcome != STALE_UNUSED) {
+      isKeepAlive = writeCachedObject(pContext, originfd, pStale, isHttp11, isKeepAlive);
+      metricsCount((pContext->staleOutcome == STALE_REVALIDATED) ? METRIC_REVALIDATED_HITS : METRIC_STALE_HITS, 1);
+    }
+    cacheRelease(pStale);
+    pContext->pStale = NULL;
+  }
+  if(pContext->staleOutcome == STALE_UNUSED) {
+    if(result == UPSTREAM_FAILED) return False;
+    metricsCount(METRIC_MISSES, 1);
+  }
+  metricsRecord(METRIC_STAGE_TOTAL, requestNs);
+  return isKeepAlive;
+}
+static int readRequest(rio_ring_t *clientBuffer, requestParser *pRequest, const char **ppRequest) {
+  /* Parses the next request head in place, reading more only when the buffered bytes end mid-head; pipelined requests stay buffered */
+  int status;
+  ssize_t n;
+  const char *data;
+  requestParserInit(pRequest);
+  while((status = requestParse(pRequest, data = rio_ringpullupb(clientBuffer, clientBuffer->rio_cnt), clientBuffer->rio_cnt)) == PARSE_INCOMPLETE) {
+    if((n = rio_ringfillb(clientBuffer)) == -2) return -2; /* A head larger than RIO_RING_MAXSIZE */
+    if(n <= 0) return -1; /* Closed, idle or failed */
+  }
+  if(status == PARSE_ERROR) return -1;
+  rio_ringconsumeb(clientBuffer, pRequest->length);
+  *ppRequest = data; /* Consumed, but untouched until the next request is read */
   return 0;
 }
-static void parseURI(const char *uri, char *hostname, char *port, char *path) {
-  const char *pHost, *pLeftOfPort, *pPath;
-  int tLength;
-
-  /* Parse The Host */
-  if(!strncasecmp(uri, "http://", 7)) pHost = uri + 7; /* Locate the starting point of host */
-  else pHost = uri; /* Locate the starting point of host */
-  pLeftOfPort = strpbrk(pHost, " :/\r\n"); /* Locate the left adjacent point of port*/
-  if(pLeftOfPort == NULL) pLeftOfPort = pHost + strlen(pHost); /* Locate the left adjacent point of port*/
-  tLength = pLeftOfPort - pHost;
-  strncpy(hostname, pHost, tLength); /* Assign value to hostname */
-  hostname[tLength] = '\0';
-  
-  /* Parse The Port */
-  if(*pLeftOfPort == ':') {
-    const char *pPort = pLeftOfPort + 1;
-    pPath = strchr(pPort, '/'); /* Locate the starting point of path */
-    if(pPath == NULL) pPath = pPort + strlen(pPort); /* Locate the starting point of path */
-    tLength = pPath - pPort;
-    strncpy(port, pPort, tLength);
-    port[tLength] = '\0';
+static int keepsClientAlive(int isKeepAlive, int isHttp11, int bodyMode) {
+  /* The client can only find the end of a response that frames itself */
+  if(!isKeepAlive || bodyMode == BODY_UNTIL_CLOSE) return False;
+  if(bodyMode == BODY_CHUNKED && !isHttp11) return False; /* HTTP/1.0 clients do not parse chunked bodies */
+  return True;
+}
+static int sendToClient(connectionContext *pContext, int originfd, const void *data, size_t size) {
+  /* Every send to the client goes through here: a reset or timeout ends this connection, never the process */
+  if(pContext->isClientGone) return -1;
+  if(rio_writen(originfd, (void *)data, size) < 0) {
+    markClientGone(pContext);
+    return -1;
   }
-  else {
-    strcpy(port, "80");
-    pPath = pLeftOfPort;
+  metricsCount(METRIC_CLIENT_BYTES_SENT, size);
+  return 0;
+}
+static void markClientGone(connectionContext *pContext) {
+  if(!pContext->isClientGone) metricsCount(METRIC_CLIENT_SEND_ERRORS, 1);
+  pContext->isClientGone = True;
+}
+static int writeCachedObject(connectionContext *pContext, int originfd, cacheObject *pObject, int isHttp11, int isKeepAlive) {
+  isKeepAlive = keepsClientAlive(isKeepAlive, isHttp11, pObject->bodyMode);
+  char *connectionHeader = isKeepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  if(sendToClient(pContext, originfd, pObject->data, pObject->headerSize) < 0) return False;
+  if(sendToClient(pContext, originfd, connectionHeader, strlen(connectionHeader)) < 0) return False;
+  if(sendToClient(pContext, originfd, pObject->data + pObject->headerSize, pObject->size - pObject->headerSize) < 0) return False;
+  return isKeepAlive;
+}
+static int writeDiskObject(connectionContext *pContext, int originfd, diskObject *pObject, int isHttp11, int isKeepAlive) {
+  /* Same layout as "writeCachedObject", with the bytes going from the page cache to the socket */
+  isKeepAlive = keepsClientAlive(isKeepAlive, isHttp11, pObject->bodyMode);
+  char *connectionHeader = isKeepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  size_t bodySize = pObject->size - pObject->headerSize;
+  if(relaySendfile(pObject->fd, pObject->offset, originfd, pObject->headerSize) != (ssize_t)pObject->headerSize
+     || sendToClient(pContext, originfd, connectionHeader, strlen(connectionHeader)) < 0
+     || relaySendfile(pObject->fd, pObject->offset + pObject->headerSize, originfd, bodySize) != (ssize_t)bodySize) {
+    markClientGone(pContext);
+    return False;
   }
-
-  /* Parse The Path */
-  if(*pPath == '\0') strcpy(path, "/");
-  else strcpy(path, pPath);
+  metricsCount(METRIC_CLIENT_BYTES_SENT, pObject->size);
+  return isKeepAlive;
 }
-static void appendToBuffer(char *buffer, size_t *offset, size_t capacity, const char *append) {
-  if(*offset >= capacity - 1) return;
-  int nWritten = snprintf(buffer + *offset, capacity - *offset, "%s", append); /* Safe method to write on buffer */
-  if(nWritten < 0) return; /* Error from "snprintf" method */
+static int followFlight(connectionContext *pContext, flight *pFlight, int originfd, int isHttp11, int *pIsKeepAlive) {
+  /* Relays the leader's bytes as they arrive; False when it gave up before this client was sent anything */
+  pooledBuffer buffer;
+  size_t headerSize, offset = 0;
+  int bodyMode;
+  ssize_t n;
 
-  /* Update Offset */
-  if((size_t)nWritten >= capacity - *offset) *offset = capacity - 1; /* Overflow: Safety bar for the next "appendToBuffer" method call */
-  else *offset += (size_t)nWritten; /* Completed without overflow */
+  if(flightWaitHead(pFlight, &headerSize, &bodyMode) < 0) return False;
+  *pIsKeepAlive = keepsClientAlive(*pIsKeepAlive, isHttp11, bodyMode);
+  char *connectionHeader = *pIsKeepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  bufferPoolAcquire(&buffer);
+  while(True) {
+    size_t limit = (offset < headerSize && headerSize - offset < buffer.capacity) ? headerSize - offset : buffer.capacity; /* Stop at the blank line to add our header */
+    if((n = flightRead(pFlight, offset, buffer.data, limit)) <= 0) break;
+    if(sendToClient(pContext, originfd, buffer.data, n) < 0) break; /* The leader carries on for the cache and the other followers */
+    offset += n;
+    if(offset == headerSize && sendToClient(pContext, originfd, connectionHeader, strlen(connectionHeader)) < 0) break; /* Same layout as a cache hit */
+  }
+  bufferPoolRelease(&buffer);
+  if(n < 0) *pIsKeepAlive = False; /* The leader's origin cut the body short */
+  return True;
 }
-static void buildHeaderBuffer(rio_t *clientBuffer, const char *hostname, char *headerBuffer) {
-  char proxyBuffer[MAXLINE];
-  char hostHeader[MAXLINE];
-  int hasHostHeader = 0;
+static int deliverResponse(connectionContext *pContext, flight *pFlight, int originfd, int isHttp11, int *pIsKeepAlive) {
+  rio_t *serverBuffer = &pContext->serverBuffer;
+  char *proxyBuffer = pContext->lineBuffer;
+  char *headerBlock = pContext->headerBlock;
+  size_t headerSize = 0;
+  responseHead head;
+  bodyFramer framer;
+  cacheCapture capture; /* Copy of the response captured while streaming, handed to the cache */
+  pooledBuffer body = { NULL, 0, 0 }; /* Copy-loop buffer: borrowed on first use, grown while the origin keeps filling it */
+  int isSpliceable = True;
   ssize_t n;
-  size_t offset = 0;
-  headerBuffer[0] = '\0';
-
-  /* When Header Received */
-  while((n = Rio_readlineb(clientBuffer, proxyBuffer, MAXLINE)) > 0) {
-    if(!strcmp(proxyBuffer, "\r\n")) break;
-    if(!strncasecmp(proxyBuffer, "Host:", 5)) {
-      hasHostHeader = 1;
-      appendToBuffer(headerBuffer, &offset, MAXBUF, proxyBuffer);
-    } else if(!strncasecmp(proxyBuffer, "User-Agent:", 11)) {
-    } else if(!strncasecmp(proxyBuffer, "Connection:", 11)) {
-    } else if(!strncasecmp(proxyBuffer, "Proxy-Connection:", 17)) {
-    } else {
-      appendToBuffer(headerBuffer, &offset, MAXBUF, proxyBuffer);
+  size_t received;
+
+  /* Relay The Status Line And Headers */
+  if((n = rio_readlineb(serverBuffer, proxyBuffer, MAXLINE)) <= 0) return UPSTREAM_FAILED;
+  long long firstByteNs = metricsRecord(METRIC_STAGE_FIRST_BYTE, pContext->requestSentNs);
+  received = n; /* Header lines; body bytes are counted as they move */
+  cacheCaptureInit(&capture);
+  memcpy(headerBlock, proxyBuffer, n);
+  headerSize = n;
+  if(responseHeadParseStatus(&head, proxyBuffer) < 0) { /* Not HTTP/1.x: pass everything through until the origin closes */
+    head.statusCode = 0;
+    head.isKeepAlive = head.isChunked = False;
+    head.contentLength = -1;
+    bodyFramerInit(&framer, &head);
+    *pIsKeepAlive = False;
+    flushHeaderBlock(pContext, originfd, pFlight, &capture, headerBlock, &headerSize);
+    metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, received);
+  }
+  else if(pContext->pStale != NULL && ((head.statusCode == 304 && pContext->isRevalidating) || (head.statusCode >= 500 && cacheServesOnError(pContext->pStale, time(NULL))))) {
+    return withholdResponse(pContext, &head, headerSize);
+  }
+  else {
+    while((n = rio_readlineb(serverBuffer, proxyBuffer, MAXLINE)) > 0) {
+      received += n;
+      if(!strcmp(proxyBuffer, "\r\n")) break;
+      if(!responseHeadAdd(&head, proxyBuffer)) continue; /* Hop-by-hop: the proxy sets its own */
+      if(headerSize + n > sizeof(pContext->headerBlock)) flushHeaderBlock(pContext, originfd, pFlight, &capture, headerBlock, &headerSize);
+      memcpy(headerBlock + headerSize, proxyBuffer, n);
+      headerSize += n;
+    }
+    if(n <= 0) {
+      flightFinish(pFlight, &capture, pContext->cacheKey, BODY_UNTIL_CLOSE, False);
+      metricsCount(METRIC_ORIGIN_RESPONSE_ERRORS, 1);
+      metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, received);
+      *pIsKeepAlive = False;
+      return UPSTREAM_DONE;
+    }
+
+    /* The Connection Header Depends On How The Body Is Framed; The Cache Keeps The Block Without It */
+    bodyFramerInit(&framer, &head);
+    *pIsKeepAlive = keepsClientAlive(*pIsKeepAlive, isHttp11, framer.mode);
+    const char *connectionHeader = *pIsKeepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    size_t connectionSize = strlen(connectionHeader);
+    flightAppend(pFlight, &capture, headerBlock, headerSize);
+    flightAppend(pFlight, &capture, "\r\n", 2);
+    flightPublishHead(pFlight, &capture, framer.mode, (framer.mode == BODY_LENGTH) ? framer.remaining : (framer.mode == BODY_NONE) ? 0 : -1); /* Followers may stream once the size is known to fit */
+    if(headerSize + connectionSize > sizeof(pContext->headerBlock)) {
+      sendToClient(pContext, originfd, headerBlock, headerSize);
+      headerSize = 0;
     }
-    if(offset >= MAXBUF - 1) break;
+    memcpy(headerBlock + headerSize, connectionHeader, connectionSize);
+    sendToClient(pContext, originfd, headerBlock, headerSize + connectionSize);
+    metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, received);
   }
 
-  /* When No Header Received */
-  if(!hasHostHeader) {
-    snprintf(hostHeader, sizeof(hostHeader), "Host: %s\r\n", hostname);
-    appendToBuffer(headerBuffer, &offset, MAXBUF, hostHeader);
+  /* Relay Exactly The Body */
+  while(!framer.isComplete) {
+    if(pContext->isClientGone && !capture.isCapturing) break; /* Nobody is left to read the rest; a capture is still finished for the cache */
+    if(!capture.isCapturing && isSpliceable && framer.mode != BODY_CHUNKED) { /* Nothing left to capture: the kernel moves the rest */
+      if((n = spliceBody(pContext, originfd, &framer)) != RELAY_UNSUPPORTED) break;
+      isSpliceable = False; /* Fall back to the copy loop */
+    }
+    if(body.data == NULL) bufferPoolAcquire(&body);
+    size_t want = (framer.mode == BODY_LENGTH && framer.remaining < (long long)body.capacity) ? (size_t)framer.remaining : body.capacity;
+    if((n = rio_readsomeb(serverBuffer, body.data, want)) <= 0) {
+      if(n == 0 && framer.mode == BODY_UNTIL_CLOSE) framer.isComplete = True;
+      break; /* Otherwise the origin cut the body short */
+    }
+    size_t taken = bodyFramerScan(&framer, body.data, n);
+    sendToClient(pContext, originfd, body.data, taken);
+    metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, n);
+    flightAppend(pFlight, &capture, body.data, taken);
+    if(taken < (size_t)n) {
+      head.isKeepAlive = False; /* Bytes past the end of the body: the connection is out of step */
+      break;
+    }
+    if((size_t)n == body.capacity) bufferPoolGrow(&body); /* The origin had more than fit: try a larger buffer */
   }
-  appendToBuffer(headerBuffer, &offset, MAXBUF, user_agent_hdr);
-  appendToBuffer(headerBuffer, &offset, MAXBUF, "Connection: close\r\n");
-  appendToBuffer(headerBuffer, &offset, MAXBUF, "Proxy-Connection: close\r\n");
-  appendToBuffer(headerBuffer, &offset, MAXBUF, "\r\n");
+  bufferPoolRelease(&body);
 
-  if(offset >= MAXBUF) headerBuffer[MAXBUF - 1] = '\0';
-  else headerBuffer[offset] = '\0';
+  flightFinish(pFlight, &capture, pContext->cacheKey, framer.mode, framer.isComplete); /* Never cache a truncated response */
+  metricsRecord(METRIC_STAGE_RELAY, firstByteNs);
+  if(!framer.isComplete) {
+    if(!pContext->isClientGone) metricsCount(METRIC_ORIGIN_RESPONSE_ERRORS, 1);
+    *pIsKeepAlive = False;
+  } /* The client saw a short body: its framing is broken too */
+  if(head.isKeepAlive && framer.isComplete && framer.mode != BODY_UNTIL_CLOSE && serverBuffer->rio_cnt == 0) return UPSTREAM_REUSABLE;
+  return UPSTREAM_DONE;
 }
-static void deliverResponse(rio_t *serverBuffer, int originfd) {
-  char proxyBuffer[MAXBUF];
+static int withholdResponse(connectionContext *pContext, responseHead *pHead, size_t headerSize) {
+  /* A 304 to the proxy's validators, or an error stale-if-error covers: the client gets "pStale" instead, so nothing is relayed */
+  rio_t *serverBuffer = &pContext->serverBuffer;
+  char *line = pContext->lineBuffer;
+  size_t received = headerSize;
   ssize_t n;
-  while((n = Rio_readnb(serverBuffer, proxyBuffer, MAXBUF)) > 0) {
-    Rio_writen(originfd, proxyBuffer, n);
+  while((n = rio_readlineb(serverBuffer, line, MAXLINE)) > 0) {
+    received += n;
+    if(!strcmp(line, "\r\n")) break;
+    responseHeadAdd(pHead, line);
+    if(headerSize + n <= sizeof(pContext->headerBlock)) { /* An oversized block loses its tail: the stored head keeps those fields */
+      memcpy(pContext->headerBlock + headerSize, line, n);
+      headerSize += n;
+    }
+  }
+  metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, received);
+  if(pHead->statusCode != 304) {
+    pContext->staleOutcome = STALE_FOR_ERROR;
+    return UPSTREAM_DONE; /* The error body is never read: the connection cannot be reused */
+  }
+  pContext->staleOutcome = STALE_REVALIDATED; /* The origin confirmed the copy, even if its head was cut short */
+  if(n <= 0) return UPSTREAM_DONE;
+  cacheObject *pRefreshed = cacheRefresh(pContext->pStale, pContext->headerBlock, headerSize);
+  if(pRefreshed != NULL) { /* The client gets the head the 304 brought up to date */
+    cacheRelease(pContext->pStale);
+    pContext->pStale = pRefreshed;
+  }
+  return (pHead->isKeepAlive && serverBuffer->rio_cnt == 0) ? UPSTREAM_REUSABLE : UPSTREAM_DONE;
+}
+static void flushHeaderBlock(connectionContext *pContext, int originfd, flight *pFlight, cacheCapture *pCapture, char *headerBlock, size_t *pHeaderSize) {
+  sendToClient(pContext, originfd, headerBlock, *pHeaderSize);
+  flightAppend(pFlight, pCapture, headerBlock, *pHeaderSize);
+  *pHeaderSize = 0;
+}
+static ssize_t spliceBody(connectionContext *pContext, int originfd, bodyFramer *pFramer) {
+  /* Bytes rio already pulled into user space leave the usual way */
+  rio_t *serverBuffer = &pContext->serverBuffer;
+  size_t buffered = bodyFramerScan(pFramer, serverBuffer->rio_bufptr, serverBuffer->rio_cnt);
+  int isSent = (sendToClient(pContext, originfd, serverBuffer->rio_bufptr, buffered) == 0);
+  metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, buffered);
+  serverBuffer->rio_bufptr += buffered;
+  serverBuffer->rio_cnt -= buffered;
+  if(!isSent) return -1;
+  if(pFramer->isComplete) return 0;
+
+  /* The Rest Never Leaves The Kernel */
+  long long length = (pFramer->mode == BODY_LENGTH) ? pFramer->remaining : -1;
+  ssize_t n = relaySplice(serverBuffer->rio_fd, originfd, length);
+  if(n == RELAY_DESTINATION_FAILED) markClientGone(pContext); /* Not the origin's fault */
+  if(n < 0) return n;
+  metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, n);
+  metricsCount(METRIC_CLIENT_BYTES_SENT, n);
+  if(pFramer->mode == BODY_LENGTH) {
+    pFramer->remaining -= n;
+    pFramer->isComplete = (pFramer->remaining == 0);
   }
+  else pFramer->isComplete = True; /* EOF ends a close-delimited body */
+  return n;
 }
 static void *thread(void *pArgument) {
-  int originfd = *((int *)pArgument);
-  Free(pArgument);
+  slabCache contexts; /* This worker's connection contexts: the one it just released is the one it reuses, still in cache */
   Pthread_detach(Pthread_self());
-  processTransaction(originfd);
-  Close(originfd);
+  slabInit(&contexts, sizeof(connectionContext), 1);
+  while(True) {
+    long long acceptedNs;
+    int originfd = sbufRemove(&connectionQueue, &acceptedNs); /* Wait for the acceptor to hand over a connection */
+    metricsRecord(METRIC_STAGE_ACCEPT, acceptedNs);
+    connectionContext *pContext = slabAlloc(&contexts);
+    processConnection(pContext, originfd);
+    slabFree(&contexts, pContext);
+    close(originfd);
+    metricsCount(METRIC_CONNECTIONS_CLOSED, 1);
+  }
   return NULL;
 }
@@ -0,0 +1,68 @@
+/* Kept apart from csapp.h: _GNU_SOURCE makes netdb.h declare a conflicting "gai_error" */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "relay.h"
+
+static __thread int threadPipe[2] = { -1, -1 }; /* Reused by every blocking relay on this thread */
+
+static void resetThreadPipe(void);
+
+ssize_t relaySplice(int fromfd, int tofd, long long length) {
+  /* Blocking socket -> pipe -> socket copy of "length" bytes (-1: until EOF); the bytes never enter user space */
+  ssize_t total = 0;
+  if(threadPipe[0] < 0 && relayOpenPipe(threadPipe) < 0) return RELAY_UNSUPPORTED;
+
+  while(length < 0 || total < length) {
+    size_t want = (length < 0 || length - total > RELAY_CHUNK_SIZE) ? RELAY_CHUNK_SIZE : (size_t)(length - total);
+    ssize_t n = splice(fromfd, NULL, threadPipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if(n == 0) return total; /* EOF */
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      if(total == 0 && (errno == EINVAL || errno == ENOSYS)) return RELAY_UNSUPPORTED;
+      return -1;
+    }
+    for(ssize_t left = n; left > 0; ) {
+      ssize_t m = splice(threadPipe[0], NULL, tofd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(m < 0 && errno == EINTR) continue;
+      if(m <= 0) {
+        resetThreadPipe(); /* Bytes stranded in the pipe would leak into the next relay */
+        return RELAY_DESTINATION_FAILED;
+      }
+      left -= m;
+    }
+    total += n;
+  }
+  return total;
+}
+ssize_t relaySpliceChunk(int fromfd, int tofd, size_t length) {
+  /* One non-blocking hop, for event loops that keep a pipe per connection */
+  return splice(fromfd, NULL, tofd, NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+}
+int relayOpenPipe(int pipefd[2]) {
+  return pipe2(pipefd, O_CLOEXEC);
+}
+ssize_t relaySendfile(int fromfd, off_t offset, int tofd, size_t length) {
+  /* Blocking file -> socket copy straight from the page cache; short only if the file ends first */
+  size_t total = 0;
+  while(total < length) {
+    ssize_t n = sendfile(tofd, fromfd, &offset, length - total); /* Advances "offset" */
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return -1;
+    if(n == 0) break;
+    total += n;
+  }
+  return total;
+}
+ssize_t relaySendfileChunk(int fromfd, off_t offset, int tofd, size_t length) {
+  /* One hop for event loops: the socket's non-blocking mode makes it stop at EAGAIN */
+  return sendfile(tofd, fromfd, &offset, length);
+}
+
+static void resetThreadPipe(void) {
+  close(threadPipe[0]);
+  close(threadPipe[1]);
+  threadPipe[0] = threadPipe[1] = -1;
+}
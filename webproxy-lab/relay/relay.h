@@ -0,0 +1,16 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <sys/types.h>
+
+#define RELAY_UNSUPPORTED -2 /* splice() refused these descriptors before any byte moved */
+#define RELAY_DESTINATION_FAILED -3 /* The reader went away or failed; -1 means the source did */
+#define RELAY_CHUNK_SIZE 65536 /* Default pipe capacity */
+
+ssize_t relaySplice(int fromfd, int tofd, long long length);
+ssize_t relaySpliceChunk(int fromfd, int tofd, size_t length);
+int relayOpenPipe(int pipefd[2]);
+ssize_t relaySendfile(int fromfd, off_t offset, int tofd, size_t length);
+ssize_t relaySendfileChunk(int fromfd, off_t offset, int tofd, size_t length);
+
+#endif
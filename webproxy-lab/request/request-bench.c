@@ -0,0 +1,206 @@
+/*
+ * request-bench - Times the request parser against the line-at-a-time
+ *   parser it replaced (sscanf request line, strpbrk/strcpy URI split,
+ *   strncasecmp chain per header, snprintf into one block), both ending
+ *   in an outbound request ready to send.
+ *
+ *   make request-bench && ./request-bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "request.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+typedef struct {
+  const char *name;
+  const char *request;
+} benchCase;
+
+/* The header block the legacy path built */
+typedef struct {
+  char buffer[MAXLINE + MAXBUF];
+  size_t offset;
+  int hasHostHeader;
+  int connection;
+} legacyBuilder;
+
+static const benchCase cases[] = {
+  { "curl", "GET http://www.example.com/index.html HTTP/1.1\r\n"
+            "Host: www.example.com\r\n"
+            "User-Agent: curl/8.5.0\r\n"
+            "Accept: */*\r\n"
+            "Proxy-Connection: Keep-Alive\r\n"
+            "\r\n" },
+  { "browser", "GET http://www.example.com:8080/static/js/app.min.js?v=20240517 HTTP/1.1\r\n"
+               "Host: www.example.com:8080\r\n"
+               "Connection: keep-alive\r\n"
+               "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+               "sec-ch-ua-mobile: ?0\r\n"
+               "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+               "sec-ch-ua-platform: \"Linux\"\r\n"
+               "Accept: */*\r\n"
+               "Sec-Fetch-Site: same-origin\r\n"
+               "Sec-Fetch-Mode: no-cors\r\n"
+               "Sec-Fetch-Dest: script\r\n"
+               "Referer: http://www.example.com:8080/dashboard\r\n"
+               "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+               "Accept-Language: en-US,en;q=0.9,ko;q=0.8\r\n"
+               "\r\n" },
+  { "cookies", "GET http://shop.example.com/cart HTTP/1.1\r\n"
+               "Host: shop.example.com\r\n"
+               "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 14_4) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4 Safari/605.1.15\r\n"
+               "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+               "Accept-Language: en-GB,en;q=0.9\r\n"
+               "Accept-Encoding: gzip, deflate\r\n"
+               "Cookie: session=3f2a9c1be84d47a1b0c6d2e5f7a8b9c0; cart=af81c2d3e4f5a6b7c8d9e0f1a2b3c4d5e6f7a8b9; _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1715000000; prefs=theme%3Ddark%26lang%3Den%26currency%3DGBP; ab=variant-b\r\n"
+               "Upgrade-Insecure-Requests: 1\r\n"
+               "If-None-Match: \"5e1f-6a2b3c4d5e6f7\"\r\n"
+               "If-Modified-Since: Fri, 17 May 2024 09:12:44 GMT\r\n"
+               "Cache-Control: max-age=0\r\n"
+               "Connection: close\r\n"
+               "\r\n" },
+};
+
+static double elapsedNanoseconds(struct timespec start, struct timespec end);
+static size_t readLine(const char *data, size_t size, size_t *pOffset, char *line, size_t capacity);
+static size_t legacyParse(const char *data, size_t size, legacyBuilder *pBuilder);
+static size_t parserParse(const char *data, size_t size, headerBuilder *pBuilder);
+static void legacyParseURI(const char *uri, char *hostname, char *port, char *path);
+static void legacyAppend(legacyBuilder *pBuilder, const char *line);
+
+int main(int argc, char **argv) {
+  long iterations = (argc > 1) ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  legacyBuilder legacy;
+  headerBuilder builder;
+  volatile size_t sink = 0; /* Keeps the work from being optimized away */
+
+  printf("%-10s %14s %14s %8s\n", "headers", "legacy ns/req", "parser ns/req", "speedup");
+  for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    const char *data = cases[c].request;
+    size_t size = strlen(data);
+    struct timespec start, middle, end;
+
+    /* Same Output From Both, Or The Timing Means Nothing */
+    char parserBlock[MAXLINE + MAXBUF];
+    legacyParse(data, size, &legacy);
+    parserParse(data, size, &builder);
+    size_t parserSize = headerBuilderCopy(&builder, parserBlock, sizeof(parserBlock) - 1);
+    parserBlock[parserSize] = '\0';
+    if(strcmp(legacy.buffer, parserBlock)) {
+      fprintf(stderr, "%s: requests differ\n--- legacy\n%s--- parser\n%s", cases[c].name, legacy.buffer, parserBlock);
+      return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(long i = 0; i < iterations; i++) sink += legacyParse(data, size, &legacy);
+    clock_gettime(CLOCK_MONOTONIC, &middle);
+    for(long i = 0; i < iterations; i++) sink += parserParse(data, size, &builder);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double legacy = elapsedNanoseconds(start, middle) / iterations;
+    double parser = elapsedNanoseconds(middle, end) / iterations;
+    printf("%-10s %14.1f %14.1f %7.2fx\n", cases[c].name, legacy, parser, legacy / parser);
+  }
+  return sink == 0;
+}
+
+static double elapsedNanoseconds(struct timespec start, struct timespec end) {
+  return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+static size_t readLine(const char *data, size_t size, size_t *pOffset, char *line, size_t capacity) {
+  /* What "rio_readlineb" did for each line: copy byte by byte up to and including '\n' */
+  size_t n = 0;
+  while(*pOffset < size && n < capacity - 1) {
+    char c = data[(*pOffset)++];
+    line[n++] = c;
+    if(c == '\n') break;
+  }
+  line[n] = '\0';
+  return n;
+}
+static size_t legacyParse(const char *data, size_t size, legacyBuilder *pBuilder) {
+  char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char hostname[MAXLINE], port[16], path[MAXLINE];
+  size_t offset = 0;
+
+  readLine(data, size, &offset, line, sizeof(line));
+  if(sscanf(line, "%s %s %s", method, uri, version) != 3 || strcasecmp(method, "GET")) return 0;
+  legacyParseURI(uri, hostname, port, path);
+  snprintf(line, sizeof(line), "GET %s HTTP/1.1\r\n", path);
+  pBuilder->offset = 0;
+  pBuilder->hasHostHeader = 0;
+  pBuilder->connection = CONNECTION_UNSPECIFIED;
+  legacyAppend(pBuilder, line);
+  while(readLine(data, size, &offset, line, sizeof(line)) > 0) {
+    if(!strcmp(line, "\r\n")) break;
+    if(!strncasecmp(line, "Host:", 5)) {
+      pBuilder->hasHostHeader = 1;
+      legacyAppend(pBuilder, line);
+    } else if(!strncasecmp(line, "User-Agent:", 11)) {
+    } else if(!strncasecmp(line, "Connection:", 11) || !strncasecmp(line, "Proxy-Connection:", 17)) {
+      const char *value = strchr(line, ':');
+      if(headerHasToken(value, strlen(value), "close")) pBuilder->connection = CONNECTION_CLOSE;
+      else if(headerHasToken(value, strlen(value), "keep-alive") && pBuilder->connection != CONNECTION_CLOSE) pBuilder->connection = CONNECTION_KEEP_ALIVE;
+    } else if(!strncasecmp(line, "Keep-Alive:", 11)) {
+    } else {
+      legacyAppend(pBuilder, line);
+    }
+  }
+  if(!pBuilder->hasHostHeader) {
+    legacyAppend(pBuilder, "Host: ");
+    legacyAppend(pBuilder, hostname);
+    legacyAppend(pBuilder, "\r\n");
+  }
+  legacyAppend(pBuilder, "User-Agent: bench\r\n");
+  legacyAppend(pBuilder, "Connection: keep-alive\r\n");
+  legacyAppend(pBuilder, "\r\n");
+  return pBuilder->offset + strlen(port);
+}
+static size_t parserParse(const char *data, size_t size, headerBuilder *pBuilder) {
+  char hostname[MAXLINE], port[16], path[MAXLINE];
+  requestParser request;
+
+  requestParserInit(&request);
+  if(requestParse(&request, data, size) != PARSE_DONE || !requestSpanEquals(data, request.method, "GET")) return 0;
+  requestCopyTarget(data, &request, hostname, port, path);
+  headerBuilderBuild(pBuilder, data, &request, "User-Agent: bench\r\n", 1);
+  return pBuilder->size + strlen(port);
+}
+static void legacyParseURI(const char *uri, char *hostname, char *port, char *path) {
+  const char *pHost, *pLeftOfPort, *pPath;
+  int tLength;
+
+  if(!strncasecmp(uri, "http://", 7)) pHost = uri + 7;
+  else pHost = uri;
+  pLeftOfPort = strpbrk(pHost, " :/\r\n");
+  if(pLeftOfPort == NULL) pLeftOfPort = pHost + strlen(pHost);
+  tLength = pLeftOfPort - pHost;
+  strncpy(hostname, pHost, tLength);
+  hostname[tLength] = '\0';
+  if(*pLeftOfPort == ':') {
+    const char *pPort = pLeftOfPort + 1;
+    pPath = strchr(pPort, '/');
+    if(pPath == NULL) pPath = pPort + strlen(pPort);
+    tLength = pPath - pPort;
+    strncpy(port, pPort, tLength);
+    port[tLength] = '\0';
+  }
+  else {
+    strcpy(port, "80");
+    pPath = pLeftOfPort;
+  }
+  if(*pPath == '\0') strcpy(path, "/");
+  else strcpy(path, pPath);
+}
+static void legacyAppend(legacyBuilder *pBuilder, const char *line) {
+  /* The old "appendToBuffer" */
+  if(pBuilder->offset >= sizeof(pBuilder->buffer) - 1) return;
+  int nWritten = snprintf(pBuilder->buffer + pBuilder->offset, sizeof(pBuilder->buffer) - pBuilder->offset, "%s", line);
+  if(nWritten < 0) return;
+  if((size_t)nWritten >= sizeof(pBuilder->buffer) - pBuilder->offset) pBuilder->offset = sizeof(pBuilder->buffer) - 1;
+  else pBuilder->offset += (size_t)nWritten;
+}
@@ -0,0 +1,148 @@
+#include <string.h>
+#include <strings.h>
+#include "request-parser.h"
+
+typedef enum {
+  STATE_LEADING, /* Stray line endings before the request line */
+  STATE_REQUEST_LINE,
+  STATE_HEADERS
+} parserState;
+
+/* Perfect hash over the names the proxy rewrites or looks at: slot = (length * 31 + lower-case first byte) % 16 */
+#define HEADER_TABLE_SIZE 16
+static const struct {
+  const char *name;
+  size_t length;
+  int id;
+} headerTable[HEADER_TABLE_SIZE] = {
+  [0] = { "proxy-connection", 16, HEADER_PROXY_CONNECTION },
+  [1] = { "keep-alive", 10, HEADER_KEEP_ALIVE },
+  [4] = { "host", 4, HEADER_HOST },
+  [8] = { "if-modified-since", 17, HEADER_IF_MODIFIED_SINCE },
+  [9] = { "connection", 10, HEADER_CONNECTION },
+  [11] = { "user-agent", 10, HEADER_USER_AGENT },
+  [12] = { "if-none-match", 13, HEADER_IF_NONE_MATCH },
+};
+
+/* A macro rather than a function: the default build is unoptimized and this runs several times per line */
+#define SET_SPAN(span, from, to) ((span).offset = (from), (span).length = (to) - (from))
+
+static int parseRequestLine(requestParser *pParser, const char *data, unsigned int start, unsigned int end);
+static int parseHeaderLine(requestParser *pParser, const char *data, unsigned int start, unsigned int end, unsigned int next);
+static void splitURI(requestParser *pParser, const char *data);
+
+void requestParserInit(requestParser *pParser) {
+  pParser->state = STATE_LEADING;
+  pParser->position = pParser->lineStart = 0;
+  pParser->headerCount = 0;
+  pParser->length = 0;
+}
+int requestParse(requestParser *pParser, const char *data, size_t size) {
+  /* Line by line: memchr finds each LF word-at-a-time, and a line is only split once it is complete */
+  unsigned int i = pParser->position;
+
+  if(pParser->state == STATE_LEADING) {
+    while(i < size && (data[i] == '\r' || data[i] == '\n')) i++;
+    if(i == size) {
+      pParser->position = i;
+      return PARSE_INCOMPLETE;
+    }
+    pParser->lineStart = i;
+    pParser->state = STATE_REQUEST_LINE;
+  }
+  while(i < size) {
+    const char *pLineFeed = memchr(data + i, '\n', size - i);
+    if(pLineFeed == NULL) break; /* Bytes before "size" are not looked at again */
+    unsigned int start = pParser->lineStart;
+    unsigned int next = pLineFeed - data + 1;
+    unsigned int end = next - 1;
+    if(end > start && data[end - 1] == '\r') end--;
+
+    if(pParser->state == STATE_REQUEST_LINE) {
+      if(parseRequestLine(pParser, data, start, end) < 0) return PARSE_ERROR;
+      pParser->state = STATE_HEADERS;
+    }
+    else if(end == start) { /* Blank line: the head is complete */
+      pParser->position = pParser->length = next;
+      splitURI(pParser, data);
+      return PARSE_DONE;
+    }
+    else if(parseHeaderLine(pParser, data, start, end, next) < 0) return PARSE_ERROR;
+    i = pParser->lineStart = next;
+  }
+  pParser->position = size;
+  return PARSE_INCOMPLETE;
+}
+int requestHeaderId(const char *name, size_t length) {
+  /* One table probe and at most one compare, whatever the header */
+  if(length == 0) return HEADER_OTHER;
+  unsigned int slot = (unsigned int)(length * 31 + (name[0] | 0x20)) % HEADER_TABLE_SIZE;
+  if(headerTable[slot].length != length) return HEADER_OTHER;
+  for(size_t i = 0; i < length; i++) {
+    if((name[i] | 0x20) != headerTable[slot].name[i]) return HEADER_OTHER; /* Table names are lower case; '-' already has bit 0x20 */
+  }
+  return headerTable[slot].id;
+}
+int requestSpanEquals(const char *data, requestSpan span, const char *literal) {
+  /* Case-insensitive */
+  return strlen(literal) == span.length && !strncasecmp(data + span.offset, literal, span.length);
+}
+size_t requestSpanCopy(char *destination, size_t capacity, const char *data, requestSpan span) {
+  /* NUL-terminated copy for the string APIs; cut to "capacity" */
+  size_t length = (span.length < capacity) ? span.length : capacity - 1;
+  memcpy(destination, data + span.offset, length);
+  destination[length] = '\0';
+  return length;
+}
+
+static int parseRequestLine(requestParser *pParser, const char *data, unsigned int start, unsigned int end) {
+  /* "METHOD SP URI SP VERSION", each piece non-empty */
+  const char *pSpace = memchr(data + start, ' ', end - start);
+  if(pSpace == NULL || pSpace == data + start) return -1;
+  SET_SPAN(pParser->method, start, pSpace - data);
+  unsigned int uriStart = pSpace - data + 1;
+  pSpace = memchr(data + uriStart, ' ', end - uriStart);
+  if(pSpace == NULL || pSpace == data + uriStart) return -1; /* HTTP/0.9 or an empty URI */
+  SET_SPAN(pParser->uri, uriStart, pSpace - data);
+  unsigned int versionStart = pSpace - data + 1;
+  if(versionStart == end || memchr(data + versionStart, ' ', end - versionStart) != NULL) return -1;
+  SET_SPAN(pParser->version, versionStart, end);
+  return 0;
+}
+static int parseHeaderLine(requestParser *pParser, const char *data, unsigned int start, unsigned int end, unsigned int next) {
+  /* "Name: value", with no whitespace in the name and none kept around the value */
+  if(pParser->headerCount == REQUEST_MAX_HEADERS) return -1;
+  if(data[start] == ' ' || data[start] == '\t') return -1; /* Obsolete line folding */
+  const char *pColon = memchr(data + start, ':', end - start);
+  if(pColon == NULL || pColon == data + start) return -1;
+  unsigned int nameEnd = pColon - data;
+  for(unsigned int i = start; i < nameEnd; i++) {
+    if(data[i] == ' ' || data[i] == '\t') return -1;
+  }
+  unsigned int valueStart = nameEnd + 1, valueEnd = end;
+  while(valueStart < valueEnd && (data[valueStart] == ' ' || data[valueStart] == '\t')) valueStart++;
+  while(valueEnd > valueStart && (data[valueEnd - 1] == ' ' || data[valueEnd - 1] == '\t')) valueEnd--;
+
+  requestHeader *pHeader = &pParser->headers[pParser->headerCount++];
+  SET_SPAN(pHeader->line, start, next);
+  SET_SPAN(pHeader->name, start, nameEnd);
+  SET_SPAN(pHeader->value, valueStart, valueEnd);
+  pHeader->id = requestHeaderId(data + start, nameEnd - start);
+  return 0;
+}
+static void splitURI(requestParser *pParser, const char *data) {
+  /* "http://host[:port]/path", or a bare "host[:port]/path" */
+  unsigned int i = pParser->uri.offset;
+  unsigned int end = pParser->uri.offset + pParser->uri.length;
+  if(pParser->uri.length >= 7 && !strncasecmp(data + i, "http://", 7)) i += 7;
+  unsigned int hostStart = i;
+  while(i < end && data[i] != ':' && data[i] != '/') i++;
+  SET_SPAN(pParser->hostname, hostStart, i);
+  if(i < end && data[i] == ':') {
+    unsigned int portStart = ++i;
+    while(i < end && data[i] != '/') i++;
+    SET_SPAN(pParser->port, portStart, i);
+  }
+  else SET_SPAN(pParser->port, i, i);
+  SET_SPAN(pParser->path, i, end);
+}
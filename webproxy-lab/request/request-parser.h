@@ -0,0 +1,51 @@
+#ifndef REQUEST_PARSER_H
+#define REQUEST_PARSER_H
+
+#include <stddef.h>
+
+#define PARSE_ERROR -1
+#define PARSE_INCOMPLETE 0 /* Call again with the same bytes plus whatever arrived since */
+#define PARSE_DONE 1
+
+/* Headers the proxy rewrites or looks at, recognized by "requestHeaderId" */
+#define HEADER_OTHER 0
+#define HEADER_HOST 1
+#define HEADER_USER_AGENT 2
+#define HEADER_CONNECTION 3
+#define HEADER_PROXY_CONNECTION 4
+#define HEADER_KEEP_ALIVE 5
+#define HEADER_IF_NONE_MATCH 6
+#define HEADER_IF_MODIFIED_SINCE 7
+
+#define REQUEST_MAX_HEADERS 100
+
+/* Bytes [offset, offset + length) of the buffer being parsed: survives the buffer being moved between reads */
+typedef struct {
+  unsigned int offset, length;
+} requestSpan;
+
+typedef struct {
+  requestSpan line; /* Whole line with its line ending: what gets forwarded */
+  requestSpan name, value; /* Value without surrounding whitespace */
+  int id; /* HEADER_* */
+} requestHeader;
+
+/* Resumable parse of one request head; every span is relative to the start of the bytes handed in */
+typedef struct {
+  int state;
+  unsigned int position; /* Where the next call resumes looking for a line feed */
+  unsigned int lineStart; /* First byte of the line not yet complete */
+  requestSpan method, uri, version;
+  requestSpan hostname, port, path; /* Pieces of "uri"; empty when absent */
+  requestHeader headers[REQUEST_MAX_HEADERS];
+  int headerCount;
+  unsigned int length; /* Bytes up to and including the blank line, once PARSE_DONE */
+} requestParser;
+
+void requestParserInit(requestParser *pParser);
+int requestParse(requestParser *pParser, const char *data, size_t size);
+int requestHeaderId(const char *name, size_t length);
+int requestSpanEquals(const char *data, requestSpan span, const char *literal);
+size_t requestSpanCopy(char *destination, size_t capacity, const char *data, requestSpan span);
+
+#endif
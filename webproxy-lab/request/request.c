@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "request.h"
+
+/* The proxy's Connection lines and the blank line, as one slice */
+#define KEEP_ALIVE_TAIL "Connection: keep-alive\r\n\r\n"
+#define CLOSE_TAIL "Connection: close\r\nProxy-Connection: close\r\n\r\n"
+
+static void addHeader(headerBuilder *pBuilder, const char *data, const requestHeader *pHeader);
+static void addPart(headerBuilder *pBuilder, const char *base, size_t length);
+
+void requestCopyTarget(const char *data, const requestParser *pRequest, char *hostname, char *port, char *path) {
+  /* MAXLINE hostname and path, 16-byte port: the defaults fill in what the URI left out */
+  requestSpanCopy(hostname, MAXLINE, data, pRequest->hostname);
+  if(pRequest->port.length == 0) strcpy(port, "80");
+  else requestSpanCopy(port, 16, data, pRequest->port);
+  if(pRequest->path.length == 0) strcpy(path, "/");
+  else requestSpanCopy(path, MAXLINE, data, pRequest->path);
+}
+void headerBuilderBuild(headerBuilder *pBuilder, const char *data, const requestParser *pRequest, const char *userAgentHeader, int isKeepAlive) {
+  /* "data" must stay put until the parts are written: nothing is copied out of it */
+  pBuilder->partCount = 0;
+  pBuilder->size = 0;
+  pBuilder->hasHostHeader = 0;
+  pBuilder->connection = CONNECTION_UNSPECIFIED;
+  pBuilder->isConditional = 0;
+
+  /* Request Line: Origin-Form Path, Version Matching The Connection Policy */
+  addPart(pBuilder, "GET ", 4);
+  if(pRequest->path.length == 0) addPart(pBuilder, "/", 1);
+  else addPart(pBuilder, data + pRequest->path.offset, pRequest->path.length);
+  if(isKeepAlive) addPart(pBuilder, " HTTP/1.1\r\n", 11);
+  else addPart(pBuilder, " HTTP/1.0\r\n", 11);
+
+  /* Client Headers, Minus The Ones The Proxy Rewrites */
+  for(int i = 0; i < pRequest->headerCount; i++) addHeader(pBuilder, data, &pRequest->headers[i]);
+
+  /* When No Header Received */
+  if(!pBuilder->hasHostHeader) {
+    addPart(pBuilder, "Host: ", 6);
+    addPart(pBuilder, data + pRequest->hostname.offset, pRequest->hostname.length);
+    addPart(pBuilder, "\r\n", 2);
+  }
+  addPart(pBuilder, userAgentHeader, strlen(userAgentHeader));
+  if(isKeepAlive) addPart(pBuilder, KEEP_ALIVE_TAIL, sizeof(KEEP_ALIVE_TAIL) - 1); /* Pooled upstream */
+  else addPart(pBuilder, CLOSE_TAIL, sizeof(CLOSE_TAIL) - 1);
+}
+void headerBuilderAddValidator(headerBuilder *pBuilder, const char *prefix, const char *value, size_t length) {
+  /* "prefix", "value" and a line ending, slotted in ahead of the proxy's Connection lines; "value" must stay put until the parts are written */
+  struct iovec tail = pBuilder->parts[--pBuilder->partCount];
+  pBuilder->size -= tail.iov_len;
+  addPart(pBuilder, prefix, strlen(prefix));
+  addPart(pBuilder, value, length);
+  addPart(pBuilder, "\r\n", 2);
+  addPart(pBuilder, tail.iov_base, tail.iov_len);
+}
+size_t headerBuilderCopy(const headerBuilder *pBuilder, char *buffer, size_t capacity) {
+  /* Flattens the parts for callers that cannot writev; returns 0 when they do not fit */
+  if(pBuilder->size > capacity) return 0;
+  size_t offset = 0;
+  for(int i = 0; i < pBuilder->partCount; i++) {
+    memcpy(buffer + offset, pBuilder->parts[i].iov_base, pBuilder->parts[i].iov_len);
+    offset += pBuilder->parts[i].iov_len;
+  }
+  return offset;
+}
+int requestIsKeepAlive(int isHttp11, const headerBuilder *pBuilder) {
+  if(pBuilder->connection == CONNECTION_CLOSE) return 0;
+  if(pBuilder->connection == CONNECTION_KEEP_ALIVE) return 1;
+  return isHttp11; /* Persistent by default from HTTP/1.1 on */
+}
+int headerHasToken(const char *value, size_t length, const char *token) {
+  /* Case-insensitive search for "token" in a comma separated header value of "length" bytes */
+  size_t tokenLength = strlen(token);
+  for(const char *p = value; p + tokenLength <= value + length; p++) {
+    if(strncasecmp(p, token, tokenLength)) continue;
+    char before = (p == value) ? ' ' : p[-1];
+    char after = (p + tokenLength == value + length) ? '\0' : p[tokenLength];
+    if((before == ' ' || before == ',' || before == '\t' || before == ':') && (after == '\0' || after == ',' || after == ' ' || after == '\r' || after == '\n' || after == ';')) return 1;
+  }
+  return 0;
+}
+
+static void addHeader(headerBuilder *pBuilder, const char *data, const requestHeader *pHeader) {
+  const char *value = data + pHeader->value.offset;
+  switch(pHeader->id) {
+    case HEADER_HOST:
+      pBuilder->hasHostHeader = 1;
+      addPart(pBuilder, data + pHeader->line.offset, pHeader->line.length);
+      break;
+    case HEADER_USER_AGENT:
+    case HEADER_KEEP_ALIVE:
+      break; /* Replaced by the proxy's own, or hop-by-hop */
+    case HEADER_CONNECTION:
+    case HEADER_PROXY_CONNECTION:
+      if(headerHasToken(value, pHeader->value.length, "close")) pBuilder->connection = CONNECTION_CLOSE; /* Remembered for the client side, never forwarded */
+      else if(headerHasToken(value, pHeader->value.length, "keep-alive") && pBuilder->connection != CONNECTION_CLOSE) pBuilder->connection = CONNECTION_KEEP_ALIVE;
+      break;
+    case HEADER_IF_NONE_MATCH:
+    case HEADER_IF_MODIFIED_SINCE:
+      pBuilder->isConditional = 1;
+      addPart(pBuilder, data + pHeader->line.offset, pHeader->line.length);
+      break;
+    default:
+      addPart(pBuilder, data + pHeader->line.offset, pHeader->line.length);
+  }
+}
+static void addPart(headerBuilder *pBuilder, const char *base, size_t length) {
+  /* Consecutive forwarded lines are still contiguous in the client buffer: grow the last slice instead of adding one */
+  struct iovec *pLast = (pBuilder->partCount > 0) ? &pBuilder->parts[pBuilder->partCount - 1] : NULL;
+  if(pLast != NULL && (char *)pLast->iov_base + pLast->iov_len == base) pLast->iov_len += length;
+  else {
+    pBuilder->parts[pBuilder->partCount].iov_base = (void *)base;
+    pBuilder->parts[pBuilder->partCount].iov_len = length;
+    pBuilder->partCount++;
+  }
+  pBuilder->size += length;
+}
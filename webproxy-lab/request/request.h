@@ -0,0 +1,37 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "../csapp.h"
+#include "request-parser.h"
+
+/* What the client's Connection / Proxy-Connection headers asked for */
+#define CONNECTION_UNSPECIFIED 0
+#define CONNECTION_CLOSE 1
+#define CONNECTION_KEEP_ALIVE 2
+
+/* Sent instead of silently dropping a client whose request head does not fit the read buffer */
+#define REQUEST_TOO_LARGE_RESPONSE "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+/* Request line, every header, three lines of the proxy's own and two validators, at most */
+#define HEADER_BUILDER_MAX_PARTS (REQUEST_MAX_HEADERS + 14)
+
+/* Outbound request as slices for one writev: client bytes forwarded where they were read, plus the proxy's constant lines */
+typedef struct {
+  struct iovec parts[HEADER_BUILDER_MAX_PARTS];
+  int partCount;
+  size_t size; /* Sum of the part lengths */
+  int hasHostHeader;
+  int connection; /* CONNECTION_* */
+  int isConditional; /* The client sent validators of its own: a 304 is its answer, not the proxy's */
+} headerBuilder;
+
+void requestCopyTarget(const char *data, const requestParser *pRequest, char *hostname, char *port, char *path);
+void headerBuilderBuild(headerBuilder *pBuilder, const char *data, const requestParser *pRequest, const char *userAgentHeader, int isKeepAlive);
+void headerBuilderAddValidator(headerBuilder *pBuilder, const char *prefix, const char *value, size_t length);
+size_t headerBuilderCopy(const headerBuilder *pBuilder, char *buffer, size_t capacity);
+int requestIsKeepAlive(int isHttp11, const headerBuilder *pBuilder);
+int headerHasToken(const char *value, size_t length, const char *token);
+
+#endif
@@ -0,0 +1,453 @@
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include "../csapp.h"
+#include "../event-log/event-log.h"
+#include "resolver.h"
+
+#define RESOLVER_KEY_SIZE (RESOLVER_HOST_SIZE + 16)
+
+typedef enum {
+  ENTRY_RESOLVING, /* Queued or inside getaddrinfo: later callers wait on it */
+  ENTRY_RESOLVED,
+  ENTRY_FAILED /* Negative entry: callers fail fast until it expires */
+} entryState;
+
+/* Event-loop descriptor to poke when an entry settles */
+typedef struct resolverWaiter {
+  int notifyfd;
+  struct resolverWaiter *pNext;
+} resolverWaiter;
+
+/* Answer for one (host, port) */
+typedef struct resolverEntry {
+  char key[RESOLVER_KEY_SIZE];
+  char hostname[RESOLVER_HOST_SIZE], port[16];
+  unsigned int hash;
+  entryState state;
+  time_t expiresAt;
+  resolverResult result;
+  resolverWaiter *pWaiters;
+  int referenceCount; /* Callers waiting on it plus a queued resolution, guarded by the shard lock */
+  int isEvicted; /* Out of the table, freed by the last reference */
+  struct resolverEntry *pPrevious, *pNext; /* LRU list: head is the most recently used */
+  struct resolverEntry *pBucketNext;
+  struct resolverEntry *pQueueNext; /* Resolver thread queue */
+} resolverEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t settled; /* Broadcast whenever an entry of this shard leaves ENTRY_RESOLVING */
+  resolverEntry *buckets[RESOLVER_BUCKET_COUNT];
+  resolverEntry *pHead, *pTail;
+  int entryCount;
+  resolverStats stats; /* Counted under "lock", summed by "resolverGetStats" */
+} resolverShard;
+
+static resolverShard shards[RESOLVER_SHARD_COUNT];
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+static resolverEntry *pQueueHead, *pQueueTail;
+static int connectTimeoutMs = RESOLVER_CONNECT_TIMEOUT_MS;
+
+static int beginLookup(const char *hostname, const char *port, resolverResult *pResult, resolverShard **ppShard, resolverEntry **ppEntry);
+static void enqueueEntry(resolverEntry *pEntry);
+static void *resolverThread(void *pArgument);
+static void resolveEntry(resolverEntry *pEntry);
+static void interleaveFamilies(resolverResult *pResult);
+static int startConnect(const resolverAddress *pAddress, int *pIsConnected);
+static void countConnect(const char *hostname, const char *port, int isFallback, int isTimeout);
+static long long nowMilliseconds(void);
+static void reportStats(void);
+static void makeKey(char *key, const char *hostname, const char *port);
+static unsigned int hashKey(const char *key);
+static resolverShard *shardOf(unsigned int hash);
+static resolverEntry *findEntry(resolverShard *pShard, const char *key, unsigned int hash);
+static int settledResult(resolverEntry *pEntry, resolverResult *pResult);
+static void linkFront(resolverShard *pShard, resolverEntry *pEntry);
+static void unlinkList(resolverShard *pShard, resolverEntry *pEntry);
+static void evictEntries(resolverShard *pShard);
+static void releaseEntry(resolverEntry *pEntry);
+
+void resolverInit(int workerCount, int timeoutMs) {
+  pthread_t threadId;
+  connectTimeoutMs = timeoutMs;
+  for(int i = 0; i < RESOLVER_SHARD_COUNT; i++) {
+    memset(&shards[i], 0, sizeof(resolverShard));
+    pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_cond_init(&shards[i].settled, NULL);
+  }
+  for(long i = 0; i < workerCount; i++) Pthread_create(&threadId, NULL, resolverThread, (void *)i);
+}
+int resolverLookup(const char *hostname, const char *port, resolverResult *pResult) {
+  /* Blocks until the address list is known; getaddrinfo itself runs on a resolver thread */
+  resolverShard *pShard;
+  resolverEntry *pEntry;
+  int status = beginLookup(hostname, port, pResult, &pShard, &pEntry);
+  if(status != RESOLVER_PENDING) return status;
+
+  pthread_mutex_lock(&pShard->lock);
+  while(pEntry->state == ENTRY_RESOLVING) pthread_cond_wait(&pShard->settled, &pShard->lock);
+  status = settledResult(pEntry, pResult);
+  pthread_mutex_unlock(&pShard->lock);
+  releaseEntry(pEntry);
+  return status;
+}
+int resolverLookupAsync(const char *hostname, const char *port, resolverResult *pResult, int notifyfd) {
+  /* Never blocks: on RESOLVER_PENDING "notifyfd" gets an 8-byte write once the answer is in, and the caller asks again */
+  resolverShard *pShard;
+  resolverEntry *pEntry;
+  int status = beginLookup(hostname, port, pResult, &pShard, &pEntry);
+  if(status != RESOLVER_PENDING) return status;
+
+  pthread_mutex_lock(&pShard->lock);
+  if(pEntry->state != ENTRY_RESOLVING) status = settledResult(pEntry, pResult); /* Settled in between */
+  else {
+    resolverWaiter *pWaiter = pEntry->pWaiters;
+    while(pWaiter != NULL && pWaiter->notifyfd != notifyfd) pWaiter = pWaiter->pNext;
+    if(pWaiter == NULL) { /* One poke per descriptor is enough: the loop retries every pending lookup */
+      pWaiter = Malloc(sizeof(resolverWaiter));
+      pWaiter->notifyfd = notifyfd;
+      pWaiter->pNext = pEntry->pWaiters;
+      pEntry->pWaiters = pWaiter;
+    }
+  }
+  pthread_mutex_unlock(&pShard->lock);
+  releaseEntry(pEntry);
+  return status;
+}
+int resolverOpenClientfd(const char *hostname, const char *port) {
+  /* "open_clientfd" over the cached address list, racing the addresses RFC 8305 style instead of waiting out each one:
+     -2 when the name does not resolve, -1 when every connect fails or the deadline passes. The socket returned is blocking */
+  resolverResult result;
+  struct pollfd attempts[RESOLVER_MAX_ADDRESSES];
+  int attemptAddress[RESOLVER_MAX_ADDRESSES]; /* Which address each attempt dialed */
+  int attemptCount = 0, liveCount = 0, next = 0, clientfd = -1, winner = -1, isConnected;
+  if(resolverLookup(hostname, port, &result) != RESOLVER_READY) return -2;
+
+  long long nowMs = nowMilliseconds(), deadlineMs = nowMs + connectTimeoutMs, nextStartMs = nowMs;
+  while(clientfd < 0 && nowMs < deadlineMs) {
+    /* Start The Next Address: On Schedule, Or At Once When Nothing Is Left In Flight Or The Last One Failed */
+    if(next < result.count && (nowMs >= nextStartMs || liveCount == 0)) {
+      int fd = startConnect(&result.addresses[next], &isConnected);
+      if(fd >= 0 && isConnected) { /* Loopback and other local addresses connect on the spot */
+        clientfd = fd;
+        winner = next;
+        break;
+      }
+      if(fd >= 0) {
+        attempts[attemptCount].fd = fd;
+        attempts[attemptCount].events = POLLOUT;
+        attemptAddress[attemptCount++] = next;
+        liveCount++;
+        nextStartMs = nowMs + RESOLVER_ATTEMPT_DELAY_MS;
+      }
+      else nextStartMs = nowMs; /* Refused or unreachable on the spot: nothing to wait for, so the next address starts now */
+      next++;
+      continue;
+    }
+    if(liveCount == 0) break; /* Every address refused */
+
+    /* Wait For Any Attempt, Until The Next One Is Due */
+    long long waitMs = deadlineMs - nowMs;
+    if(next < result.count && nextStartMs - nowMs < waitMs) waitMs = nextStartMs - nowMs;
+    int n = poll(attempts, attemptCount, (int)waitMs);
+    if(n < 0 && errno != EINTR) break;
+    for(int i = 0; i < attemptCount && n > 0; i++) {
+      if(attempts[i].fd < 0 || attempts[i].revents == 0) continue;
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if(getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+        clientfd = attempts[i].fd;
+        winner = attemptAddress[i];
+        attempts[i].fd = -1;
+        break;
+      }
+      close(attempts[i].fd); /* Refused or unreachable: the next address need not wait its turn */
+      attempts[i].fd = -1;
+      liveCount--;
+      nextStartMs = 0;
+    }
+    nowMs = nowMilliseconds();
+  }
+
+  for(int i = 0; i < attemptCount; i++) {
+    if(attempts[i].fd >= 0) close(attempts[i].fd); /* Losers of the race */
+  }
+  if(clientfd < 0) {
+    if(nowMs >= deadlineMs) countConnect(hostname, port, 0, 1);
+    return -1;
+  }
+  fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) & ~O_NONBLOCK); /* Callers use blocking I/O */
+  if(winner > 0) countConnect(hostname, port, 1, 0);
+  return clientfd;
+}
+void resolverGetStats(resolverStats *pStats) {
+  memset(pStats, 0, sizeof(resolverStats));
+  for(int i = 0; i < RESOLVER_SHARD_COUNT; i++) {
+    pthread_mutex_lock(&shards[i].lock);
+    pStats->hits += shards[i].stats.hits;
+    pStats->negativeHits += shards[i].stats.negativeHits;
+    pStats->misses += shards[i].stats.misses;
+    pStats->coalesced += shards[i].stats.coalesced;
+    pStats->failures += shards[i].stats.failures;
+    pStats->evictions += shards[i].stats.evictions;
+    pStats->connectFallbacks += shards[i].stats.connectFallbacks;
+    pStats->connectTimeouts += shards[i].stats.connectTimeouts;
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+}
+
+static int beginLookup(const char *hostname, const char *port, resolverResult *pResult, resolverShard **ppShard, resolverEntry **ppEntry) {
+  /* Answers from the cache, joins a resolution in flight, or starts one; on RESOLVER_PENDING "ppEntry" holds a reference for "releaseEntry" */
+  char key[RESOLVER_KEY_SIZE];
+  if(strlen(hostname) >= RESOLVER_HOST_SIZE || strlen(port) >= sizeof(((resolverEntry *)0)->port)) return RESOLVER_FAILED;
+  makeKey(key, hostname, port);
+  unsigned int hash = hashKey(key);
+  resolverShard *pShard = shardOf(hash);
+  time_t now = time(NULL);
+  int status = RESOLVER_PENDING, isStarting = 0;
+
+  pthread_mutex_lock(&pShard->lock);
+  resolverEntry *pEntry = findEntry(pShard, key, hash);
+  if(pEntry == NULL) {
+    pEntry = Calloc(1, sizeof(resolverEntry));
+    strcpy(pEntry->key, key);
+    strcpy(pEntry->hostname, hostname);
+    strcpy(pEntry->port, port);
+    pEntry->hash = hash;
+    resolverEntry **pBucket = &pShard->buckets[(hash / RESOLVER_SHARD_COUNT) % RESOLVER_BUCKET_COUNT];
+    pEntry->pBucketNext = *pBucket;
+    *pBucket = pEntry;
+    linkFront(pShard, pEntry);
+    pShard->entryCount++;
+    isStarting = 1;
+  }
+  else if(pEntry->state == ENTRY_RESOLVING) pShard->stats.coalesced++;
+  else if(now >= pEntry->expiresAt) isStarting = 1; /* Expired: resolve again in place */
+  else {
+    status = settledResult(pEntry, pResult);
+    if(status == RESOLVER_READY) pShard->stats.hits++;
+    else pShard->stats.negativeHits++;
+  }
+  if(pShard->pHead != pEntry) { /* Touch: names in use stay clear of eviction */
+    unlinkList(pShard, pEntry);
+    linkFront(pShard, pEntry);
+  }
+  if(isStarting) {
+    pEntry->state = ENTRY_RESOLVING;
+    pEntry->referenceCount++; /* The queue's, dropped once "resolveEntry" is done with it */
+    pShard->stats.misses++;
+    evictEntries(pShard);
+  }
+  if(status == RESOLVER_PENDING) pEntry->referenceCount++; /* The caller's, so an eviction cannot free it while it waits */
+  pthread_mutex_unlock(&pShard->lock);
+
+  if(isStarting) enqueueEntry(pEntry);
+  *ppShard = pShard;
+  *ppEntry = pEntry;
+  return status;
+}
+static void enqueueEntry(resolverEntry *pEntry) {
+  pthread_mutex_lock(&queueLock);
+  pEntry->pQueueNext = NULL;
+  if(pQueueTail != NULL) pQueueTail->pQueueNext = pEntry;
+  else pQueueHead = pEntry;
+  pQueueTail = pEntry;
+  pthread_cond_signal(&queueReady);
+  pthread_mutex_unlock(&queueLock);
+}
+static void *resolverThread(void *pArgument) {
+  int isReporter = ((long)pArgument == 0); /* One thread writes the counters to the event log */
+  Pthread_detach(Pthread_self());
+  while(1) {
+    struct timespec deadline = { time(NULL) + RESOLVER_REPORT_INTERVAL, 0 };
+    pthread_mutex_lock(&queueLock);
+    while(pQueueHead == NULL) {
+      if(pthread_cond_timedwait(&queueReady, &queueLock, &deadline) == ETIMEDOUT) break;
+    }
+    resolverEntry *pEntry = pQueueHead;
+    if(pEntry != NULL) {
+      pQueueHead = pEntry->pQueueNext;
+      if(pQueueHead == NULL) pQueueTail = NULL;
+    }
+    pthread_mutex_unlock(&queueLock);
+    if(pEntry != NULL) resolveEntry(pEntry);
+    else if(isReporter) reportStats();
+  }
+  return NULL;
+}
+static void resolveEntry(resolverEntry *pEntry) {
+  /* Only resolver threads write an entry while it is ENTRY_RESOLVING, so getaddrinfo runs without the shard lock */
+  struct addrinfo hints, *listp, *p;
+  resolverResult result;
+  resolverShard *pShard = shardOf(pEntry->hash);
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG; /* Same hints as "open_clientfd" */
+  result.count = 0;
+  int rc = getaddrinfo(pEntry->hostname, pEntry->port, &hints, &listp);
+  if(rc == 0) {
+    for(p = listp; p != NULL && result.count < RESOLVER_MAX_ADDRESSES; p = p->ai_next) {
+      if(p->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+      resolverAddress *pAddress = &result.addresses[result.count++];
+      pAddress->family = p->ai_family;
+      pAddress->socktype = p->ai_socktype;
+      pAddress->protocol = p->ai_protocol;
+      pAddress->length = p->ai_addrlen;
+      memcpy(&pAddress->address, p->ai_addr, p->ai_addrlen);
+    }
+    freeaddrinfo(listp);
+    interleaveFamilies(&result);
+  }
+
+  pthread_mutex_lock(&pShard->lock);
+  pEntry->result = result;
+  pEntry->state = (result.count > 0) ? ENTRY_RESOLVED : ENTRY_FAILED;
+  pEntry->expiresAt = time(NULL) + ((result.count > 0) ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+  if(result.count == 0) pShard->stats.failures++;
+  resolverWaiter *pWaiters = pEntry->pWaiters;
+  pEntry->pWaiters = NULL;
+  pthread_cond_broadcast(&pShard->settled);
+  pthread_mutex_unlock(&pShard->lock);
+
+  while(pWaiters != NULL) {
+    uint64_t one = 1;
+    resolverWaiter *pNext = pWaiters->pNext;
+    if(write(pWaiters->notifyfd, &one, sizeof(one)) < 0) { /* Full: a poke is already pending, which is all the loop needs */ }
+    Free(pWaiters);
+    pWaiters = pNext;
+  }
+  releaseEntry(pEntry);
+}
+static void interleaveFamilies(resolverResult *pResult) {
+  /* RFC 8305 section 4: keep getaddrinfo's order within each family, but alternate families, first family first */
+  resolverResult ordered;
+  int isTaken[RESOLVER_MAX_ADDRESSES] = { 0 };
+  int firstFamily = pResult->addresses[0].family, wantsFirst = 1;
+  ordered.count = 0;
+  while(ordered.count < pResult->count) {
+    int found = -1;
+    for(int i = 0; i < pResult->count && found < 0; i++) {
+      if(!isTaken[i] && ((pResult->addresses[i].family == firstFamily) == wantsFirst)) found = i;
+    }
+    for(int i = 0; i < pResult->count && found < 0; i++) { /* One family ran out: the rest in order */
+      if(!isTaken[i]) found = i;
+    }
+    isTaken[found] = 1;
+    ordered.addresses[ordered.count++] = pResult->addresses[found];
+    wantsFirst = !wantsFirst;
+  }
+  *pResult = ordered;
+}
+static int startConnect(const resolverAddress *pAddress, int *pIsConnected) {
+  /* A non-blocking connect left in flight; -1 when it failed on the spot */
+  int fd = socket(pAddress->family, pAddress->socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, pAddress->protocol);
+  if(fd < 0) return -1;
+  if(connect(fd, (const struct sockaddr *)&pAddress->address, pAddress->length) == 0) {
+    *pIsConnected = 1;
+    return fd;
+  }
+  if(errno == EINPROGRESS) {
+    *pIsConnected = 0;
+    return fd;
+  }
+  close(fd);
+  return -1;
+}
+static void countConnect(const char *hostname, const char *port, int isFallback, int isTimeout) {
+  char key[RESOLVER_KEY_SIZE];
+  makeKey(key, hostname, port);
+  resolverShard *pShard = shardOf(hashKey(key));
+  pthread_mutex_lock(&pShard->lock);
+  pShard->stats.connectFallbacks += isFallback;
+  pShard->stats.connectTimeouts += isTimeout;
+  pthread_mutex_unlock(&pShard->lock);
+}
+static long long nowMilliseconds(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000LL + time.tv_nsec / 1000000;
+}
+static void reportStats(void) {
+  static resolverStats lastStats; /* Only the reporter thread touches it */
+  resolverStats stats;
+  char message[MAXLINE];
+
+  resolverGetStats(&stats);
+  if(!memcmp(&stats, &lastStats, sizeof(stats))) return; /* Nothing new since the last line */
+  lastStats = stats;
+  snprintf(message, sizeof(message), "DNS cache: %lu hits, %lu negative hits, %lu misses, %lu coalesced, %lu failures, %lu evictions; connects: %lu fallbacks, %lu timeouts.",
+           stats.hits, stats.negativeHits, stats.misses, stats.coalesced, stats.failures, stats.evictions, stats.connectFallbacks, stats.connectTimeouts);
+  writeEvent(message);
+}
+static void makeKey(char *key, const char *hostname, const char *port) {
+  size_t offset = 0;
+  for(const char *p = hostname; *p; p++) key[offset++] = tolower((unsigned char)*p); /* Length checked by the caller */
+  snprintf(key + offset, RESOLVER_KEY_SIZE - offset, ":%s", port);
+}
+static unsigned int hashKey(const char *key) {
+  unsigned int hash = 2166136261u; /* FNV-1a */
+  for(const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+static resolverShard *shardOf(unsigned int hash) {
+  return &shards[hash % RESOLVER_SHARD_COUNT];
+}
+static resolverEntry *findEntry(resolverShard *pShard, const char *key, unsigned int hash) {
+  for(resolverEntry *p = pShard->buckets[(hash / RESOLVER_SHARD_COUNT) % RESOLVER_BUCKET_COUNT]; p != NULL; p = p->pBucketNext) {
+    if(p->hash == hash && !strcmp(p->key, key)) return p;
+  }
+  return NULL;
+}
+static int settledResult(resolverEntry *pEntry, resolverResult *pResult) {
+  /* Caller holds the shard lock */
+  if(pEntry->state != ENTRY_RESOLVED) return RESOLVER_FAILED;
+  *pResult = pEntry->result;
+  return RESOLVER_READY;
+}
+static void linkFront(resolverShard *pShard, resolverEntry *pEntry) {
+  pEntry->pPrevious = NULL;
+  pEntry->pNext = pShard->pHead;
+  if(pShard->pHead != NULL) pShard->pHead->pPrevious = pEntry;
+  pShard->pHead = pEntry;
+  if(pShard->pTail == NULL) pShard->pTail = pEntry;
+}
+static void unlinkList(resolverShard *pShard, resolverEntry *pEntry) {
+  if(pEntry->pPrevious != NULL) pEntry->pPrevious->pNext = pEntry->pNext;
+  else pShard->pHead = pEntry->pNext;
+  if(pEntry->pNext != NULL) pEntry->pNext->pPrevious = pEntry->pPrevious;
+  else pShard->pTail = pEntry->pPrevious;
+  pEntry->pPrevious = pEntry->pNext = NULL;
+}
+static void evictEntries(resolverShard *pShard) {
+  /* Caller holds the shard lock. Entries still resolving are skipped: each has a caller waiting on it, so they are bounded by the requests in flight */
+  resolverEntry *pEntry = pShard->pTail;
+  while(pShard->entryCount > RESOLVER_SHARD_CAPACITY && pEntry != NULL) {
+    resolverEntry *pPrevious = pEntry->pPrevious;
+    if(pEntry->state != ENTRY_RESOLVING) {
+      resolverEntry **ppLink = &pShard->buckets[(pEntry->hash / RESOLVER_SHARD_COUNT) % RESOLVER_BUCKET_COUNT];
+      while(*ppLink != pEntry) ppLink = &(*ppLink)->pBucketNext;
+      *ppLink = pEntry->pBucketNext;
+      unlinkList(pShard, pEntry);
+      pShard->entryCount--;
+      pShard->stats.evictions++;
+      pEntry->isEvicted = 1;
+      if(pEntry->referenceCount == 0) Free(pEntry); /* Otherwise a caller still reading its answer frees it */
+    }
+    pEntry = pPrevious;
+  }
+}
+static void releaseEntry(resolverEntry *pEntry) {
+  resolverShard *pShard = shardOf(pEntry->hash);
+  pthread_mutex_lock(&pShard->lock);
+  int isLast = (--pEntry->referenceCount == 0 && pEntry->isEvicted);
+  pthread_mutex_unlock(&pShard->lock);
+  if(isLast) Free(pEntry);
+}
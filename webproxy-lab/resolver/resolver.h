@@ -0,0 +1,50 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+
+#define RESOLVER_SHARD_COUNT 8
+#define RESOLVER_BUCKET_COUNT 64 /* Hash buckets per shard */
+#define RESOLVER_SHARD_CAPACITY 128 /* Entries kept per shard; the least recently used settled one goes first */
+#define RESOLVER_WORKER_COUNT 4 /* Threads that run getaddrinfo so request threads never do */
+#define RESOLVER_MAX_ADDRESSES 8 /* Addresses kept per (host, port) */
+#define RESOLVER_HOST_SIZE 256 /* DNS names are at most 253 characters */
+#define RESOLVER_TTL 60 /* Seconds an answer is reused: getaddrinfo does not report the record TTL */
+#define RESOLVER_NEGATIVE_TTL 5 /* Seconds a failed lookup is remembered */
+#define RESOLVER_REPORT_INTERVAL 60 /* Seconds between counter lines in the event log */
+#define RESOLVER_ATTEMPT_DELAY_MS 250 /* RFC 8305: the next address starts when the last one has not connected by then */
+#define RESOLVER_CONNECT_TIMEOUT_MS 10000 /* Default deadline for connecting to any of a name's addresses */
+
+#define RESOLVER_FAILED -1
+#define RESOLVER_READY 0
+#define RESOLVER_PENDING 1 /* A resolver thread is on it: the notify descriptor fires when it settles */
+
+typedef struct {
+  int family, socktype, protocol;
+  socklen_t length;
+  struct sockaddr_storage address;
+} resolverAddress;
+
+typedef struct {
+  int count;
+  resolverAddress addresses[RESOLVER_MAX_ADDRESSES];
+} resolverResult;
+
+typedef struct {
+  unsigned long hits; /* Answered from a fresh entry */
+  unsigned long negativeHits; /* Refused from a remembered failure */
+  unsigned long misses; /* Sent to a resolver thread */
+  unsigned long coalesced; /* Waited on a resolution another caller started */
+  unsigned long failures; /* getaddrinfo errors */
+  unsigned long evictions; /* Entries dropped to stay within RESOLVER_SHARD_CAPACITY */
+  unsigned long connectFallbacks; /* Connects won by an address other than the first */
+  unsigned long connectTimeouts; /* Connects that reached the deadline with no address answering */
+} resolverStats;
+
+void resolverInit(int workerCount, int connectTimeoutMs);
+int resolverLookup(const char *hostname, const char *port, resolverResult *pResult);
+int resolverLookupAsync(const char *hostname, const char *port, resolverResult *pResult, int notifyfd);
+int resolverOpenClientfd(const char *hostname, const char *port);
+void resolverGetStats(resolverStats *pStats);
+
+#endif
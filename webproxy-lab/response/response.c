@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "../request/request.h"
+#include "response.h"
+
+/* Chunked body scanner states */
+#define CHUNK_SIZE 0 /* Hex digits of a chunk-size line */
+#define CHUNK_EXTENSION 1 /* Rest of the chunk-size line */
+#define CHUNK_DATA 2 /* Chunk payload */
+#define CHUNK_DATA_END 3 /* CRLF after the payload */
+#define CHUNK_TRAILER_START 4 /* Start of a trailer line, or the final CRLF */
+#define CHUNK_TRAILER 5 /* Rest of a trailer line */
+#define CHUNK_FINAL_LF 6 /* LF of the final CRLF */
+
+static int isName(const char *name, size_t length, const char *literal);
+static void scanCacheControl(responseCachePolicy *pPolicy, const char *value, size_t length);
+static long long parseHttpDate(const char *value, size_t length);
+static size_t fieldNameLength(const char *line, const char *lineEnd);
+static int isMergeableField(const char *line, const char *lineEnd);
+static int hasField(const char *headers, size_t size, const char *name, size_t nameLength);
+
+int responseHeadParseStatus(responseHead *pHead, const char *statusLine) {
+  int major, minor;
+  pHead->isChunked = 0;
+  pHead->contentLength = -1;
+  if(sscanf(statusLine, "HTTP/%d.%d %d", &major, &minor, &pHead->statusCode) != 3) return -1;
+  pHead->isKeepAlive = (major > 1 || (major == 1 && minor >= 1)); /* HTTP/1.1 default */
+  return 0;
+}
+int responseHeadAdd(responseHead *pHead, const char *line) {
+  /* Records what framing needs; returns 0 for hop-by-hop headers the proxy must not forward */
+  if(!strncasecmp(line, "Connection:", 11)) {
+    if(headerHasToken(line + 11, strlen(line + 11), "close")) pHead->isKeepAlive = 0;
+    else if(headerHasToken(line + 11, strlen(line + 11), "keep-alive")) pHead->isKeepAlive = 1;
+    return 0;
+  }
+  if(!strncasecmp(line, "Keep-Alive:", 11) || !strncasecmp(line, "Proxy-Connection:", 17)) return 0;
+  if(!strncasecmp(line, "Content-Length:", 15)) pHead->contentLength = strtoll(line + 15, NULL, 10);
+  else if(!strncasecmp(line, "Transfer-Encoding:", 18) && headerHasToken(line + 18, strlen(line + 18), "chunked")) pHead->isChunked = 1;
+  return 1;
+}
+void bodyFramerInit(bodyFramer *pFramer, const responseHead *pHead) {
+  pFramer->remaining = 0;
+  pFramer->chunkSize = 0;
+  pFramer->chunkState = CHUNK_SIZE;
+  pFramer->isComplete = 0;
+  if(pHead->statusCode == 204 || pHead->statusCode == 304) pFramer->mode = BODY_NONE;
+  else if(pHead->statusCode >= 100 && pHead->statusCode < 200) pFramer->mode = BODY_UNTIL_CLOSE; /* Interim response: play safe */
+  else if(pHead->isChunked) pFramer->mode = BODY_CHUNKED;
+  else if(pHead->contentLength >= 0) pFramer->mode = BODY_LENGTH;
+  else pFramer->mode = BODY_UNTIL_CLOSE;
+
+  if(pFramer->mode == BODY_LENGTH) pFramer->remaining = pHead->contentLength;
+  pFramer->isComplete = (pFramer->mode == BODY_NONE) || (pFramer->mode == BODY_LENGTH && pFramer->remaining == 0);
+}
+size_t bodyFramerScan(bodyFramer *pFramer, const char *data, size_t size) {
+  /* Returns how many of "data" belong to the body; anything after that is not part of this response */
+  size_t i = 0;
+  if(pFramer->isComplete) return 0;
+  if(pFramer->mode == BODY_UNTIL_CLOSE) return size;
+  if(pFramer->mode == BODY_LENGTH) {
+    size_t taken = ((long long)size < pFramer->remaining) ? size : (size_t)pFramer->remaining;
+    pFramer->remaining -= taken;
+    pFramer->isComplete = (pFramer->remaining == 0);
+    return taken;
+  }
+
+  while(i < size && !pFramer->isComplete) {
+    char c = data[i];
+    switch(pFramer->chunkState) {
+      case CHUNK_SIZE:
+        if(isxdigit((unsigned char)c)) {
+          pFramer->chunkSize = pFramer->chunkSize * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+          i++;
+          break;
+        }
+        pFramer->chunkState = CHUNK_EXTENSION; /* ';', whitespace or CR: skip to the LF */
+        break;
+      case CHUNK_EXTENSION:
+        i++;
+        if(c != '\n') break;
+        if(pFramer->chunkSize == 0) pFramer->chunkState = CHUNK_TRAILER_START; /* Last chunk */
+        else {
+          pFramer->remaining = pFramer->chunkSize;
+          pFramer->chunkState = CHUNK_DATA;
+        }
+        break;
+      case CHUNK_DATA: {
+        size_t taken = ((long long)(size - i) < pFramer->remaining) ? size - i : (size_t)pFramer->remaining;
+        i += taken;
+        pFramer->remaining -= taken;
+        if(pFramer->remaining == 0) pFramer->chunkState = CHUNK_DATA_END;
+        break;
+      }
+      case CHUNK_DATA_END:
+        i++;
+        if(c == '\n') {
+          pFramer->chunkSize = 0;
+          pFramer->chunkState = CHUNK_SIZE;
+        }
+        break;
+      case CHUNK_TRAILER_START:
+        i++;
+        if(c == '\r') pFramer->chunkState = CHUNK_FINAL_LF;
+        else if(c == '\n') pFramer->isComplete = 1;
+        else pFramer->chunkState = CHUNK_TRAILER;
+        break;
+      case CHUNK_TRAILER:
+        i++;
+        if(c == '\n') pFramer->chunkState = CHUNK_TRAILER_START;
+        break;
+      case CHUNK_FINAL_LF:
+        i++;
+        if(c == '\n') pFramer->isComplete = 1;
+        break;
+    }
+  }
+  return i;
+}
+void responseCachePolicyInit(responseCachePolicy *pPolicy) {
+  pPolicy->isStorable = 1;
+  pPolicy->isNoCache = pPolicy->isMustRevalidate = 0;
+  pPolicy->maxAge = pPolicy->sharedMaxAge = -1;
+  pPolicy->staleWhileRevalidate = pPolicy->staleIfError = 0;
+  pPolicy->expires = pPolicy->date = pPolicy->lastModified = -1;
+  pPolicy->etag = pPolicy->lastModifiedValue = NULL;
+  pPolicy->etagLength = pPolicy->lastModifiedLength = 0;
+}
+void responseCachePolicyScan(responseCachePolicy *pPolicy, const char *headers, size_t size) {
+  /* Line by line over a header block; the status line and headers the cache does not read are skipped */
+  const char *line = headers, *end = headers + size;
+  while(line < end) {
+    const char *lineEnd = memchr(line, '\n', end - line);
+    if(lineEnd == NULL) lineEnd = end;
+    const char *colon = memchr(line, ':', lineEnd - line);
+    if(colon != NULL) {
+      size_t nameLength = colon - line;
+      const char *value = colon + 1, *valueEnd = lineEnd;
+      while(value < valueEnd && (*value == ' ' || *value == '\t')) value++;
+      while(valueEnd > value && isspace((unsigned char)valueEnd[-1])) valueEnd--;
+      size_t length = valueEnd - value;
+      if(isName(line, nameLength, "Cache-Control")) scanCacheControl(pPolicy, value, length);
+      else if(isName(line, nameLength, "Expires")) {
+        pPolicy->expires = parseHttpDate(value, length);
+        if(pPolicy->expires < 0) pPolicy->expires = 0; /* RFC 9111 5.3: an invalid date is in the past */
+      }
+      else if(isName(line, nameLength, "Date")) pPolicy->date = parseHttpDate(value, length);
+      else if(isName(line, nameLength, "Last-Modified")) {
+        pPolicy->lastModified = parseHttpDate(value, length);
+        pPolicy->lastModifiedValue = value;
+        pPolicy->lastModifiedLength = length;
+      }
+      else if(isName(line, nameLength, "ETag")) {
+        pPolicy->etag = value;
+        pPolicy->etagLength = length;
+      }
+    }
+    line = lineEnd + 1;
+  }
+}
+size_t responseHeadMerge(char *merged, const char *stored, size_t storedSize, const char *update, size_t updateSize) {
+  /* RFC 9111 3.2: the stored status line and header lines, less the fields "update" carries, then the update's own fields. Its status line,
+     hop-by-hop fields and Content-Length stay out: the stored body keeps its framing. "merged" holds "storedSize" + "updateSize" bytes */
+  size_t size = 0;
+  const char *line = stored, *end = stored + storedSize;
+  while(line < end) {
+    const char *lineEnd = memchr(line, '\n', end - line);
+    lineEnd = (lineEnd != NULL) ? lineEnd + 1 : end;
+    size_t nameLength = fieldNameLength(line, lineEnd);
+    if(line == stored || nameLength == 0 || !hasField(update, updateSize, line, nameLength)) {
+      memcpy(merged + size, line, lineEnd - line);
+      size += lineEnd - line;
+    }
+    line = lineEnd;
+  }
+  for(line = update, end = update + updateSize; line < end; ) {
+    const char *lineEnd = memchr(line, '\n', end - line);
+    if(lineEnd == NULL) break; /* Cut short: a partial line would run into the next one */
+    lineEnd++;
+    if(isMergeableField(line, lineEnd)) {
+      memcpy(merged + size, line, lineEnd - line);
+      size += lineEnd - line;
+    }
+    line = lineEnd;
+  }
+  return size;
+}
+
+static int isName(const char *name, size_t length, const char *literal) {
+  /* Case-insensitive, for names that are not NUL-terminated */
+  return strlen(literal) == length && !strncasecmp(name, literal, length);
+}
+static void scanCacheControl(responseCachePolicy *pPolicy, const char *value, size_t length) {
+  /* Comma separated "name" or "name=value" directives; ones a shared cache does not act on are ignored */
+  const char *p = value, *end = value + length;
+  while(p < end) {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *name = p;
+    while(p < end && *p != '=' && *p != ',' && *p != ' ' && *p != '\t') p++;
+    size_t nameLength = p - name;
+    long long seconds = -1;
+    if(p < end && *p == '=') {
+      if(++p < end && *p == '"') p++;
+      if(p < end && isdigit((unsigned char)*p)) seconds = 0;
+      while(p < end && isdigit((unsigned char)*p)) {
+        if(seconds < 100000000000LL) seconds = seconds * 10 + (*p - '0'); /* Past three thousand years: as good as forever */
+        p++;
+      }
+      while(p < end && *p != ',') p++; /* Closing quote, or an argument this cache does not use */
+    }
+    if(isName(name, nameLength, "no-store") || isName(name, nameLength, "private")) pPolicy->isStorable = 0;
+    else if(isName(name, nameLength, "no-cache")) pPolicy->isNoCache = 1;
+    else if(isName(name, nameLength, "must-revalidate") || isName(name, nameLength, "proxy-revalidate")) pPolicy->isMustRevalidate = 1;
+    else if(seconds < 0) continue;
+    else if(isName(name, nameLength, "max-age")) pPolicy->maxAge = seconds;
+    else if(isName(name, nameLength, "s-maxage")) pPolicy->sharedMaxAge = seconds;
+    else if(isName(name, nameLength, "stale-while-revalidate")) pPolicy->staleWhileRevalidate = seconds;
+    else if(isName(name, nameLength, "stale-if-error")) pPolicy->staleIfError = seconds;
+  }
+}
+static long long parseHttpDate(const char *value, size_t length) {
+  /* IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only form RFC 9110 lets senders generate; -1 for anything else */
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char date[64], month[4];
+  struct tm fields;
+  if(length >= sizeof(date)) return -1;
+  memcpy(date, value, length);
+  date[length] = '\0';
+  memset(&fields, 0, sizeof(fields));
+  if(sscanf(date, "%*3s, %d %3s %d %d:%d:%d GMT", &fields.tm_mday, month, &fields.tm_year, &fields.tm_hour, &fields.tm_min, &fields.tm_sec) != 6) return -1;
+  const char *pMonth = strstr(months, month);
+  if(strlen(month) != 3 || pMonth == NULL || (pMonth - months) % 3 != 0) return -1;
+  fields.tm_mon = (pMonth - months) / 3;
+  fields.tm_year -= 1900;
+  return timegm(&fields);
+}
+static size_t fieldNameLength(const char *line, const char *lineEnd) {
+  /* Length of the name before the colon; 0 for a status line or anything else that is not a header field */
+  const char *colon = memchr(line, ':', lineEnd - line);
+  if(colon == NULL || colon == line) return 0;
+  for(const char *p = line; p < colon; p++) {
+    if(*p == ' ' || *p == '\t') return 0;
+  }
+  return colon - line;
+}
+static int isMergeableField(const char *line, const char *lineEnd) {
+  /* A header field a 304 may update in the stored head */
+  static const char *excluded[] = { "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+                                    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length" };
+  size_t nameLength = fieldNameLength(line, lineEnd);
+  if(nameLength == 0) return 0;
+  for(size_t i = 0; i < sizeof(excluded) / sizeof(excluded[0]); i++) {
+    if(isName(line, nameLength, excluded[i])) return 0;
+  }
+  return 1;
+}
+static int hasField(const char *headers, size_t size, const char *name, size_t nameLength) {
+  /* Whether "headers" carries a mergeable field called "name" */
+  const char *line = headers, *end = headers + size;
+  while(line < end) {
+    const char *lineEnd = memchr(line, '\n', end - line);
+    if(lineEnd == NULL) return 0;
+    lineEnd++;
+    if(fieldNameLength(line, lineEnd) == nameLength && !strncasecmp(line, name, nameLength) && isMergeableField(line, lineEnd)) return 1;
+    line = lineEnd;
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+
+/* How the end of a response body is found */
+#define BODY_NONE 0 /* Bodiless statuses (204, 304) */
+#define BODY_LENGTH 1 /* Content-Length */
+#define BODY_CHUNKED 2 /* Transfer-Encoding: chunked */
+#define BODY_UNTIL_CLOSE 3 /* Neither: the origin closes the connection */
+
+/* What the proxy needs from an origin status line and header block */
+typedef struct {
+  int statusCode;
+  int isKeepAlive; /* Origin lets the connection be reused */
+  int isChunked;
+  long long contentLength; /* -1 when absent */
+} responseHead;
+
+/* Tracks a body as it streams so the bytes that belong to it can be told apart from whatever follows */
+typedef struct {
+  int mode;
+  long long remaining; /* BODY_LENGTH: body bytes left, BODY_CHUNKED: data bytes left in the current chunk */
+  long long chunkSize; /* Chunk-size line being parsed */
+  int chunkState;
+  int isComplete;
+} bodyFramer;
+
+/* What a response's caching headers say */
+typedef struct {
+  int isStorable; /* Neither "no-store" nor "private": a shared cache may keep it */
+  int isNoCache; /* "no-cache": revalidated before every use */
+  int isMustRevalidate; /* "must-revalidate" or "proxy-revalidate": never served stale */
+  long long maxAge, sharedMaxAge; /* "max-age" and "s-maxage" seconds, -1 when absent */
+  long long staleWhileRevalidate, staleIfError; /* RFC 5861 windows in seconds, 0 when absent */
+  long long expires, date, lastModified; /* Seconds since the epoch, -1 when absent; an unparsable Expires is 0, already expired */
+  const char *etag, *lastModifiedValue; /* Validators as they appear in the scanned block, NULL when absent */
+  size_t etagLength, lastModifiedLength;
+} responseCachePolicy;
+
+int responseHeadParseStatus(responseHead *pHead, const char *statusLine);
+int responseHeadAdd(responseHead *pHead, const char *line);
+void bodyFramerInit(bodyFramer *pFramer, const responseHead *pHead);
+size_t bodyFramerScan(bodyFramer *pFramer, const char *data, size_t size);
+void responseCachePolicyInit(responseCachePolicy *pPolicy);
+void responseCachePolicyScan(responseCachePolicy *pPolicy, const char *headers, size_t size);
+size_t responseHeadMerge(char *merged, const char *stored, size_t storedSize, const char *update, size_t updateSize);
+
+#endif
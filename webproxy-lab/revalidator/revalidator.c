@@ -0,0 +1,181 @@
+#include <pthread.h>
+#include "../csapp.h"
+#include "../proxy-help.h"
+#include "../response/response.h"
+#include "../resolver/resolver.h"
+#include "../metrics/metrics.h"
+#include "revalidator.h"
+
+#define REQUEST_PART_COUNT 16
+
+/* One stale object to refresh: the reference keeps its key and validators in place */
+typedef struct revalidatorJob {
+  cacheObject *pObject;
+  char *hostname, *port, *path;
+  struct revalidatorJob *pNext;
+} revalidatorJob;
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueReady = PTHREAD_COND_INITIALIZER;
+static revalidatorJob *pQueueHead, *pQueueTail;
+static int queueLength;
+
+static void *revalidatorThread(void *pArgument);
+static void revalidate(const revalidatorJob *pJob);
+static int sendRequest(int clientfd, const revalidatorJob *pJob);
+static metricCounter readResponse(rio_t *pBuffer, cacheObject *pObject);
+static void addPart(struct iovec *parts, int *pCount, const char *base, size_t length);
+static char *copyString(const char *source);
+static void freeJob(revalidatorJob *pJob);
+
+void revalidatorInit(int workerCount) {
+  pthread_t threadId;
+  for(int i = 0; i < workerCount; i++) Pthread_create(&threadId, NULL, revalidatorThread, NULL);
+}
+void revalidatorSchedule(cacheObject *pObject, const char *hostname, const char *port, const char *path) {
+  /* The caller won "cacheClaimRevalidation"; a full queue hands the claim back, and a later stale hit tries again */
+  revalidatorJob *pJob = Malloc(sizeof(revalidatorJob));
+  cacheRetain(pObject);
+  pJob->pObject = pObject;
+  pJob->hostname = copyString(hostname);
+  pJob->port = copyString(port);
+  pJob->path = copyString(path);
+  pJob->pNext = NULL;
+
+  pthread_mutex_lock(&queueLock);
+  if(queueLength >= REVALIDATOR_QUEUE_DEPTH) {
+    pthread_mutex_unlock(&queueLock);
+    cacheEndRevalidation(pObject);
+    freeJob(pJob);
+    return;
+  }
+  if(pQueueTail != NULL) pQueueTail->pNext = pJob;
+  else pQueueHead = pJob;
+  pQueueTail = pJob;
+  queueLength++;
+  pthread_cond_signal(&queueReady);
+  pthread_mutex_unlock(&queueLock);
+}
+
+static void *revalidatorThread(void *pArgument) {
+  Pthread_detach(Pthread_self());
+  while(1) {
+    pthread_mutex_lock(&queueLock);
+    while(pQueueHead == NULL) pthread_cond_wait(&queueReady, &queueLock);
+    revalidatorJob *pJob = pQueueHead;
+    pQueueHead = pJob->pNext;
+    if(pQueueHead == NULL) pQueueTail = NULL;
+    queueLength--;
+    pthread_mutex_unlock(&queueLock);
+    revalidate(pJob);
+    freeJob(pJob);
+  }
+  return NULL;
+}
+static void revalidate(const revalidatorJob *pJob) {
+  /* Conditional GET on a connection of its own: a 304 refreshes the object's head, a cacheable 200 replaces it, anything else leaves it stale */
+  rio_t serverBuffer;
+  metricCounter outcome = METRIC_REVALIDATIONS_FAILED;
+  int clientfd = resolverOpenClientfd(pJob->hostname, pJob->port);
+  if(clientfd >= 0) {
+    Rio_readinitb(&serverBuffer, clientfd);
+    if(sendRequest(clientfd, pJob) == 0) outcome = readResponse(&serverBuffer, pJob->pObject);
+    close(clientfd);
+  }
+  else metricsCount(METRIC_ORIGIN_CONNECT_ERRORS, 1);
+  if(outcome != METRIC_REVALIDATIONS_NOT_MODIFIED) cacheEndRevalidation(pJob->pObject); /* "cacheRefresh" already did */
+  metricsCount(outcome, 1);
+}
+static int sendRequest(int clientfd, const revalidatorJob *pJob) {
+  /* HTTP/1.0 with the object's validators: the origin closes after answering, so a replacement body needs no framing of its own */
+  struct iovec parts[REQUEST_PART_COUNT];
+  int partCount = 0, isDefaultPort = !strcmp(pJob->port, "80");
+  cacheObject *pObject = pJob->pObject;
+  addPart(parts, &partCount, "GET ", 4);
+  addPart(parts, &partCount, pJob->path, strlen(pJob->path));
+  addPart(parts, &partCount, " HTTP/1.0\r\nHost: ", 17);
+  addPart(parts, &partCount, pJob->hostname, strlen(pJob->hostname));
+  if(!isDefaultPort) {
+    addPart(parts, &partCount, ":", 1);
+    addPart(parts, &partCount, pJob->port, strlen(pJob->port));
+  }
+  addPart(parts, &partCount, "\r\n", 2);
+  addPart(parts, &partCount, user_agent_hdr, strlen(user_agent_hdr));
+  if(pObject->etag != NULL) {
+    addPart(parts, &partCount, "If-None-Match: ", 15);
+    addPart(parts, &partCount, pObject->etag, pObject->etagLength);
+    addPart(parts, &partCount, "\r\n", 2);
+  }
+  if(pObject->lastModified != NULL) {
+    addPart(parts, &partCount, "If-Modified-Since: ", 19);
+    addPart(parts, &partCount, pObject->lastModified, pObject->lastModifiedLength);
+    addPart(parts, &partCount, "\r\n", 2);
+  }
+  addPart(parts, &partCount, "Connection: close\r\n\r\n", 21);
+  return (rio_writev(clientfd, parts, partCount) < 0) ? -1 : 0;
+}
+static metricCounter readResponse(rio_t *pBuffer, cacheObject *pObject) {
+  char line[MAXLINE], headerBlock[MAXBUF], body[MAXBUF];
+  size_t headerSize = 0;
+  responseHead head;
+  bodyFramer framer;
+  cacheCapture capture;
+  ssize_t n;
+
+  /* Status Line: Only A 304 Or A 200 Changes Anything */
+  if((n = rio_readlineb(pBuffer, line, MAXLINE)) <= 0 || responseHeadParseStatus(&head, line) < 0) return METRIC_REVALIDATIONS_FAILED;
+  metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, n);
+  if(head.statusCode != 304 && head.statusCode != 200) return METRIC_REVALIDATIONS_FAILED;
+  cacheCaptureInit(&capture);
+  cacheCaptureAppend(&capture, line, n);
+  while((n = rio_readlineb(pBuffer, line, MAXLINE)) > 0 && strcmp(line, "\r\n")) {
+    metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, n);
+    if(head.statusCode == 304 && headerSize + n <= sizeof(headerBlock)) { /* An oversized block loses its tail: the stored head keeps those fields */
+      memcpy(headerBlock + headerSize, line, n);
+      headerSize += n;
+    }
+    if(responseHeadAdd(&head, line)) cacheCaptureAppend(&capture, line, n); /* Hop-by-hop headers stay out, as on a miss */
+  }
+  if(n <= 0) {
+    cacheCaptureDiscard(&capture);
+    return METRIC_REVALIDATIONS_FAILED;
+  }
+  if(head.statusCode == 304) {
+    cacheCaptureDiscard(&capture);
+    cacheObject *pRefreshed = cacheRefresh(pObject, headerBlock, headerSize);
+    if(pRefreshed != NULL) cacheRelease(pRefreshed);
+    return METRIC_REVALIDATIONS_NOT_MODIFIED;
+  }
+
+  /* A New Version: Read It Whole, Then It Replaces The Stale One */
+  cacheCaptureAppend(&capture, "\r\n", 2);
+  bodyFramerInit(&framer, &head);
+  while(!framer.isComplete && capture.isCapturing) { /* Too large or no-store: nothing to replace it with */
+    if((n = rio_readsomeb(pBuffer, body, sizeof(body))) <= 0) {
+      if(n == 0 && framer.mode == BODY_UNTIL_CLOSE) framer.isComplete = 1;
+      break;
+    }
+    metricsCount(METRIC_ORIGIN_BYTES_RECEIVED, n);
+    cacheCaptureAppend(&capture, body, bodyFramerScan(&framer, body, n));
+  }
+  if(framer.isComplete && capture.isCapturing) cacheCaptureCommit(&capture, pObject->key, framer.mode); /* Evicts "pObject"; the job's reference keeps it readable */
+  else cacheCaptureDiscard(&capture);
+  return METRIC_REVALIDATIONS_MODIFIED;
+}
+static void addPart(struct iovec *parts, int *pCount, const char *base, size_t length) {
+  parts[*pCount].iov_base = (void *)base;
+  parts[*pCount].iov_len = length;
+  (*pCount)++;
+}
+static char *copyString(const char *source) {
+  char *copy = Malloc(strlen(source) + 1);
+  strcpy(copy, source);
+  return copy;
+}
+static void freeJob(revalidatorJob *pJob) {
+  cacheRelease(pJob->pObject);
+  Free(pJob->hostname);
+  Free(pJob->port);
+  Free(pJob->path);
+  Free(pJob);
+}
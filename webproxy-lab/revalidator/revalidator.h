@@ -0,0 +1,12 @@
+#ifndef REVALIDATOR_H
+#define REVALIDATOR_H
+
+#include "../cache/cache.h"
+
+#define REVALIDATOR_WORKER_COUNT 2 /* Threads that refresh stale-while-revalidate objects off the request path */
+#define REVALIDATOR_QUEUE_DEPTH 256 /* Refreshes waiting; past it a stale hit is served without queuing another */
+
+void revalidatorInit(int workerCount);
+void revalidatorSchedule(cacheObject *pObject, const char *hostname, const char *port, const char *path);
+
+#endif
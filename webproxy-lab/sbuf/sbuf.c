@@ -0,0 +1,36 @@
+#include "../csapp.h"
+#include "sbuf.h"
+
+void sbufInit(sbuf *sp, int capacity) {
+  sp->buffer = Calloc(capacity, sizeof(int));
+  sp->stamps = Calloc(capacity, sizeof(long long));
+  sp->capacity = capacity;
+  sp->front = sp->rear = 0; /* Empty iff front == rear */
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, capacity);
+  Sem_init(&sp->items, 0, 0);
+}
+void sbufDeinit(sbuf *sp) {
+  Free(sp->buffer);
+  Free(sp->stamps);
+}
+void sbufInsert(sbuf *sp, int item, long long stamp) {
+  P(&sp->slots); /* Blocks while the queue is full: back-pressure on the accept loop */
+  P(&sp->mutex);
+  sp->rear++;
+  sp->buffer[sp->rear % sp->capacity] = item;
+  sp->stamps[sp->rear % sp->capacity] = stamp;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+int sbufRemove(sbuf *sp, long long *pStamp) {
+  int item;
+  P(&sp->items);
+  P(&sp->mutex);
+  sp->front++;
+  item = sp->buffer[sp->front % sp->capacity];
+  *pStamp = sp->stamps[sp->front % sp->capacity];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
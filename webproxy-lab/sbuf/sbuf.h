@@ -0,0 +1,23 @@
+#ifndef SBUF_H
+#define SBUF_H
+
+#include <semaphore.h>
+
+/* Bounded FIFO of connected descriptors shared by the acceptor and the worker threads */
+typedef struct {
+  int *buffer;
+  long long *stamps; /* Caller's timestamp for each item, handed back with it */
+  int capacity;
+  int front; /* buffer[(front + 1) % capacity] is the first item */
+  int rear; /* buffer[rear % capacity] is the last item */
+  sem_t mutex; /* Protects accesses to buffer */
+  sem_t slots; /* Counts available slots */
+  sem_t items; /* Counts available items */
+} sbuf;
+
+void sbufInit(sbuf *sp, int capacity);
+void sbufDeinit(sbuf *sp);
+void sbufInsert(sbuf *sp, int item, long long stamp);
+int sbufRemove(sbuf *sp, long long *pStamp);
+
+#endif
@@ -0,0 +1,37 @@
+#include "../csapp.h"
+#include "slab.h"
+
+static void addSlab(slabCache *pCache);
+
+void slabInit(slabCache *pCache, size_t objectSize, int objectsPerSlab) {
+  pCache->objectSize = (objectSize + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT * SLAB_ALIGNMENT;
+  pCache->objectsPerSlab = objectsPerSlab;
+  pCache->pFree = NULL;
+  pCache->slabCount = pCache->inUseCount = 0;
+}
+void *slabAlloc(slabCache *pCache) {
+  /* Contents are whatever the last owner left: the caller initializes what it uses */
+  if(pCache->pFree == NULL) addSlab(pCache);
+  void *pObject = pCache->pFree;
+  pCache->pFree = *(void **)pObject;
+  pCache->inUseCount++;
+  return pObject;
+}
+void slabFree(slabCache *pCache, void *pObject) {
+  /* Kept for the next allocation on this thread; slabs are never handed back, so memory stays at the peak */
+  *(void **)pObject = pCache->pFree;
+  pCache->pFree = pObject;
+  pCache->inUseCount--;
+}
+
+static void addSlab(slabCache *pCache) {
+  char *pSlab;
+  int rc;
+  if((rc = posix_memalign((void **)&pSlab, SLAB_ALIGNMENT, pCache->objectSize * pCache->objectsPerSlab)) != 0) posix_error(rc, "posix_memalign error");
+  for(int i = pCache->objectsPerSlab - 1; i >= 0; i--) { /* Chained so the lowest address comes out first */
+    void *pObject = pSlab + i * pCache->objectSize;
+    *(void **)pObject = pCache->pFree;
+    pCache->pFree = pObject;
+  }
+  pCache->slabCount++;
+}
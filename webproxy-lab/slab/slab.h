@@ -0,0 +1,21 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_ALIGNMENT 64 /* Objects start on their own cache line */
+
+/* Fixed-size objects carved from larger blocks, owned by one thread: no locking */
+typedef struct {
+  size_t objectSize; /* Rounded up to SLAB_ALIGNMENT */
+  int objectsPerSlab;
+  void *pFree; /* Freed objects, most recently freed first so the next allocation is still warm in cache */
+  size_t slabCount;
+  size_t inUseCount;
+} slabCache;
+
+void slabInit(slabCache *pCache, size_t objectSize, int objectsPerSlab);
+void *slabAlloc(slabCache *pCache);
+void slabFree(slabCache *pCache, void *pObject);
+
+#endif
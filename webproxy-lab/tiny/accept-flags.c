@@ -0,0 +1,9 @@
+/* Kept apart from csapp.h: _GNU_SOURCE makes netdb.h declare a conflicting "gai_error" */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include "accept-flags.h"
+
+int acceptWithFlags(int listenfd, struct sockaddr *pAddress, socklen_t *pSize, int flags) {
+  /* "flags" takes SOCK_NONBLOCK and SOCK_CLOEXEC, set before any other thread can fork */
+  return accept4(listenfd, pAddress, pSize, flags);
+}
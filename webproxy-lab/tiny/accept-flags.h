@@ -0,0 +1,8 @@
+#ifndef ACCEPT_FLAGS_H
+#define ACCEPT_FLAGS_H
+
+#include <sys/socket.h>
+
+int acceptWithFlags(int listenfd, struct sockaddr *pAddress, socklen_t *pSize, int flags);
+
+#endif
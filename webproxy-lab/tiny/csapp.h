@@ -24,6 +24,7 @@
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -51,6 +52,19 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Growable ring for the ring reader: filled with readv, read through views */
+/* $begin rio_ring_t */
+#define RIO_RING_MAXSIZE (64 * 1024) /* Largest a ring grows to for one line or head */
+typedef struct {
+    int rio_fd;                 /* Descriptor for this ring */
+    size_t rio_cnt;             /* Unread bytes in the ring */
+    size_t rio_start;           /* Offset of the first unread byte */
+    size_t rio_size;            /* Capacity of rio_data */
+    char *rio_data;             /* rio_init, or a heap buffer once grown */
+    char rio_init[RIO_BUFSIZE]; /* Storage until a line or head needs more */
+} rio_ring_t;
+/* $end rio_ring_t */
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -178,6 +192,12 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_ringinitb(rio_ring_t *rp, int fd); 
+void rio_ringfreeb(rio_ring_t *rp);
+ssize_t	rio_ringfillb(rio_ring_t *rp);
+char *rio_ringpullupb(rio_ring_t *rp, size_t n);
+void rio_ringconsumeb(rio_ring_t *rp, size_t n);
+ssize_t	rio_ringlineb(rio_ring_t *rp, char **linep);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
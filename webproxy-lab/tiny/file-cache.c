@@ -0,0 +1,190 @@
+#include <pthread.h>
+#include "csapp.h"
+#include "tiny-interface.h"
+#include "file-cache.h"
+
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static fileCacheEntry *buckets[FILE_CACHE_BUCKET_COUNT];
+static fileCacheEntry *pHead, *pTail;
+static int entryCount;
+static size_t memoryUsed;
+static fileCacheHeadRenderer renderHead;
+
+static long long now(void);
+static unsigned int hashPath(const char *path);
+static fileCacheEntry *findEntry(const char *path, unsigned int hash);
+static int isSameFile(const struct stat *pCached, const struct stat *pCurrent);
+static fileCacheEntry *openEntry(const char *path, struct stat *pStatus);
+static void linkFront(fileCacheEntry *pEntry);
+static void unlinkList(fileCacheEntry *pEntry);
+static void evictEntry(fileCacheEntry *pEntry);
+static void freeEntry(fileCacheEntry *pEntry);
+
+void fileCacheInit(fileCacheHeadRenderer renderer) {
+  renderHead = renderer;
+}
+int fileCacheAcquire(const char *path, struct stat *pStatus, fileCacheEntry **ppEntry) {
+  /* -1 when "path" does not exist; otherwise "pStatus" is filled and "ppEntry" holds the open file, or NULL when it is not a readable regular file */
+  unsigned int hash = hashPath(path);
+  long long checkedNs = now();
+  int isStated = False;
+
+  /* Hit: No open, No stat, Unless The Last Check Is Old */
+  pthread_mutex_lock(&cacheLock);
+  fileCacheEntry *pEntry = findEntry(path, hash);
+  if(pEntry != NULL) {
+    pEntry->referenceCount++;
+    unlinkList(pEntry); /* Touch: move to the most recently used position */
+    linkFront(pEntry);
+    if(checkedNs - pEntry->checkedNs < FILE_CACHE_REVALIDATE_NS) {
+      *pStatus = pEntry->status;
+      *ppEntry = pEntry;
+      pthread_mutex_unlock(&cacheLock);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&cacheLock);
+  if(pEntry != NULL) {
+    isStated = (stat(path, pStatus) == 0);
+    pthread_mutex_lock(&cacheLock);
+    if(isStated && isSameFile(&pEntry->status, pStatus)) {
+      pEntry->checkedNs = checkedNs;
+      pthread_mutex_unlock(&cacheLock);
+      *ppEntry = pEntry;
+      return 0;
+    }
+    if(!pEntry->isEvicted) evictEntry(pEntry); /* Edited, replaced or removed: the next request opens it again */
+    pthread_mutex_unlock(&cacheLock);
+    fileCacheRelease(pEntry);
+    if(!isStated) return -1;
+  }
+
+  /* Miss */
+  if(!isStated && stat(path, pStatus) < 0) return -1;
+  *ppEntry = NULL;
+  if(!S_ISREG(pStatus->st_mode) || !(S_IRUSR & pStatus->st_mode)) return 0;
+  if((pEntry = openEntry(path, pStatus)) == NULL) return 0;
+  pEntry->hash = hash;
+  pEntry->checkedNs = checkedNs;
+  pthread_mutex_lock(&cacheLock);
+  fileCacheEntry *pExisting = findEntry(path, hash);
+  if(pExisting != NULL) evictEntry(pExisting); /* Another thread opened it at the same time: keep the newest */
+  while((entryCount >= FILE_CACHE_CAPACITY || memoryUsed + pEntry->memorySize > FILE_CACHE_MEMORY) && pTail != NULL) evictEntry(pTail);
+  fileCacheEntry **pBucket = &buckets[hash % FILE_CACHE_BUCKET_COUNT];
+  pEntry->pBucketNext = *pBucket;
+  *pBucket = pEntry;
+  linkFront(pEntry);
+  entryCount++;
+  memoryUsed += pEntry->memorySize;
+  pthread_mutex_unlock(&cacheLock);
+  *ppEntry = pEntry;
+  return 0;
+}
+void fileCacheRelease(fileCacheEntry *pEntry) {
+  int isLastReader;
+  pthread_mutex_lock(&cacheLock);
+  pEntry->referenceCount--;
+  isLastReader = (pEntry->isEvicted && pEntry->referenceCount == 0);
+  pthread_mutex_unlock(&cacheLock);
+  if(isLastReader) freeEntry(pEntry);
+}
+
+static long long now(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time); /* vDSO: no system call */
+  return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+static unsigned int hashPath(const char *path) {
+  unsigned int hash = 2166136261u; /* FNV-1a */
+  for(const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+static fileCacheEntry *findEntry(const char *path, unsigned int hash) {
+  for(fileCacheEntry *p = buckets[hash % FILE_CACHE_BUCKET_COUNT]; p != NULL; p = p->pBucketNext) {
+    if(p->hash == hash && !strcmp(p->path, path)) return p;
+  }
+  return NULL;
+}
+static int isSameFile(const struct stat *pCached, const struct stat *pCurrent) {
+  /* A new inode means the path was replaced; a new size or mtime means it was written in place */
+  return pCached->st_dev == pCurrent->st_dev && pCached->st_ino == pCurrent->st_ino && pCached->st_size == pCurrent->st_size
+    && pCached->st_mtim.tv_sec == pCurrent->st_mtim.tv_sec && pCached->st_mtim.tv_nsec == pCurrent->st_mtim.tv_nsec
+    && pCached->st_mode == pCurrent->st_mode;
+}
+static fileCacheEntry *openEntry(const char *path, struct stat *pStatus) {
+  /* The entry starts with its caller's reference; NULL when the file cannot be read after all */
+  char head[MAXBUF];
+  int fd = open(path, O_RDONLY | O_CLOEXEC); /* CGI children must not inherit the cache */
+  if(fd < 0) return NULL;
+  if(fstat(fd, pStatus) < 0 || !S_ISREG(pStatus->st_mode)) { /* Describe what was opened, not what the path named a moment ago */
+    close(fd);
+    return NULL;
+  }
+  fileCacheEntry *pEntry = Malloc(sizeof(fileCacheEntry));
+  pEntry->path = Malloc(strlen(path) + 1);
+  strcpy(pEntry->path, path);
+  pEntry->fd = fd;
+  pEntry->status = *pStatus;
+  pEntry->headSize = renderHead(path, pStatus, head, sizeof(head));
+  pEntry->head = Malloc(pEntry->headSize + 1);
+  memcpy(pEntry->head, head, pEntry->headSize + 1);
+  pEntry->content = NULL;
+  pEntry->memorySize = pEntry->headSize;
+  pEntry->referenceCount = 1;
+  pEntry->isEvicted = False;
+
+  /* Small Files Are Kept Whole: A Hit Is Then One writev Of Two Buffers */
+  size_t size = pStatus->st_size, offset = 0;
+  ssize_t n = 0;
+  if(size > 0 && size <= FILE_CACHE_MAX_CONTENT) {
+    pEntry->content = Malloc(size);
+    while(offset < size && ((n = pread(fd, pEntry->content + offset, size - offset, offset)) > 0 || (n < 0 && errno == EINTR))) {
+      if(n > 0) offset += n;
+    }
+    if(offset < size) { /* Shrank or failed under us: send from the descriptor instead */
+      Free(pEntry->content);
+      pEntry->content = NULL;
+    }
+    else {
+      close(fd);
+      pEntry->fd = -1;
+      pEntry->memorySize += size;
+    }
+  }
+  return pEntry;
+}
+static void linkFront(fileCacheEntry *pEntry) {
+  pEntry->pPrevious = NULL;
+  pEntry->pNext = pHead;
+  if(pHead != NULL) pHead->pPrevious = pEntry;
+  pHead = pEntry;
+  if(pTail == NULL) pTail = pEntry;
+}
+static void unlinkList(fileCacheEntry *pEntry) {
+  if(pEntry->pPrevious != NULL) pEntry->pPrevious->pNext = pEntry->pNext;
+  else pHead = pEntry->pNext;
+  if(pEntry->pNext != NULL) pEntry->pNext->pPrevious = pEntry->pPrevious;
+  else pTail = pEntry->pPrevious;
+  pEntry->pPrevious = pEntry->pNext = NULL;
+}
+static void evictEntry(fileCacheEntry *pEntry) {
+  /* Caller holds the cache lock */
+  fileCacheEntry **ppLink = &buckets[pEntry->hash % FILE_CACHE_BUCKET_COUNT];
+  while(*ppLink != NULL && *ppLink != pEntry) ppLink = &(*ppLink)->pBucketNext;
+  if(*ppLink != NULL) *ppLink = pEntry->pBucketNext;
+  unlinkList(pEntry);
+  entryCount--;
+  memoryUsed -= pEntry->memorySize;
+  pEntry->isEvicted = True;
+  if(pEntry->referenceCount == 0) freeEntry(pEntry); /* Otherwise the last "fileCacheRelease" closes it */
+}
+static void freeEntry(fileCacheEntry *pEntry) {
+  if(pEntry->fd >= 0) close(pEntry->fd);
+  if(pEntry->content != NULL) Free(pEntry->content);
+  Free(pEntry->head);
+  Free(pEntry->path);
+  Free(pEntry);
+}
@@ -0,0 +1,36 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+
+#define FILE_CACHE_CAPACITY 256 /* Hot files kept, each as an open descriptor or an in-memory copy */
+#define FILE_CACHE_BUCKET_COUNT 512
+#define FILE_CACHE_REVALIDATE_NS 1000000000LL /* How old a cached stat may get before the path is checked again */
+#define FILE_CACHE_MAX_CONTENT (256 * 1024) /* Larger files stay on disk and are sent from their descriptor */
+#define FILE_CACHE_MEMORY (32 * 1024 * 1024) /* Heads and contents of every cached file together */
+
+/* Writes the response head for a file into "head"; returns its length */
+typedef size_t (*fileCacheHeadRenderer)(const char *path, const struct stat *pStatus, char *head, size_t capacity);
+
+/* A static file ready to send: its response head, and its bytes or an open descriptor */
+typedef struct fileCacheEntry {
+  char *path;
+  int fd; /* -1 when "content" holds the file; read only through "sendfile" with explicit offsets, so every thread can share it */
+  struct stat status;
+  char *head; /* Rendered once per version of the file, NUL-terminated */
+  size_t headSize;
+  char *content; /* The whole file, or NULL */
+  size_t memorySize; /* Head plus content, charged against FILE_CACHE_MEMORY */
+  unsigned int hash;
+  long long checkedNs; /* When the path last still named this file */
+  int referenceCount; /* Responses still sending from "fd", guarded by the cache lock */
+  int isEvicted; /* Unlinked from the cache, closed by the last reader */
+  struct fileCacheEntry *pPrevious, *pNext; /* LRU list: head is the most recently used */
+  struct fileCacheEntry *pBucketNext; /* Hash bucket chain */
+} fileCacheEntry;
+
+void fileCacheInit(fileCacheHeadRenderer renderHead);
+int fileCacheAcquire(const char *path, struct stat *pStatus, fileCacheEntry **ppEntry);
+void fileCacheRelease(fileCacheEntry *pEntry);
+
+#endif
@@ -1,4 +1,9 @@
 #define True 1
 #define False 0
 #define CONTENT_IS_STATIC 1
-#define CONTENT_IS_DYNAMIC 0
\ No newline at end of file
+#define CONTENT_IS_DYNAMIC 0
+#define ENGINE_ITERATIVE 0 /* One connection at a time */
+#define ENGINE_THREAD 1 /* Prethreaded workers, each blocking in accept */
+#define ENGINE_EPOLL 2 /* Non-blocking event loops */
+#define DEFAULT_THREAD_COUNT 32
+#define MAX_EVENTS 256 /* Events handled per epoll_wait */
@@ -1,48 +1,261 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content, one connection at a time or
+ *     concurrently from a prethreaded pool or epoll event loops.
  *
  * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "tiny-interface.h"
+#include "file-cache.h"
+#include "accept-flags.h"
 
+/* Static response being sent: the head, then a cached file or an error page */
+typedef struct {
+  char *head, *body; /* Point into "pFile" or at the buffers below; "body" is NULL when it goes by "sendfile" */
+  size_t headSize, bodySize;
+  fileCacheEntry *pFile; /* Held until the response is released */
+  char headBuffer[MAXBUF], errorBody[MAXBUF];
+} response;
+
+/* One client of an epoll loop */
+typedef struct {
+  int fd;
+  rio_ring_t input; /* Request head, read until its blank line; grows past MAXBUF for large heads */
+  int isResponding;
+  response response;
+  size_t sent; /* Across the head and the body */
+} connection;
+
+typedef struct {
+  int engine;
+  int threadCount; /* Pool workers, or event loops */
+  char *port;
+} tinyConfig;
+
+int parseConfig(int argc, char **argv, tinyConfig *pConfig);
+void *acceptLoop(void *pArgument);
+void *eventLoop(void *pArgument);
+void acceptConnections(int epollfd, int listenfd);
+int driveConnection(int epollfd, connection *pConnection);
+void closeConnection(int epollfd, connection *pConnection);
+int readRequestHead(connection *pConnection);
+int hasBlankLine(const char *data, size_t size);
+void copyRequestLine(char *buf, const char *line, size_t length);
+int writeResponse(connection *pConnection);
+void reapChildren(int sig);
+void logConnection(SA *pAddress, socklen_t size);
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+int route(char *requestLine, response *pResponse, char *filename, char *cgiargs);
+void read_requesthdrs(rio_ring_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(response *pResponse, fileCacheEntry *pFile);
+size_t render_static_head(const char *filename, const struct stat *pStatus, char *head, size_t capacity);
 void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+pid_t serve_dynamic(int fd, char *filename, char *cgiargs);
+void clienterror(response *pResponse, char *cause, char *errnum, char *shortmsg, char *longmsg);
+void send_response(int fd, response *pResponse);
+ssize_t send_some(int fd, response *pResponse, size_t sent);
+void release_response(response *pResponse);
+void set_cork(int fd, int isCorked);
 
 int main(int argc, char **argv) {
-  int listenfd, connectfd;
-  char hostname[MAXLINE], port[MAXLINE];
-  socklen_t sizeOfClientAddress;
-  struct sockaddr_storage clientAddress;
+  int listenfd;
+  tinyConfig config;
+  pthread_t threadId;
 
   /* Check command line args */
-  if(argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  if(parseConfig(argc, argv, &config) < 0) {
+    fprintf(stderr, "usage: %s <port> [-e iterative|thread|epoll] [-t thread count]\n", argv[0]);
     exit(1);
   }
+  Signal(SIGPIPE, SIG_IGN); /* A client that hangs up fails its own writes instead of killing the server */
+  fileCacheInit(render_static_head);
+
+  listenfd = Open_listenfd(config.port);
+  if(config.engine == ENGINE_EPOLL) {
+    Signal(SIGCHLD, reapChildren); /* Event loops never block in a wait for their CGI children */
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    for(int i = 1; i < config.threadCount; i++) Pthread_create(&threadId, NULL, eventLoop, &listenfd);
+    eventLoop(&listenfd); /* The main thread drives the last loop */
+  }
+  if(config.engine == ENGINE_THREAD) {
+    for(int i = 1; i < config.threadCount; i++) Pthread_create(&threadId, NULL, acceptLoop, &listenfd); /* Prethread the workers */
+  }
+  acceptLoop(&listenfd); /* Iterative: the only worker */
+  return 0;
+}
+
+int parseConfig(int argc, char **argv, tinyConfig *pConfig) {
+  int option;
+  pConfig->engine = ENGINE_THREAD;
+  pConfig->threadCount = 0;
+  while((option = getopt(argc, argv, "e:t:")) != -1) {
+    switch(option) {
+      case 'e':
+        if(!strcmp(optarg, "iterative")) pConfig->engine = ENGINE_ITERATIVE;
+        else if(!strcmp(optarg, "thread")) pConfig->engine = ENGINE_THREAD;
+        else if(!strcmp(optarg, "epoll")) pConfig->engine = ENGINE_EPOLL;
+        else return -1;
+        break;
+      case 't': pConfig->threadCount = atoi(optarg); if(pConfig->threadCount <= 0) return -1; break;
+      default: return -1;
+    }
+  }
+  if(optind != argc - 1) return -1;
+  if(pConfig->engine == ENGINE_ITERATIVE) pConfig->threadCount = 1;
+  else if(pConfig->threadCount == 0) pConfig->threadCount = (pConfig->engine == ENGINE_EPOLL) ? sysconf(_SC_NPROCESSORS_ONLN) : DEFAULT_THREAD_COUNT;
+  pConfig->port = argv[optind];
+  return 0;
+}
+void *acceptLoop(void *pArgument) {
+  /* Logical Flow
+  - complete the connection
+  - handle the transaction
+  - close the connection
+  Every pool worker runs this on the shared listener: the kernel hands each connection to one of them
+  */
+  int listenfd = *(int *)pArgument, connectfd;
+  socklen_t sizeOfClientAddress;
+  struct sockaddr_storage clientAddress;
 
-  listenfd = Open_listenfd(argv[1]);
   while(True) {
-    /* Logical Flow
-    - complete the connection
-    - handle the transaction
-    - close the connection
-    */
     sizeOfClientAddress = sizeof(clientAddress); /* Why must it be inside the loop?: Resolved */
-    connectfd = Accept(listenfd, (SA *)&clientAddress, &sizeOfClientAddress); /* Accept the connection request */
-    Getnameinfo((SA *)&clientAddress, sizeOfClientAddress, hostname, MAXLINE, port, MAXLINE, 0); /* Set up the hostname and port */
-    printf("Accepted connection from (%s, %s)\n", hostname, port); /* Nothing logical, just logging */
+    if((connectfd = acceptWithFlags(listenfd, (SA *)&clientAddress, &sizeOfClientAddress, SOCK_CLOEXEC)) < 0) continue; /* Aborted or out of descriptors: keep serving; CGI children forked by other workers must not hold it open */
+    logConnection((SA *)&clientAddress, sizeOfClientAddress);
     doit(connectfd); /* Handle one transaction */
     Close(connectfd); /* Close the connection request */
   }
+  return NULL;
+}
+void *eventLoop(void *pArgument) {
+  /* Every loop watches the shared listener; EPOLLEXCLUSIVE wakes only one of them per connection */
+  int listenfd = *(int *)pArgument, epollfd;
+  struct epoll_event events[MAX_EVENTS];
+  struct epoll_event listenEvent = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+
+  if((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) unix_error("epoll_create1 error");
+  if(epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &listenEvent) < 0) unix_error("epoll_ctl error");
+  while(True) {
+    int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+    if(n < 0) {
+      if(errno == EINTR) continue; /* A CGI child exited */
+      unix_error("epoll_wait error");
+    }
+    for(int i = 0; i < n; i++) {
+      connection *pConnection = events[i].data.ptr;
+      if(pConnection == NULL) acceptConnections(epollfd, listenfd);
+      else if(driveConnection(epollfd, pConnection) < 0) closeConnection(epollfd, pConnection); /* Done or failed: each event names only its own connection, so it can go now */
+    }
+  }
+  return NULL;
+}
+void acceptConnections(int epollfd, int listenfd) {
+  struct sockaddr_storage clientAddress;
+  socklen_t sizeOfClientAddress;
+  while(True) {
+    sizeOfClientAddress = sizeof(clientAddress);
+    int connectfd = acceptWithFlags(listenfd, (SA *)&clientAddress, &sizeOfClientAddress, SOCK_NONBLOCK | SOCK_CLOEXEC); /* CGI children inherit only their own socket */
+    if(connectfd < 0) {
+      if(errno == EINTR) continue;
+      return; /* EAGAIN: the backlog is drained */
+    }
+    logConnection((SA *)&clientAddress, sizeOfClientAddress);
+    connection *pConnection = Malloc(sizeof(connection));
+    pConnection->fd = connectfd;
+    rio_ringinitb(&pConnection->input, connectfd);
+    pConnection->sent = 0;
+    pConnection->isResponding = False;
+    pConnection->response.pFile = NULL;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = pConnection };
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, connectfd, &event) < 0) unix_error("epoll_ctl error"); /* Data already queued raises the first edge immediately */
+  }
+}
+int driveConnection(int epollfd, connection *pConnection) {
+  /* Edge-triggered: runs until the kernel says EAGAIN; -1 once the connection should close */
+  char buf[MAXLINE], filename[MAXLINE], cgiargs[MAXLINE];
+  if(!pConnection->isResponding) {
+    int status = readRequestHead(pConnection);
+    if(status <= 0) return status;
+    rio_ring_t *pInput = &pConnection->input;
+    copyRequestLine(buf, rio_ringpullupb(pInput, pInput->rio_cnt), pInput->rio_cnt); /* The request line; the headers are not used */
+    printf("Request headers: %s\n", buf);
+    if(route(buf, &pConnection->response, filename, cgiargs) == CONTENT_IS_DYNAMIC) {
+      epoll_ctl(epollfd, EPOLL_CTL_DEL, pConnection->fd, NULL); /* The child keeps the socket open, so closing ours would not drop it from the set */
+      fcntl(pConnection->fd, F_SETFL, fcntl(pConnection->fd, F_GETFL) & ~O_NONBLOCK); /* The CGI program writes with plain blocking stdio */
+      serve_dynamic(pConnection->fd, filename, cgiargs); /* Reaped by "reapChildren" */
+      return -1;
+    }
+    pConnection->isResponding = True;
+    if(pConnection->response.body == NULL) set_cork(pConnection->fd, True); /* Head and "sendfile" body leave in full segments */
+  }
+  return writeResponse(pConnection);
+}
+void closeConnection(int epollfd, connection *pConnection) {
+  /* Deregister first: epoll drops a socket only when every descriptor for it is closed, and a CGI child may still hold one */
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, pConnection->fd, NULL); /* ENOENT once a CGI child took it over */
+  release_response(&pConnection->response);
+  rio_ringfreeb(&pConnection->input);
+  Close(pConnection->fd);
+  Free(pConnection);
+}
+int readRequestHead(connection *pConnection) {
+  /* 1 once the blank line is in, 0 to wait for more, -1 on close, error or a head larger than RIO_RING_MAXSIZE */
+  rio_ring_t *pInput = &pConnection->input;
+  while(True) {
+    ssize_t n = rio_ringfillb(pInput); /* Retries EINTR itself */
+    if(n > 0) {
+      if(hasBlankLine(rio_ringpullupb(pInput, pInput->rio_cnt), pInput->rio_cnt)) return 1;
+      continue;
+    }
+    return (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 0 : -1;
+  }
+}
+int hasBlankLine(const char *data, size_t size) {
+  /* "\r\n\r\n" or "\n\n": a line feed followed by an empty line */
+  const char *end = data + size, *p = data;
+  while((p = memchr(p, '\n', end - p)) != NULL && ++p < end) {
+    if(*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n')) return True;
+  }
+  return False;
+}
+void copyRequestLine(char *buf, const char *line, size_t length) {
+  /* Up to the line ending, cut to MAXLINE like "rio_readlineb" did, so the fixed buffers in "route" cannot overflow */
+  const char *lineEnd = memchr(line, '\n', length);
+  if(lineEnd != NULL) length = lineEnd - line;
+  if(length > 0 && line[length - 1] == '\r') length--;
+  if(length > MAXLINE - 1) length = MAXLINE - 1;
+  memcpy(buf, line, length);
+  buf[length] = '\0';
+}
+int writeResponse(connection *pConnection) {
+  /* 0 to wait for the socket to drain, -1 once everything is sent or the client is gone */
+  response *pResponse = &pConnection->response;
+  size_t total = pResponse->headSize + pResponse->bodySize;
+  while(pConnection->sent < total) {
+    ssize_t n = send_some(pConnection->fd, pResponse, pConnection->sent);
+    if(n > 0) pConnection->sent += n;
+    else if(n < 0 && errno == EINTR) continue;
+    else return (n < 0 && errno == EAGAIN) ? 0 : -1;
+  }
+  if(pResponse->body == NULL) set_cork(pConnection->fd, False); /* Push out the last partial segment */
+  return -1;
+}
+void reapChildren(int sig) {
+  int savedErrno = errno;
+  while(waitpid(-1, NULL, WNOHANG) > 0); /* Several children may have exited behind one signal */
+  errno = savedErrno;
+}
+void logConnection(SA *pAddress, socklen_t size) {
+  char hostname[MAXLINE], port[MAXLINE];
+  Getnameinfo(pAddress, size, hostname, MAXLINE, port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV); /* Numeric: a reverse lookup would stall every client behind it */
+  printf("Accepted connection from (%s, %s)\n", hostname, port); /* Nothing logical, just logging */
 }
 
 void doit(int fd) {
@@ -51,64 +264,89 @@ void doit(int fd) {
   - locate the file requested
   - serve
   */
+  char buf[MAXLINE], filename[MAXLINE], cgiargs[MAXLINE], *line;
+  response response;
+  rio_ring_t rio;
+  ssize_t n;
+
+  rio_ringinitb(&rio, fd);
+  if((n = rio_ringlineb(&rio, &line)) <= 0) { /* Read one request line; the client may have left already */
+    rio_ringfreeb(&rio);
+    return;
+  }
+  copyRequestLine(buf, line, n);
+  printf("Request headers: %s\n", buf);
+  read_requesthdrs(&rio); /* Drain the buffer */
+  rio_ringfreeb(&rio);
+  if(route(buf, &response, filename, cgiargs) == CONTENT_IS_DYNAMIC) {
+    Waitpid(serve_dynamic(fd, filename, cgiargs), NULL, 0);
+    return;
+  }
+  send_response(fd, &response);
+  release_response(&response);
+}
+int route(char *requestLine, response *pResponse, char *filename, char *cgiargs) {
+  /* CONTENT_IS_DYNAMIC: run "filename" with "cgiargs"; otherwise "pResponse" holds the file or the error to send */
   int isRequestStatic;
   struct stat fileInformation; /* Information about the file */
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  char filename[MAXLINE], cgiargs[MAXLINE];
-  rio_t rio;
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  fileCacheEntry *pFile = NULL;
 
-  Rio_readinitb(&rio, fd);
-  Rio_readlineb(&rio, buf, MAXLINE); /* Read one request line */
-  printf("Request headers: %s\n", buf);
-  sscanf(buf, "%s %s %s", method, uri, version); /* Set up the variables */
+  pResponse->pFile = NULL;
+  if(sscanf(requestLine, "%s %s %s", method, uri, version) < 2) { /* Set up the variables */
+    clienterror(pResponse, "", "400", "Bad request", "Tiny couldn't parse the request");
+    return CONTENT_IS_STATIC;
+  }
   if(strcasecmp(method, "GET")) {
-    clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method");
-    return; /* Return when the request isn't GET METHOD */
+    clienterror(pResponse, method, "501", "Not implemented", "Tiny does not implement this method");
+    return CONTENT_IS_STATIC; /* Return when the request isn't GET METHOD */
   }
-  read_requesthdrs(&rio); /* Drain the buffer */
 
   isRequestStatic = parse_uri(uri, filename, cgiargs); /* Set up the file name and arguments */
-  if(stat(filename, &fileInformation) < 0) {
-    clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
-    return; /* Return when cannot find the file */
+  if((isRequestStatic ? fileCacheAcquire(filename, &fileInformation, &pFile) : stat(filename, &fileInformation)) < 0) { /* Hot files skip the stat too */
+    clienterror(pResponse, filename, "404", "Not found", "Tiny couldn't find this file");
+    return CONTENT_IS_STATIC; /* Return when cannot find the file */
   }
 
   if(isRequestStatic) {
-    if(!(S_ISREG(fileInformation.st_mode)) || !(S_IRUSR & fileInformation.st_mode)) {
-      clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file");
-      return;
+    if(!(S_ISREG(fileInformation.st_mode)) || !(S_IRUSR & fileInformation.st_mode) || pFile == NULL) {
+      clienterror(pResponse, filename, "403", "Forbidden", "Tiny couldn't read the file");
+      return CONTENT_IS_STATIC;
     }
-    serve_static(fd, filename, fileInformation.st_size);
+    serve_static(pResponse, pFile);
+    return CONTENT_IS_STATIC;
   }
-  else {
-    if(!(S_ISREG(fileInformation.st_mode)) || !(S_IXUSR & fileInformation.st_mode)) {
-      clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
-      return;
-    }
-    serve_dynamic(fd, filename, cgiargs);
+  if(!(S_ISREG(fileInformation.st_mode)) || !(S_IXUSR & fileInformation.st_mode)) {
+    clienterror(pResponse, filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
+    return CONTENT_IS_STATIC;
   }
+  return CONTENT_IS_DYNAMIC;
 }
-void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-  char buf[MAXLINE], body[MAXBUF];
+void clienterror(response *pResponse, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+  char *body = pResponse->errorBody, *head = pResponse->headBuffer;
   int n = 0;
-  n += snprintf(body + n, sizeof(body) - n, "<html><title>Tiny Error</title>");
-  n += snprintf(body + n, sizeof(body) - n, "<body bgcolor=\"ffffff\">\r\n");
-  n += snprintf(body + n, sizeof(body) - n, "%s: %s\r\n", errnum, shortmsg);
-  n += snprintf(body + n, sizeof(body) - n, "<p>%s: %s</p>\r\n", longmsg, cause);
-  n += snprintf(body + n, sizeof(body) - n, "<hr><em>The Tiny Web server</em>\r\n");
+  n += snprintf(body + n, sizeof(pResponse->errorBody) - n, "<html><title>Tiny Error</title>");
+  n += snprintf(body + n, sizeof(pResponse->errorBody) - n, "<body bgcolor=\"ffffff\">\r\n");
+  n += snprintf(body + n, sizeof(pResponse->errorBody) - n, "%s: %s\r\n", errnum, shortmsg);
+  n += snprintf(body + n, sizeof(pResponse->errorBody) - n, "<p>%s: %s</p>\r\n", longmsg, cause);
+  n += snprintf(body + n, sizeof(pResponse->errorBody) - n, "<hr><em>The Tiny Web server</em>\r\n");
   int h = 0;
-  h += snprintf(buf + h, sizeof(buf) - h, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  h += snprintf(buf + h, sizeof(buf) - h, "Content-type: text/html\r\n");
-  h += snprintf(buf + h, sizeof(buf) - h, "Content-length: %d\r\n\r\n", n);
-  Rio_writen(fd, buf, h);
-  Rio_writen(fd, body, n);
-}
-void read_requesthdrs(rio_t *rp) {
-  char buf[MAXLINE];
-  /* Read the first line */ Rio_readlineb(rp, buf, MAXLINE);
-  while(/* If the next line is not a blank, drain one more line */ strcmp(buf, "\r\n")) {
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("💻 Drain the buffer: %s", buf);
+  h += snprintf(head + h, sizeof(pResponse->headBuffer) - h, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+  h += snprintf(head + h, sizeof(pResponse->headBuffer) - h, "Content-type: text/html\r\n");
+  h += snprintf(head + h, sizeof(pResponse->headBuffer) - h, "Content-length: %d\r\n\r\n", n);
+  pResponse->head = head;
+  pResponse->headSize = h;
+  pResponse->body = body;
+  pResponse->bodySize = n;
+  pResponse->pFile = NULL;
+}
+void read_requesthdrs(rio_ring_t *rp) {
+  char *line; /* A view into the ring: nothing is copied out */
+  ssize_t n;
+  /* Read the first line */ if((n = rio_ringlineb(rp, &line)) <= 0) return;
+  while(/* If the next line is not a blank, drain one more line */ !(n == 2 && !memcmp(line, "\r\n", 2))) {
+    if((n = rio_ringlineb(rp, &line)) <= 0) return; /* The client closed mid-head */
+    printf("💻 Drain the buffer: %.*s", (int)n, line);
   }
   return;
 }
@@ -117,7 +355,7 @@ int parse_uri(char *uri, char *filename, char *cgiargs) {
   if(/* CASE 1: content is not dynamic */ !strstr(uri, "cgi-bin")) {
     /* No arguments required */
     strcpy(cgiargs, "");
-    
+
     /* Setting up the file name */
     strcpy(filename, ".");
     strcat(filename, uri);
@@ -127,47 +365,44 @@ int parse_uri(char *uri, char *filename, char *cgiargs) {
   }
   else /* CASE 2: content is dynamic */ {
     ptr = index(uri, '?');
-    
-    /* Setting up the arguments */ 
+
+    /* Setting up the arguments */
     if(ptr) {
       strcpy(cgiargs, ptr + 1);
       *ptr = '\0';
     }
     else strcpy(cgiargs, "");
-    
+
     /* Setting up the file name */
     strcpy(filename, ".");
     strcat(filename, uri);
-    
+
     return CONTENT_IS_DYNAMIC;
   }
 }
-void serve_static(int fd, char *filename, int filesize) {
+void serve_static(response *pResponse, fileCacheEntry *pFile) {
   /* Logical Flow
-  - Open file
-  - Memory mapping
-  - Close file
-  - Write on socket
-  - Memory unmapping
+  - Hold the cached file: its head was rendered when it was cached
+  - The caller sends the head and the bytes in memory with one writev, or the head then the file with "sendfile"
   */
-  int srcfd;
-  char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-  get_filetype(filename, filetype);
+  pResponse->head = pFile->head;
+  pResponse->headSize = pFile->headSize;
+  pResponse->body = pFile->content;
+  pResponse->bodySize = pFile->status.st_size;
+  pResponse->pFile = pFile;
+  printf("Response headers: %s\n", pResponse->head);
+}
+size_t render_static_head(const char *filename, const struct stat *pStatus, char *head, size_t capacity) {
+  /* Called by the file cache once per version of a file, not per request */
+  char filetype[MAXLINE];
+  get_filetype((char *)filename, filetype);
   int n = 0;
-  n += snprintf(buf + n, sizeof(buf) - n, "HTTP/1.0 200 OK\r\n");
-  n += snprintf(buf + n, sizeof(buf) - n, "Server: Tiny Web Server\r\n");
-  n += snprintf(buf + n, sizeof(buf) - n, "Connection: close\r\n");
-  n += snprintf(buf + n, sizeof(buf) - n, "Content-length: %d\r\n", filesize);
-  n += snprintf(buf + n, sizeof(buf) - n, "Content-type: %s\r\n\r\n", filetype);
-  Rio_writen(fd, buf, n);
-  printf("Response headers: %s\n", buf);
-
-  srcfd = Open(filename, O_RDONLY, 0);
-  srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-  Close(srcfd);
-  Rio_writen(fd, srcp, filesize);
-  Munmap(srcp, filesize);
+  n += snprintf(head + n, capacity - n, "HTTP/1.0 200 OK\r\n");
+  n += snprintf(head + n, capacity - n, "Server: Tiny Web Server\r\n");
+  n += snprintf(head + n, capacity - n, "Connection: close\r\n");
+  n += snprintf(head + n, capacity - n, "Content-length: %lld\r\n", (long long)pStatus->st_size);
+  n += snprintf(head + n, capacity - n, "Content-type: %s\r\n\r\n", filetype);
+  return n;
 }
 void get_filetype(char *filename, char *filetype) {
   if(strstr(filename, ".html")) strcpy(filetype, "text/html");
@@ -176,18 +411,58 @@ void get_filetype(char *filename, char *filetype) {
   else if(strstr(filename, ".jpg")) strcpy(filetype, "image/jpeg");
   else strcpy(filetype, "text/plain");
 }
-void serve_dynamic(int fd, char *filename, char *cgiargs) {
+pid_t serve_dynamic(int fd, char *filename, char *cgiargs) {
+  /* Returns the child for the caller to wait on */
   char buf[MAXLINE], *emptylist[] = { NULL };
+  pid_t pid;
 
   sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  rio_writen(fd, buf, strlen(buf));
   sprintf(buf, "Server: Tiny Web Server\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  rio_writen(fd, buf, strlen(buf));
 
-  if(Fork() == 0) {
+  if((pid = Fork()) == 0) {
     setenv("QUERY_STRING", cgiargs, 1);
     Dup2(fd, STDOUT_FILENO); /* Replace "STDOUT_FILENO" with "fd": "printf" prints directly to the client socket, not the terminal */
     Execve(filename, emptylist, environ); /* Execute the CGI program */
   }
-  Wait(NULL);
+  return pid;
+}
+void send_response(int fd, response *pResponse) {
+  /* A client that left only ends its own transaction */
+  size_t sent = 0, total = pResponse->headSize + pResponse->bodySize;
+  ssize_t n;
+  if(pResponse->body == NULL) set_cork(fd, True); /* The head waits for the file's first bytes instead of leaving as a segment of its own */
+  while(sent < total) {
+    if((n = send_some(fd, pResponse, sent)) > 0) sent += n;
+    else if(n < 0 && errno == EINTR) continue;
+    else return; /* Client gone, or the file shrank under us */
+  }
+  if(pResponse->body == NULL) set_cork(fd, False);
+}
+ssize_t send_some(int fd, response *pResponse, size_t sent) {
+  /* One system call's worth past the first "sent" bytes: head and body in memory go together */
+  struct iovec parts[2];
+  int count = 0;
+  if(pResponse->body == NULL && sent >= pResponse->headSize) {
+    off_t offset = sent - pResponse->headSize;
+    return sendfile(fd, pResponse->pFile->fd, &offset, pResponse->bodySize - offset);
+  }
+  if(sent < pResponse->headSize) {
+    parts[count].iov_base = pResponse->head + sent;
+    parts[count++].iov_len = pResponse->headSize - sent;
+  }
+  if(pResponse->body != NULL) {
+    size_t bodySent = (sent > pResponse->headSize) ? sent - pResponse->headSize : 0;
+    parts[count].iov_base = pResponse->body + bodySent;
+    parts[count++].iov_len = pResponse->bodySize - bodySent;
+  }
+  return writev(fd, parts, count);
+}
+void release_response(response *pResponse) {
+  if(pResponse->pFile != NULL) fileCacheRelease(pResponse->pFile);
+  pResponse->pFile = NULL;
+}
+void set_cork(int fd, int isCorked) {
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &isCorked, sizeof(isCorked));
 }
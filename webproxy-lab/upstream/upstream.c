@@ -0,0 +1,201 @@
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "../csapp.h"
+#include "upstream.h"
+
+#define UPSTREAM_KEY_SIZE 300
+
+/* Idle keep-alive connections to one origin, newest last */
+typedef struct upstreamHost {
+  char key[UPSTREAM_KEY_SIZE];
+  unsigned int hash;
+  int idlefds[UPSTREAM_MAX_IDLE_PER_HOST];
+  time_t idleSince[UPSTREAM_MAX_IDLE_PER_HOST];
+  int idleCount;
+  time_t lastUsed;
+  struct upstreamHost *pBucketNext;
+  struct upstreamHost *pPrevious, *pNext; /* LRU list: head is the most recently used */
+} upstreamHost;
+
+typedef struct {
+  pthread_mutex_t lock;
+  upstreamHost *buckets[UPSTREAM_BUCKET_COUNT];
+  upstreamHost *pHead, *pTail;
+  int hostCount;
+} upstreamShard;
+
+static upstreamShard shards[UPSTREAM_SHARD_COUNT];
+
+static void makeKey(char *key, const char *hostname, const char *port);
+static unsigned int hashKey(const char *key);
+static upstreamHost *findHost(upstreamShard *pShard, const char *key, unsigned int hash);
+static upstreamHost *addHost(upstreamShard *pShard, const char *key, unsigned int hash);
+static int removeHost(upstreamShard *pShard, upstreamHost *pHost, int *closingfds);
+static void touchHost(upstreamShard *pShard, upstreamHost *pHost, time_t now);
+static int dropExpired(upstreamHost *pHost, time_t now, int *closingfds);
+static void *sweepThread(void *pArgument);
+static int isAlive(int fd);
+
+void upstreamInit(void) {
+  pthread_t threadId;
+  for(int i = 0; i < UPSTREAM_SHARD_COUNT; i++) {
+    memset(&shards[i], 0, sizeof(upstreamShard));
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+  Pthread_create(&threadId, NULL, sweepThread, NULL);
+}
+int upstreamAcquire(const char *hostname, const char *port) {
+  /* Returns an idle connection to the origin, or -1 when the caller has to open one */
+  char key[UPSTREAM_KEY_SIZE];
+  makeKey(key, hostname, port);
+  unsigned int hash = hashKey(key);
+  upstreamShard *pShard = &shards[hash % UPSTREAM_SHARD_COUNT];
+  time_t now = time(NULL);
+  int fd = -1;
+
+  pthread_mutex_lock(&pShard->lock);
+  upstreamHost *pHost = findHost(pShard, key, hash);
+  if(pHost != NULL) touchHost(pShard, pHost, now);
+  while(pHost != NULL && pHost->idleCount > 0 && fd < 0) {
+    int candidate = pHost->idlefds[--pHost->idleCount]; /* Most recently used first: least likely to have timed out */
+    if(now - pHost->idleSince[pHost->idleCount] <= UPSTREAM_IDLE_TIMEOUT && isAlive(candidate)) fd = candidate;
+    else close(candidate);
+  }
+  pthread_mutex_unlock(&pShard->lock);
+  return fd;
+}
+void upstreamRelease(const char *hostname, const char *port, int fd) {
+  /* Parks a connection whose last response was fully read; the host's oldest and timed-out ones make room */
+  char key[UPSTREAM_KEY_SIZE];
+  makeKey(key, hostname, port);
+  unsigned int hash = hashKey(key);
+  upstreamShard *pShard = &shards[hash % UPSTREAM_SHARD_COUNT];
+  time_t now = time(NULL);
+  int closingfds[2 * UPSTREAM_MAX_IDLE_PER_HOST], closingCount = 0;
+
+  pthread_mutex_lock(&pShard->lock);
+  upstreamHost *pHost = findHost(pShard, key, hash);
+  if(pHost == NULL) {
+    if(pShard->hostCount >= UPSTREAM_MAX_HOSTS_PER_SHARD) closingCount = removeHost(pShard, pShard->pTail, closingfds); /* The least recently used origin gives way */
+    pHost = addHost(pShard, key, hash);
+  }
+  touchHost(pShard, pHost, now);
+  closingCount += dropExpired(pHost, now, closingfds + closingCount);
+  if(pHost->idleCount == UPSTREAM_MAX_IDLE_PER_HOST) {
+    closingfds[closingCount++] = pHost->idlefds[0]; /* Drop the oldest to make room */
+    memmove(pHost->idlefds, pHost->idlefds + 1, (UPSTREAM_MAX_IDLE_PER_HOST - 1) * sizeof(int));
+    memmove(pHost->idleSince, pHost->idleSince + 1, (UPSTREAM_MAX_IDLE_PER_HOST - 1) * sizeof(time_t));
+    pHost->idleCount--;
+  }
+  pHost->idlefds[pHost->idleCount] = fd;
+  pHost->idleSince[pHost->idleCount] = now;
+  pHost->idleCount++;
+  pthread_mutex_unlock(&pShard->lock);
+  for(int i = 0; i < closingCount; i++) close(closingfds[i]);
+}
+
+static void makeKey(char *key, const char *hostname, const char *port) {
+  size_t offset = 0;
+  for(const char *p = hostname; *p && offset < UPSTREAM_KEY_SIZE - 8; p++) key[offset++] = tolower((unsigned char)*p);
+  snprintf(key + offset, UPSTREAM_KEY_SIZE - offset, ":%s", port);
+}
+static unsigned int hashKey(const char *key) {
+  unsigned int hash = 2166136261u; /* FNV-1a */
+  for(const unsigned char *p = (const unsigned char *)key; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+static upstreamHost *findHost(upstreamShard *pShard, const char *key, unsigned int hash) {
+  /* Caller holds the shard lock */
+  for(upstreamHost *p = pShard->buckets[(hash / UPSTREAM_SHARD_COUNT) % UPSTREAM_BUCKET_COUNT]; p != NULL; p = p->pBucketNext) {
+    if(p->hash == hash && !strcmp(p->key, key)) return p;
+  }
+  return NULL;
+}
+static upstreamHost *addHost(upstreamShard *pShard, const char *key, unsigned int hash) {
+  /* Caller holds the shard lock; "touchHost" puts it on the LRU list */
+  upstreamHost **pBucket = &pShard->buckets[(hash / UPSTREAM_SHARD_COUNT) % UPSTREAM_BUCKET_COUNT];
+  upstreamHost *pHost = Calloc(1, sizeof(upstreamHost));
+  strcpy(pHost->key, key);
+  pHost->hash = hash;
+  pHost->pBucketNext = *pBucket;
+  *pBucket = pHost;
+  pHost->pNext = pShard->pHead;
+  if(pShard->pHead != NULL) pShard->pHead->pPrevious = pHost;
+  pShard->pHead = pHost;
+  if(pShard->pTail == NULL) pShard->pTail = pHost;
+  pShard->hostCount++;
+  return pHost;
+}
+static int removeHost(upstreamShard *pShard, upstreamHost *pHost, int *closingfds) {
+  /* Caller holds the shard lock and closes the returned idle fds once it lets go */
+  int count = pHost->idleCount;
+  upstreamHost **pLink = &pShard->buckets[(pHost->hash / UPSTREAM_SHARD_COUNT) % UPSTREAM_BUCKET_COUNT];
+  while(*pLink != pHost) pLink = &(*pLink)->pBucketNext;
+  *pLink = pHost->pBucketNext;
+  if(pHost->pPrevious != NULL) pHost->pPrevious->pNext = pHost->pNext;
+  else pShard->pHead = pHost->pNext;
+  if(pHost->pNext != NULL) pHost->pNext->pPrevious = pHost->pPrevious;
+  else pShard->pTail = pHost->pPrevious;
+  pShard->hostCount--;
+  memcpy(closingfds, pHost->idlefds, count * sizeof(int));
+  Free(pHost);
+  return count;
+}
+static void touchHost(upstreamShard *pShard, upstreamHost *pHost, time_t now) {
+  /* Caller holds the shard lock: origins in use stay clear of eviction */
+  pHost->lastUsed = now;
+  if(pShard->pHead == pHost) return;
+  pHost->pPrevious->pNext = pHost->pNext;
+  if(pHost->pNext != NULL) pHost->pNext->pPrevious = pHost->pPrevious;
+  else pShard->pTail = pHost->pPrevious;
+  pHost->pPrevious = NULL;
+  pHost->pNext = pShard->pHead;
+  pShard->pHead->pPrevious = pHost;
+  pShard->pHead = pHost;
+}
+static int dropExpired(upstreamHost *pHost, time_t now, int *closingfds) {
+  /* Takes the connections idle past the timeout off the host, oldest first; returns how many the caller must close */
+  int count = 0;
+  while(count < pHost->idleCount && now - pHost->idleSince[count] > UPSTREAM_IDLE_TIMEOUT) {
+    closingfds[count] = pHost->idlefds[count];
+    count++;
+  }
+  pHost->idleCount -= count;
+  memmove(pHost->idlefds, pHost->idlefds + count, pHost->idleCount * sizeof(int));
+  memmove(pHost->idleSince, pHost->idleSince + count, pHost->idleCount * sizeof(time_t));
+  return count;
+}
+static void *sweepThread(void *pArgument) {
+  /* Closes what no acquire or release came back for: timed-out idle connections, then origins left with none */
+  int closingfds[UPSTREAM_MAX_HOSTS_PER_SHARD * UPSTREAM_MAX_IDLE_PER_HOST];
+  Pthread_detach(Pthread_self());
+  while(1) {
+    sleep(UPSTREAM_SWEEP_INTERVAL);
+    for(int i = 0; i < UPSTREAM_SHARD_COUNT; i++) {
+      upstreamShard *pShard = &shards[i];
+      time_t now = time(NULL);
+      int closingCount = 0;
+      pthread_mutex_lock(&pShard->lock);
+      upstreamHost *pHost = pShard->pTail;
+      while(pHost != NULL) {
+        upstreamHost *pPrevious = pHost->pPrevious;
+        closingCount += dropExpired(pHost, now, closingfds + closingCount);
+        if(pHost->idleCount == 0 && now - pHost->lastUsed > UPSTREAM_IDLE_TIMEOUT) removeHost(pShard, pHost, closingfds + closingCount);
+        pHost = pPrevious;
+      }
+      pthread_mutex_unlock(&pShard->lock);
+      for(int j = 0; j < closingCount; j++) close(closingfds[j]);
+    }
+  }
+  return NULL;
+}
+static int isAlive(int fd) {
+  /* An idle connection must have nothing to read: EOF or stray bytes mean the origin is done with it */
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,15 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#define UPSTREAM_SHARD_COUNT 8
+#define UPSTREAM_BUCKET_COUNT 64 /* Hash buckets per shard */
+#define UPSTREAM_MAX_IDLE_PER_HOST 8 /* Idle keep-alive connections kept per (host, port) */
+#define UPSTREAM_IDLE_TIMEOUT 30 /* Seconds an idle connection may wait before it is closed */
+#define UPSTREAM_MAX_HOSTS_PER_SHARD 8 /* Origins remembered per shard; the least recently used gives way, which bounds the idle fds */
+#define UPSTREAM_SWEEP_INTERVAL 5 /* Seconds between sweeps that close timed-out idle connections */
+
+void upstreamInit(void);
+int upstreamAcquire(const char *hostname, const char *port);
+void upstreamRelease(const char *hostname, const char *port, int fd);
+
+#endif